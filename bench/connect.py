@@ -0,0 +1,178 @@
+#!/usr/bin/env python3
+"""Connect-heavy benchmark for the -S socket options and the -u listener.
+
+Usage: bench/connect.py ./http-server [seconds] [clients]
+
+Starts the server once per configuration and has `clients` processes each
+open a connection, send one request, read the response and close, as fast as
+they can for `seconds`. Every configuration is run while 200 other clients sit
+connected without sending anything, which is what TCP_DEFER_ACCEPT is for, so
+the descriptors the server holds for them are reported as well.
+
+Fast Open is only used if the kernel allows it for both ends
+(net.ipv4.tcp_fastopen has bits 1 and 2 set); the fastopen rows otherwise
+measure an ordinary handshake. The cork rows fetch a file too big for the
+cache, since only streamed responses are corked. The unix socket row connects
+over -u instead of TCP.
+"""
+import multiprocessing
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+IDLE_CLIENTS = 200
+
+CONFIGS = [
+    ("default", [], b"/small.txt"),
+    ("backlog=4096", ["-S", "backlog=4096"], b"/small.txt"),
+    ("defer-accept=5", ["-S", "defer-accept=5"], b"/small.txt"),
+    ("fastopen=256", ["-S", "fastopen=256"], b"/small.txt"),
+    ("rcvbuf,sndbuf=256k", ["-S", "rcvbuf=262144", "-S", "sndbuf=262144"], b"/small.txt"),
+    ("unix socket", ["-u"], b"/small.txt"),
+    ("streamed", [], b"/large.bin"),
+    ("streamed, cork", ["-S", "cork"], b"/large.bin"),
+]
+
+
+def fastopen_enabled():
+    try:
+        with open("/proc/sys/net/ipv4/tcp_fastopen") as f:
+            return int(f.read()) & 3 == 3
+    except (OSError, ValueError):
+        return False
+
+
+def worker(address, target, seconds, fastopen, results):
+    req = b"GET " + target + b" HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+    latencies = []
+    first_bytes = []
+    errors = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        started = time.perf_counter()
+        s = socket.socket(socket.AF_UNIX if isinstance(address, str) else socket.AF_INET)
+        s.settimeout(5)
+        try:
+            if fastopen:
+                s.sendto(req, socket.MSG_FASTOPEN, address)
+            else:
+                s.connect(address)
+                s.sendall(req)
+            first = None
+            while True:
+                chunk = s.recv(262144)
+                if first is None:
+                    first = time.perf_counter()
+                if not chunk:
+                    break
+            latencies.append(time.perf_counter() - started)
+            first_bytes.append(first - started)
+        except OSError:
+            errors += 1
+        finally:
+            s.close()
+    results.put((latencies, first_bytes, errors))
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def fd_count(pid):
+    try:
+        return len(os.listdir(os.path.join("/proc", str(pid), "fd")))
+    except OSError:
+        return -1
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def run(binary, root, name, options, target, seconds, clients):
+    port = free_port()
+    address = ("127.0.0.1", port)
+    if options == ["-u"]:
+        address = os.path.join(root, "bench.sock")
+        options = ["-u", address]
+    proc = subprocess.Popen([binary, "-a", "127.0.0.1", "-p", str(port), "-d", root] + options,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    idle = []
+    try:
+        deadline = time.time() + 15
+        while time.time() < deadline:
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=0.5).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        time.sleep(0.2)
+        baseline = fd_count(proc.pid)
+        for _ in range(IDLE_CLIENTS):
+            c = socket.socket(socket.AF_UNIX if isinstance(address, str) else socket.AF_INET)
+            c.connect(address)
+            idle.append(c)
+        time.sleep(0.5)
+        idle_fds = fd_count(proc.pid) - baseline
+
+        fastopen = "fastopen" in name and fastopen_enabled()
+        results = multiprocessing.Queue()
+        workers = [multiprocessing.Process(target=worker,
+                                           args=(address, target, seconds, fastopen, results))
+                   for _ in range(clients)]
+        for w in workers:
+            w.start()
+        latencies, first_bytes, errors = [], [], 0
+        for _ in workers:
+            l, f, e = results.get()
+            latencies += l
+            first_bytes += f
+            errors += e
+        for w in workers:
+            w.join()
+    finally:
+        for s in idle:
+            s.close()
+        proc.terminate()
+        proc.wait()
+
+    print(f"{name:<20} {len(latencies) / seconds:>9.0f} {percentile(first_bytes, 0.5) * 1e3:>9.2f}"
+          f" {percentile(latencies, 0.5) * 1e3:>8.2f} {percentile(latencies, 0.99) * 1e3:>8.2f}"
+          f" {errors:>6} {idle_fds:>9}")
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 2
+    binary = os.path.abspath(sys.argv[1])
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 5.0
+    clients = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+
+    root = tempfile.mkdtemp(prefix="http-server-bench.")
+    with open(os.path.join(root, "small.txt"), "wb") as f:
+        f.write(b"x" * 512)
+    with open(os.path.join(root, "large.bin"), "wb") as f:
+        f.write(os.urandom(2 * 1024 * 1024))
+
+    print(f"{clients} clients, {seconds:g}s per row, {IDLE_CLIENTS} idle connections, "
+          f"Fast Open {'on' if fastopen_enabled() else 'off (sysctl)'}")
+    print(f"{'config':<20} {'conn/s':>9} {'ttfb p50':>9} {'p50 ms':>8} {'p99 ms':>8}"
+          f" {'errors':>6} {'idle fds':>9}")
+    for name, options, target in CONFIGS:
+        run(binary, root, name, options, target, seconds, clients)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
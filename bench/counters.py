@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""Per-request cost of the server from its CPU counters, for comparing commits.
+
+Usage: bench/counters.py ./http-server [requests] [--save FILE] [--compare FILE]
+
+Starts the server and sends it a fixed number of requests of each kind: cached
+hits on a keep-alive connection, cached hits on a connection each, 404s, and
+files streamed from disk. Around each kind it reads the server's counters with
+perf_event_open -- instructions, cycles and cache misses, or where the
+hardware ones are not available, as in most VMs, task clock, context switches
+and page faults -- and prints them divided by the number of requests. Each kind
+is run five times and the median kept.
+
+Unlike requests per second, instruction counts do not depend on how busy the
+machine is or how fast the client is, so a difference of a few percent between
+two builds is real. The software counters are far noisier. --save writes the results as JSON, and --compare prints the change from
+a saved run next to each number.
+
+Only the server's threads are counted, the client's work is not. Kernel time
+is included if perf_event_paranoid allows it (1 or lower), and the header says
+which.
+"""
+import argparse
+import ctypes
+import json
+import os
+import platform
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+ROUNDS = 5
+
+PERF_TYPE_HARDWARE = 0
+PERF_TYPE_SOFTWARE = 1
+HARDWARE = [("instructions", PERF_TYPE_HARDWARE, 1),
+            ("cycles", PERF_TYPE_HARDWARE, 0),
+            ("cache-misses", PERF_TYPE_HARDWARE, 3)]
+SOFTWARE = [("task-clock-ns", PERF_TYPE_SOFTWARE, 1),
+            ("context-switches", PERF_TYPE_SOFTWARE, 3),
+            ("page-faults", PERF_TYPE_SOFTWARE, 2)]
+
+# perf_event_attr flag bits.
+DISABLED = 1 << 0
+EXCLUDE_KERNEL = 1 << 5
+EXCLUDE_HV = 1 << 6
+
+PERF_EVENT_IOC_ENABLE = 0x2400
+PERF_EVENT_IOC_DISABLE = 0x2401
+PERF_EVENT_IOC_RESET = 0x2403
+
+SYS_PERF_EVENT_OPEN = {"x86_64": 298, "aarch64": 241, "i686": 336, "armv7l": 364}
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+
+class PerfEventAttr(ctypes.Structure):
+    # PERF_ATTR_SIZE_VER0; the kernel zero-fills the rest.
+    _fields_ = [("type", ctypes.c_uint32),
+                ("size", ctypes.c_uint32),
+                ("config", ctypes.c_uint64),
+                ("sample_period", ctypes.c_uint64),
+                ("sample_type", ctypes.c_uint64),
+                ("read_format", ctypes.c_uint64),
+                ("flags", ctypes.c_uint64),
+                ("wakeup_events", ctypes.c_uint32),
+                ("bp_type", ctypes.c_uint32),
+                ("config1", ctypes.c_uint64)]
+
+
+def perf_event_open(kind, config, tid, exclude_kernel):
+    attr = PerfEventAttr()
+    attr.type = kind
+    attr.size = ctypes.sizeof(PerfEventAttr)
+    attr.config = config
+    attr.flags = DISABLED | EXCLUDE_HV | (EXCLUDE_KERNEL if exclude_kernel else 0)
+    fd = libc.syscall(SYS_PERF_EVENT_OPEN[platform.machine()], ctypes.byref(attr),
+                      tid, -1, -1, 0)
+    if fd < 0:
+        raise OSError(ctypes.get_errno(), os.strerror(ctypes.get_errno()))
+    return fd
+
+
+class Counters:
+    """One set of events on every thread of a process.  Threads started after
+    this is set up are not counted, so the server is warmed up first, which
+    also starts libuv's thread pool."""
+
+    def __init__(self, pid):
+        self.fds = {}
+        last = None
+        for events in (HARDWARE, SOFTWARE):
+            for exclude_kernel in (False, True):
+                try:
+                    self.open(pid, events, exclude_kernel)
+                    self.events = events
+                    self.kernel = not exclude_kernel
+                    return
+                except OSError as e:
+                    self.close()
+                    last = e
+        raise SystemExit(f"perf_event_open: {last}")
+
+    def open(self, pid, events, exclude_kernel):
+        for tid in os.listdir(f"/proc/{pid}/task"):
+            for name, kind, config in events:
+                self.fds.setdefault(name, []).append(
+                    perf_event_open(kind, config, int(tid), exclude_kernel))
+
+    def close(self):
+        for fds in self.fds.values():
+            for fd in fds:
+                os.close(fd)
+        self.fds = {}
+
+    def ioctl(self, request):
+        for fds in self.fds.values():
+            for fd in fds:
+                libc.ioctl(fd, request, 0)
+
+    def measure(self, work):
+        self.ioctl(PERF_EVENT_IOC_RESET)
+        self.ioctl(PERF_EVENT_IOC_ENABLE)
+        work()
+        self.ioctl(PERF_EVENT_IOC_DISABLE)
+        return {name: sum(struct.unpack("Q", os.read(fd, 8))[0] for fd in fds)
+                for name, fds in self.fds.items()}
+
+
+def read_response(s):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = s.recv(262144)
+        if not chunk:
+            raise OSError("connection closed")
+        data += chunk
+    head, rest = data.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in head.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:"):
+            length = int(line.split(b":", 1)[1])
+    while len(rest) < length:
+        chunk = s.recv(262144)
+        if not chunk:
+            raise OSError("connection closed")
+        rest += chunk
+
+
+def keep_alive(port, target, n):
+    s = socket.create_connection(("127.0.0.1", port))
+    try:
+        for _ in range(n):
+            s.sendall(b"GET " + target + b" HTTP/1.1\r\nHost: x\r\n\r\n")
+            read_response(s)
+    finally:
+        s.close()
+
+
+def one_each(port, target, n):
+    for _ in range(n):
+        s = socket.create_connection(("127.0.0.1", port))
+        try:
+            s.sendall(b"GET " + target + b" HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+            read_response(s)
+        finally:
+            s.close()
+
+
+def kinds(port, n):
+    """(name, work, requests) for each kind; fewer of the streamed ones, which
+    are each 2 MB."""
+    streamed = max(1, n // 50)
+    return [("cached, keep-alive", lambda: keep_alive(port, b"/index.html", n), n),
+            ("cached, close", lambda: one_each(port, b"/index.html", n), n),
+            ("404, keep-alive", lambda: keep_alive(port, b"/nope.html", n), n),
+            ("streamed 2 MB", lambda: keep_alive(port, b"/big.bin", streamed), streamed)]
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def main():
+    parser = argparse.ArgumentParser(usage=__doc__.split("\n\n")[1])
+    parser.add_argument("binary")
+    parser.add_argument("requests", type=int, nargs="?", default=2000)
+    parser.add_argument("--save")
+    parser.add_argument("--compare")
+    args = parser.parse_args()
+
+    root = tempfile.mkdtemp(prefix="http-server-bench.")
+    with open(os.path.join(root, "index.html"), "wb") as f:
+        f.write(b"x" * 6000)
+    with open(os.path.join(root, "big.bin"), "wb") as f:
+        f.write(os.urandom(2 * 1024 * 1024))
+
+    port = free_port()
+    proc = subprocess.Popen([os.path.abspath(args.binary), "-a", "127.0.0.1", "-p", str(port),
+                             "-d", root], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    results = {}
+    try:
+        deadline = time.time() + 15
+        while time.time() < deadline:
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=0.5).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        for _, work, _ in kinds(port, 50):
+            work()
+
+        counters = Counters(proc.pid)
+        try:
+            for name, work, n in kinds(port, args.requests):
+                rounds = [counters.measure(work) for _ in range(ROUNDS)]
+                results[name] = {event: sorted(r[event] for r in rounds)[ROUNDS // 2] / n
+                                 for event, _, _ in counters.events}
+        finally:
+            counters.close()
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    baseline = None
+    if args.compare:
+        with open(args.compare) as f:
+            baseline = json.load(f)
+
+    events = [event for event, _, _ in counters.events]
+    print(f"per request, median of {ROUNDS} rounds of {args.requests}"
+          f" (streamed: {max(1, args.requests // 50)}), "
+          f"{'user and kernel' if counters.kernel else 'user space only'}")
+    print(f"{'kind':<20}" + "".join(f" {e:>22}" for e in events))
+    for name, values in results.items():
+        line = f"{name:<20}"
+        for event in events:
+            cell = f"{values[event]:.0f}"
+            old = (baseline or {}).get(name, {}).get(event)
+            if old:
+                cell += f" ({(values[event] - old) / old * 100:+.1f}%)"
+            line += f" {cell:>22}"
+        print(line)
+
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(results, f, indent=2)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
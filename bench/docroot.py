@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""Synthetic document root and request trace, for bench/replay.py.
+
+Usage: bench/docroot.py ROOT [--trace FILE] [--files N] [--requests N]
+                        [--zipf S] [--rate R] [--missing F] [--max-size BYTES]
+                        [--seed N]
+
+Fills ROOT with N files (2000 by default) whose sizes follow the usual model
+of web objects: lognormal for the body of the distribution, with a median
+around 10 KB, and a Pareto tail above 130 KB for about one file in fifteen,
+capped at --max-size (64 MB). The extension follows the size, so small files
+are markup, scripts and styles and large ones images and downloads. Contents
+are random, so no two files share a cached body.
+
+With --trace it also writes a request trace in the format the server's -t
+writes. Files are requested with Zipf popularity (exponent --zipf, 0.8 by
+default) in a random order unrelated to their size. Requests arrive as a
+Poisson process at --rate per second. A fraction --missing of them, 2% by
+default, is for paths that do not exist, drawn from a small set the way
+scanners and broken links repeat themselves. The bytes column gives the
+size of the body, not of the whole response.
+
+The same seed gives the same tree and trace.
+"""
+import argparse
+import bisect
+import math
+import os
+import random
+import sys
+
+# Lognormal body and Pareto tail, in bytes, after Barford and Crovella's
+# SURGE model of web file sizes.
+BODY_MU = 9.357
+BODY_SIGMA = 1.318
+TAIL_SHARE = 0.07
+TAIL_MIN = 133 * 1024
+TAIL_ALPHA = 1.1
+
+MISSING_NAMES = 50
+
+
+def file_size(rng, cap):
+    if rng.random() < TAIL_SHARE:
+        size = TAIL_MIN / (1.0 - rng.random()) ** (1.0 / TAIL_ALPHA)
+    else:
+        size = rng.lognormvariate(BODY_MU, BODY_SIGMA)
+    return max(1, min(int(size), cap))
+
+
+def extension(rng, size):
+    if size < 16 * 1024:
+        return rng.choice([".html", ".css", ".js", ".txt"])
+    if size < 1024 * 1024:
+        return rng.choice([".png", ".jpg", ".gif", ".js"])
+    return rng.choice([".jpg", ".bin"])
+
+
+def zipf_cdf(n, s):
+    weights = [1.0 / (rank ** s) for rank in range(1, n + 1)]
+    total = sum(weights)
+    cdf, acc = [], 0.0
+    for w in weights:
+        acc += w / total
+        cdf.append(acc)
+    return cdf
+
+
+def pick(rng, cdf):
+    return min(bisect.bisect_left(cdf, rng.random()), len(cdf) - 1)
+
+
+def main():
+    parser = argparse.ArgumentParser(usage=__doc__.split("\n\n")[1])
+    parser.add_argument("root")
+    parser.add_argument("--trace")
+    parser.add_argument("--files", type=int, default=2000)
+    parser.add_argument("--requests", type=int, default=100000)
+    parser.add_argument("--zipf", type=float, default=0.8)
+    parser.add_argument("--rate", type=float, default=2000.0)
+    parser.add_argument("--missing", type=float, default=0.02)
+    parser.add_argument("--max-size", type=int, default=64 * 1024 * 1024)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    if args.files < 1 or args.requests < 0 or args.rate <= 0 or not 0 <= args.missing <= 1:
+        parser.error("--files has to be positive, --rate positive and --missing from 0 to 1")
+
+    rng = random.Random(args.seed)
+    dirs = max(1, int(math.sqrt(args.files) / 2))
+    files = []
+    total = 0
+    for i in range(args.files):
+        size = file_size(rng, args.max_size)
+        path = f"/d{i % dirs:03d}/f{i:06d}{extension(rng, size)}"
+        full = os.path.join(args.root, path.lstrip("/"))
+        os.makedirs(os.path.dirname(full), exist_ok=True)
+        with open(full, "wb") as f:
+            left = size
+            while left > 0:
+                chunk = min(left, 1 << 20)
+                f.write(rng.randbytes(chunk))
+                left -= chunk
+        files.append((path, size))
+        total += size
+
+    sizes = sorted(size for _, size in files)
+    print(f"{len(files)} files in {dirs} directories, {total / 1e6:.1f} MB;"
+          f" median {sizes[len(sizes) // 2]} bytes, largest {sizes[-1]}")
+
+    if args.trace:
+        # Popularity is independent of size: rank r is a random file.
+        by_rank = files[:]
+        rng.shuffle(by_rank)
+        cdf = zipf_cdf(len(by_rank), args.zipf)
+        missing_cdf = zipf_cdf(MISSING_NAMES, 1.0)
+        now = 0.0
+        hit_bytes = 0
+        with open(args.trace, "w") as f:
+            f.write("# usec\tstatus\tbytes\tmethod\ttarget\n")
+            for _ in range(args.requests):
+                now += rng.expovariate(args.rate)
+                if rng.random() < args.missing:
+                    target, status, size = f"/missing/{pick(rng, missing_cdf):03d}.html", 404, 0
+                else:
+                    target, size = by_rank[pick(rng, cdf)]
+                    status = 200
+                    hit_bytes += size
+                f.write(f"{int(now * 1e6)}\t{status}\t{size}\tGET\t{target}\n")
+        print(f"{args.requests} requests over {now:.1f}s, {hit_bytes / 1e6:.1f} MB of bodies"
+              f" -> {args.trace}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
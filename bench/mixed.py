@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+"""Small-request latency while large downloads run, for the -W write scheduler.
+
+Usage: bench/mixed.py ./http-server [seconds] [small clients] [large clients]
+
+Starts the server once per configuration. `small clients` processes send 1 KB
+requests over keep-alive connections and time each one. Alongside them, half
+of `large clients` pull a 500 MB file (streamed from disk) and half repeatedly
+pull a 1 MB one (sent from the cache), all reading as fast as they can. Prints
+the small-request percentiles and the bytes the large clients got through.
+
+The 500 MB file is sparse, so it costs no disk space and reads from the page
+cache; what is measured is the server's write path, not the disk.
+"""
+import multiprocessing
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+CONFIGS = [
+    ("default (whole writes)", []),
+    ("-W 65536", ["-W", "65536"]),
+    ("-W 16384", ["-W", "16384"]),
+    ("-W 65536,50000000", ["-W", "65536,50000000"]),
+]
+
+
+def small_client(port, seconds, results):
+    req = b"GET /small.txt HTTP/1.1\r\nHost: x\r\n\r\n"
+    latencies = []
+    deadline = time.time() + seconds
+    s = socket.create_connection(("127.0.0.1", port))
+    try:
+        while time.time() < deadline:
+            started = time.perf_counter()
+            s.sendall(req)
+            data = b""
+            while not data.endswith(b"x" * 1024):
+                chunk = s.recv(65536)
+                if not chunk:
+                    raise OSError("closed")
+                data += chunk
+            latencies.append(time.perf_counter() - started)
+    finally:
+        s.close()
+    results.put(("small", latencies))
+
+
+def large_client(port, target, seconds, results):
+    req = b"GET " + target + b" HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"
+    got = 0
+    deadline = time.time() + seconds
+    while time.time() < deadline:
+        s = socket.create_connection(("127.0.0.1", port))
+        s.settimeout(5)
+        try:
+            s.sendall(req)
+            while time.time() < deadline:
+                chunk = s.recv(1 << 20)
+                if not chunk:
+                    break
+                got += len(chunk)
+        except OSError:
+            pass
+        finally:
+            s.close()
+    results.put(("large", got))
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def run(binary, root, name, options, seconds, small, large):
+    port = free_port()
+    proc = subprocess.Popen([binary, "-a", "127.0.0.1", "-p", str(port), "-d", root] + options,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        deadline = time.time() + 15
+        while time.time() < deadline:
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=0.5).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+
+        results = multiprocessing.Queue()
+        procs = [multiprocessing.Process(target=small_client, args=(port, seconds, results))
+                 for _ in range(small)]
+        procs += [multiprocessing.Process(target=large_client,
+                                          args=(port, b"/huge.bin" if i % 2 == 0 else b"/cached.bin",
+                                                seconds, results))
+                  for i in range(large)]
+        for p in procs:
+            p.start()
+        latencies, moved = [], 0
+        for _ in procs:
+            kind, value = results.get()
+            if kind == "small":
+                latencies += value
+            else:
+                moved += value
+        for p in procs:
+            p.join()
+    finally:
+        proc.terminate()
+        proc.wait()
+
+    print(f"{name:<22} {len(latencies) / seconds:>8.0f} {percentile(latencies, 0.5) * 1e3:>8.2f}"
+          f" {percentile(latencies, 0.99) * 1e3:>8.2f} {percentile(latencies, 0.999) * 1e3:>8.2f}"
+          f" {moved / seconds / 1e6:>9.0f}")
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 2
+    binary = os.path.abspath(sys.argv[1])
+    seconds = float(sys.argv[2]) if len(sys.argv) > 2 else 10.0
+    small = int(sys.argv[3]) if len(sys.argv) > 3 else 8
+    large = int(sys.argv[4]) if len(sys.argv) > 4 else 4
+
+    root = tempfile.mkdtemp(prefix="http-server-bench.")
+    with open(os.path.join(root, "small.txt"), "wb") as f:
+        f.write(b"x" * 1024)
+    with open(os.path.join(root, "cached.bin"), "wb") as f:
+        f.write(os.urandom(1000 * 1000))
+    with open(os.path.join(root, "huge.bin"), "wb") as f:
+        f.truncate(500 * 1000 * 1000)
+
+    print(f"{small} small clients, {large} large, {seconds:g}s per row")
+    print(f"{'config':<22} {'small/s':>8} {'p50 ms':>8} {'p99 ms':>8} {'p99.9 ms':>8} {'large MB/s':>9}")
+    for name, options in CONFIGS:
+        run(binary, root, name, options, seconds, small, large)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
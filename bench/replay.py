@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+"""Replays a request trace against a running server.
+
+Usage: bench/replay.py TRACE PORT [--host HOST] [--speed X]
+                       [--connections N] [--limit N]
+
+TRACE is what the server writes with -t, or what bench/docroot.py generates
+with its tree. Each request is sent when it is due, at the trace's own pace
+times --speed (2 is twice as fast). --speed 0 sends them as fast as the
+connections allow. They go out over --connections keep-alive connections (8
+by default), each taking the next request due, so a slow response holds up
+its own connection and not the others.
+
+Latency is measured from when a request was due. When the server, or this
+script, falls behind, the wait is counted too, the way a real client would
+see it. With --speed 0 nothing is due, and it is measured from the send.
+
+Prints requests per second, bytes received, latency percentiles and the
+statuses. A status that differs from the trace is counted as a mismatch:
+a 404 that used to be a 200 means the tree is not the one traced.
+
+The client is a Python script and tops out at a few thousand requests per
+second. Use more connections, or several copies on parts of the trace, to
+go past that.
+"""
+import argparse
+import collections
+import queue
+import socket
+import sys
+import threading
+import time
+
+
+def load(path, limit):
+    requests = []
+    with open(path) as f:
+        for line in f:
+            if line.startswith("#") or not line.strip():
+                continue
+            fields = line.rstrip("\n").split("\t")
+            if len(fields) != 5:
+                raise SystemExit(f"{path}: not a trace line: {line!r}")
+            usec, status, _, method, target = fields
+            requests.append((int(usec), int(status), method, target))
+            if limit and len(requests) == limit:
+                break
+    return requests
+
+
+def read_response(s, head_only):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = s.recv(262144)
+        if not chunk:
+            raise OSError("connection closed")
+        data += chunk
+    head, rest = data.split(b"\r\n\r\n", 1)
+    lines = head.split(b"\r\n")
+    status = int(lines[0].split()[1])
+    length = 0
+    close = False
+    for line in lines[1:]:
+        name, _, value = line.partition(b":")
+        name = name.strip().lower()
+        if name == b"content-length":
+            length = int(value)
+        elif name == b"connection":
+            close = value.strip().lower() == b"close"
+    if head_only:
+        length = 0
+    got = len(rest)
+    while got < length:
+        chunk = s.recv(262144)
+        if not chunk:
+            raise OSError("connection closed")
+        got += len(chunk)
+    return status, len(head) + 4 + length, close
+
+
+def worker(host, port, jobs, results):
+    s = None
+    while True:
+        job = jobs.get()
+        if job is None:
+            break
+        due, want, method, target = job
+        if due is None:
+            due = time.perf_counter()
+        for attempt in range(2):
+            try:
+                if s is None:
+                    s = socket.create_connection((host, port))
+                s.sendall(f"{method} {target} HTTP/1.1\r\nHost: {host}\r\n\r\n".encode("latin-1"))
+                status, size, close = read_response(s, method == "HEAD")
+                results.append((time.perf_counter() - due, status, want, size))
+                if close:
+                    s.close()
+                    s = None
+                break
+            except OSError:
+                # A keep-alive connection the server has closed is retried
+                # once on a new one.
+                if s is not None:
+                    s.close()
+                    s = None
+                if attempt == 1:
+                    results.append((time.perf_counter() - due, 0, want, 0))
+    if s is not None:
+        s.close()
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(len(values) * p))]
+
+
+def main():
+    parser = argparse.ArgumentParser(usage=__doc__.split("\n\n")[1])
+    parser.add_argument("trace")
+    parser.add_argument("port", type=int)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--speed", type=float, default=1.0)
+    parser.add_argument("--connections", type=int, default=8)
+    parser.add_argument("--limit", type=int, default=0)
+    args = parser.parse_args()
+
+    requests = load(args.trace, args.limit)
+    if not requests:
+        raise SystemExit(f"{args.trace}: no requests")
+    first = requests[0][0]
+
+    jobs = queue.Queue(maxsize=args.connections * 4)
+    results = []
+    threads = [threading.Thread(target=worker, args=(args.host, args.port, jobs, results))
+               for _ in range(args.connections)]
+    for t in threads:
+        t.start()
+
+    started = time.perf_counter()
+    for usec, want, method, target in requests:
+        if args.speed > 0:
+            due = started + (usec - first) / 1e6 / args.speed
+            wait = due - time.perf_counter()
+            if wait > 0:
+                time.sleep(wait)
+        else:
+            due = None
+        jobs.put((due, want, method, target))
+    for _ in threads:
+        jobs.put(None)
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - started
+
+    latencies = sorted(r[0] for r in results)
+    statuses = collections.Counter(r[1] for r in results)
+    mismatched = sum(1 for r in results if r[2] and r[1] != r[2])
+    received = sum(r[3] for r in results)
+    traced = (requests[-1][0] - first) / 1e6
+    print(f"{len(results)} requests in {elapsed:.2f}s (traced over {traced:.2f}s),"
+          f" {len(results) / elapsed:.0f}/s, {received / elapsed / 1e6:.1f} MB/s")
+    print(f"latency ms: p50 {percentile(latencies, 0.5) * 1e3:.2f}"
+          f"  p90 {percentile(latencies, 0.9) * 1e3:.2f}"
+          f"  p99 {percentile(latencies, 0.99) * 1e3:.2f}"
+          f"  p99.9 {percentile(latencies, 0.999) * 1e3:.2f}"
+          f"  max {latencies[-1] * 1e3:.2f}")
+    print("status: " + "  ".join(f"{status or 'failed'} {n}" for status, n in sorted(statuses.items())))
+    print(f"status differing from the trace: {mismatched}")
+    return 1 if statuses.get(0) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
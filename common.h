@@ -0,0 +1,189 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _COMMON_H_
+#define _COMMON_H_
+
+/* What the server and the tools built alongside it have to agree on, so that
+ * a response rendered ahead of time by one is byte for byte what the other
+ * would have rendered itself. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+/* Content types by file extension.  Anything not listed is served as
+ * application/octet-stream. */
+static const struct {
+  const char* ext;
+  const char* type;
+} default_mime_types[] = {
+  { ".jpg", "image/jpeg" },
+  { ".png", "image/png" },
+  { ".gif", "image/gif" },
+  { ".html", "text/html" },
+  { ".css", "text/css" },
+  { ".txt", "text/plain" },
+  { ".js", "text/javascript" },
+};
+
+#define DEFAULT_CONTENT_TYPE "application/octet-stream"
+
+/* The extension a type is looked up by: everything from the last dot of the
+ * path on, or the whole path if it has none. */
+static const char*
+path_extension(const char* path) {
+  const char* dot = path;
+  const char* ptr = dot;
+  while (dot) {
+    ptr = dot;
+    dot = strchr(dot + 1, '.');
+  }
+  return ptr;
+}
+
+/* Cache-Control, by path, rendered into the headers along with everything
+ * else.  A rule is PATTERN=VALUE: a pattern starting with '/' covers paths
+ * starting with it, one starting with '.' files with that extension, and the
+ * first rule that matches applies.  A fingerprinted file name, one with a
+ * content hash in it like app.3f2a9c1b.js, names contents that never change,
+ * so where no rule matches it is cached for a year.  Anything else gets no
+ * Cache-Control at all. */
+#define MAX_CACHE_RULES 64
+#define MAX_CACHE_CONTROL 256
+/* Room for the whole header line. */
+#define CACHE_CONTROL_LINE_MAX (MAX_CACHE_CONTROL + sizeof("Cache-Control: \r\n"))
+#define FINGERPRINT_CACHE_CONTROL "public, max-age=31536000, immutable"
+
+typedef struct {
+  const char* pattern;
+  size_t pattern_len;
+  const char* value;
+} cache_rule;
+
+static cache_rule cache_rules[MAX_CACHE_RULES];
+static size_t ncache_rules;
+
+/* Adds a rule from an argument, which has to stay valid.  Returns -1 if it is
+ * malformed or there are too many. */
+static int
+add_cache_rule(const char* arg) {
+  const char* eq = strchr(arg, '=');
+  const char* p;
+  if (eq == NULL || eq == arg || (arg[0] != '/' && arg[0] != '.') ||
+      eq[1] == '\0' || strlen(eq + 1) > MAX_CACHE_CONTROL || ncache_rules == MAX_CACHE_RULES)
+    return -1;
+  /* The value goes into the header as it is. */
+  for (p = eq + 1; *p; p++)
+    if ((unsigned char) *p < 0x20 || *p == 0x7f)
+      return -1;
+  cache_rules[ncache_rules].pattern = arg;
+  cache_rules[ncache_rules].pattern_len = (size_t) (eq - arg);
+  cache_rules[ncache_rules].value = eq + 1;
+  ncache_rules++;
+  return 0;
+}
+
+/* Whether the file name has a part of at least eight lowercase hex digits,
+ * with both letters and digits among them, after a dot or dash and ahead of
+ * its extension, the way bundlers name their output: name.HASH.ext or
+ * name-HASH.ext.  The first part is the name itself, so feed2023.xml is not
+ * taken for a hash. */
+static int
+path_is_fingerprinted(const char* path) {
+  const char* name = strrchr(path, '/');
+  const char* ext;
+  const char* p;
+
+  name = name ? name + 1 : path;
+  ext = strrchr(name, '.');
+  if (ext == NULL)
+    return 0;
+  for (p = name + strcspn(name, ".-"); p < ext; ) {
+    const char* start = ++p;
+    int digits = 0, letters = 0, hex = 1;
+    for (; p < ext && *p != '.' && *p != '-'; p++) {
+      if (*p >= '0' && *p <= '9')
+        digits = 1;
+      else if (*p >= 'a' && *p <= 'f')
+        letters = 1;
+      else
+        hex = 0;
+    }
+    if (hex && digits && letters && p - start >= 8)
+      return 1;
+  }
+  return 0;
+}
+
+/* The Cache-Control value for a path below the document root, starting with
+ * '/', or NULL for none. */
+static const char*
+cache_control_for(const char* path) {
+  const char* name = strrchr(path, '/');
+  const char* ext;
+  size_t i;
+
+  name = name ? name + 1 : path;
+  ext = strrchr(name, '.');
+  for (i = 0; i < ncache_rules; i++) {
+    const cache_rule* rule = &cache_rules[i];
+    if (rule->pattern[0] == '/' ? !strncmp(path, rule->pattern, rule->pattern_len)
+        : ext != NULL && strlen(ext) == rule->pattern_len && !memcmp(ext, rule->pattern, rule->pattern_len))
+      return rule->value;
+  }
+  if (path_is_fingerprinted(path))
+    return FINGERPRINT_CACHE_CONTROL;
+  return NULL;
+}
+
+/* The Cache-Control header line for path, or an empty string. */
+static void
+render_cache_control(char* buf, size_t cap, const char* path) {
+  const char* value = cache_control_for(path);
+  if (value == NULL)
+    buf[0] = '\0';
+  else
+    snprintf(buf, cap, "Cache-Control: %s\r\n", value);
+}
+
+/* Header of a 200 response.  extra is inserted as is ahead of Connection and
+ * has to be empty or end in CRLF.  Returns what snprintf returns, so a result
+ * not below cap means the header did not fit. */
+static int
+render_ok_header(char* buf, size_t cap, uint64_t body_len, const char* ctype, const char* extra, int keep_alive) {
+  return snprintf(buf,
+      cap,
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: %" PRIu64 "\r\n"
+      "Content-Type: %s\r\n"
+      "%s"
+      "Connection: %s\r\n"
+      "\r\n",
+      body_len,
+      ctype,
+      extra,
+      keep_alive ? "keep-alive" : "close");
+}
+
+#endif
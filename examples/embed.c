@@ -0,0 +1,171 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+
+#include "server.h"
+
+/* A program serving endpoints of its own alongside the files, from handlers
+ * on the server's loop rather than in another process behind it.  It takes
+ * http-server's options.
+ *
+ *   /healthz      a constant, sent without copying
+ *   /config       rendered per request
+ *   /latest       whichever file is current, from the file cache
+ *   /slow         answered from a timer, after the handler has returned
+ *   /api/echo     the query string, from a copy of its own that is freed once
+ *                 sent; anything else under /api/ is left to the files */
+
+static uv_loop_t* loop;
+static uint64_t started_at;
+static uint64_t handled;
+
+static int
+on_health(http_request* request, void* data) {
+  static const char ok[] = "ok\n";
+  (void) data;
+  handled++;
+  http_respond_nocopy(request, 200, "text/plain", "Cache-Control: no-store\r\n", ok, sizeof(ok) - 1, NULL, NULL);
+  return 0;
+}
+
+static int
+on_config(http_request* request, void* data) {
+  const char* version = data;
+  char body[256];
+  int n;
+
+  handled++;
+  n = snprintf(body, sizeof(body), "{\"version\":\"%s\",\"uptime_ms\":%" PRIu64 ",\"handled\":%" PRIu64 "}\n",
+      version, uv_now(loop) - started_at, handled);
+  if (n < 0 || (size_t) n >= sizeof(body)) {
+    http_respond_nocopy(request, 500, NULL, NULL, "", 0, NULL, NULL);
+    return 0;
+  }
+  http_respond(request, 200, "application/json", "Cache-Control: no-store\r\n", body, (size_t) n);
+  return 0;
+}
+
+static int
+on_latest(http_request* request, void* data) {
+  (void) data;
+  handled++;
+  http_respond_file(request, "/index.html");
+  return 0;
+}
+
+static void
+on_slow_close(uv_handle_t* handle) {
+  free(handle);
+}
+
+static void
+on_slow_timer(uv_timer_t* timer) {
+  static const char body[] = "done\n";
+  http_respond_nocopy(timer->data, 200, NULL, NULL, body, sizeof(body) - 1, NULL, NULL);
+  uv_close((uv_handle_t*) timer, on_slow_close);
+}
+
+static int
+on_slow(http_request* request, void* data) {
+  uv_timer_t* timer = malloc(sizeof(*timer));
+  (void) data;
+  handled++;
+  if (timer == NULL || uv_timer_init(loop, timer)) {
+    free(timer);
+    http_respond_nocopy(request, 503, NULL, NULL, "", 0, NULL, NULL);
+    return 0;
+  }
+  timer->data = request;
+  uv_timer_start(timer, on_slow_timer, 50, 0);
+  return 0;
+}
+
+/* The query string lies in the server's read buffer, which is reused once
+ * the request is answered, so a body that outlives the call is a copy: the
+ * server hands it back to free() when it has been sent. */
+static int
+on_api(http_request* request, void* data) {
+  char* body;
+  (void) data;
+  if (request->path_len != 9 || memcmp(request->path, "/api/echo", 9))
+    return -1;
+  handled++;
+  body = malloc(request->query_len + 1);
+  if (body == NULL) {
+    http_respond_nocopy(request, 503, NULL, NULL, "", 0, NULL, NULL);
+    return 0;
+  }
+  if (request->query_len > 0)
+    memcpy(body, request->query, request->query_len);
+  http_respond_nocopy(request, 200, NULL, NULL, body, request->query_len, free, body);
+  return 0;
+}
+
+/* Stops the server and lets what it has in flight finish: with the signal
+ * handle gone too, uv_run returns once the last response has gone out. */
+static void
+on_signal(uv_signal_t* handle, int signum) {
+  (void) signum;
+  http_server_stop();
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+int
+main(int argc, char* argv[]) {
+  uv_signal_t sig;
+  int r;
+
+  http_server_route("/healthz", on_health, NULL);
+  http_server_route("/config", on_config, (void*) "1.0");
+  http_server_route("/latest", on_latest, NULL);
+  http_server_route("/slow", on_slow, NULL);
+  http_server_route("/api/*", on_api, NULL);
+
+  loop = uv_default_loop();
+  started_at = uv_now(loop);
+  r = http_server_start(loop, argc, argv);
+  if (r == 2)
+    http_server_usage(argv[0]);
+  if (r)
+    return 1;
+
+#ifdef SIGPIPE
+  signal(SIGPIPE, SIG_IGN);
+#endif
+  uv_signal_init(loop, &sig);
+  uv_signal_start(&sig, on_signal, SIGINT);
+
+  uv_run(loop, UV_RUN_DEFAULT);
+  r = uv_loop_close(loop);
+  if (r) {
+    fprintf(stderr, "Loop close error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    return 1;
+  }
+  return 0;
+}
+
+/* vim:set et ts=2 sw=2 cino=>2: */
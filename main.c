@@ -0,0 +1,77 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include "server.h"
+
+/* The http-server program: the library, serving until interrupted. */
+
+static void
+on_signal(uv_signal_t* handle, int signum) {
+  (void) signum;
+  uv_stop((uv_loop_t*) handle->data);
+}
+
+int
+main(int argc, char* argv[]) {
+  uv_loop_t* loop = uv_default_loop();
+  int r;
+
+  r = http_server_start(loop, argc, argv);
+  if (r == 2)
+    http_server_usage(argv[0]);
+  if (r)
+    return 1;
+
+  uv_signal_t sig;
+  r = uv_signal_init(loop, &sig);
+  if (r) {
+    fprintf(stderr, "Signal error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    return 1;
+  }
+  sig.data = loop;
+  r = uv_signal_start(&sig, on_signal, SIGINT);
+  if (r) {
+    fprintf(stderr, "Signal error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    return 1;
+  }
+
+#ifdef SIGPIPE
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = SIG_IGN;
+  act.sa_flags = SA_RESTART;
+  if (sigaction(SIGPIPE, &act, NULL)) {
+    fprintf(stderr, "cannot ignore SIGPIPE\n");
+    return 1;
+  }
+#endif
+
+  r = uv_run(loop, UV_RUN_DEFAULT);
+  http_server_stop();
+  return r;
+}
+
+/* vim:set et ts=2 sw=2 cino=>2: */
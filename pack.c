@@ -0,0 +1,388 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Packs a document root into a site pack (see site_pack.h) for the server to
+ * map with -P: every file read, its response headers rendered and, with -z,
+ * a gzip variant compressed, all ahead of time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB
+# include <zlib.h>
+#endif
+#include "common.h"
+#include "site_pack.h"
+
+/* Deep enough for any real tree, and a bound on a symlink loop. */
+#define MAX_DEPTH 64
+
+typedef struct {
+  char* url;
+  char* fs_path;
+  site_pack_slot slot;
+} pack_file;
+
+static pack_file* files;
+static size_t nfiles;
+static size_t files_cap;
+#ifdef HAVE_ZLIB
+static int use_gzip = 0;
+#endif
+
+static void
+usage(const char* app) {
+  fprintf(stderr, "usage: %s [OPTIONS] DIR PACK\n", app);
+#ifdef HAVE_ZLIB
+  fprintf(stderr, "    -z: also store gzip variants of files it makes smaller\n");
+#endif
+  fprintf(stderr, "    -c PATTERN=VALUE: Cache-Control rule, as for http-server -c\n");
+  exit(1);
+}
+
+static int
+add_file(const char* url, const char* fs_path) {
+  if (nfiles == files_cap) {
+    size_t cap = files_cap ? files_cap * 2 : 256;
+    pack_file* grown = realloc(files, cap * sizeof(pack_file));
+    if (grown == NULL)
+      return -1;
+    files = grown;
+    files_cap = cap;
+  }
+  memset(&files[nfiles], 0, sizeof(pack_file));
+  files[nfiles].url = strdup(url);
+  files[nfiles].fs_path = strdup(fs_path);
+  if (files[nfiles].url == NULL || files[nfiles].fs_path == NULL)
+    return -1;
+  nfiles++;
+  return 0;
+}
+
+/* Collects every regular file below dir, following links the way serving
+ * them would. */
+static int
+walk(const char* dir, const char* url, int depth) {
+  DIR* d;
+  struct dirent* ent;
+
+  if (depth > MAX_DEPTH) {
+    fprintf(stderr, "Too deep, skipped: %s\n", dir);
+    return 0;
+  }
+  d = opendir(dir);
+  if (d == NULL) {
+    fprintf(stderr, "Open error: %s: %s\n", dir, strerror(errno));
+    return -1;
+  }
+  while ((ent = readdir(d)) != NULL) {
+    char fs_path[PATH_MAX];
+    char child_url[PATH_MAX];
+    struct stat st;
+
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+    if (snprintf(fs_path, sizeof(fs_path), "%s/%s", dir, ent->d_name) >= (int) sizeof(fs_path) ||
+        snprintf(child_url, sizeof(child_url), "%s/%s", url, ent->d_name) >= (int) sizeof(child_url)) {
+      fprintf(stderr, "Path too long, skipped: %s/%s\n", dir, ent->d_name);
+      continue;
+    }
+    if (stat(fs_path, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      if (walk(fs_path, child_url, depth + 1)) {
+        closedir(d);
+        return -1;
+      }
+    } else if (S_ISREG(st.st_mode)) {
+      if (st.st_size > SITE_PACK_MAX_BODY) {
+        fprintf(stderr, "Too large, skipped: %s\n", fs_path);
+        continue;
+      }
+      if (add_file(child_url, fs_path)) {
+        fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+        closedir(d);
+        return -1;
+      }
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+static int
+compare_files(const void* a, const void* b) {
+  return strcmp(((const pack_file*) a)->url, ((const pack_file*) b)->url);
+}
+
+static char*
+read_file(const char* path, size_t* len) {
+  FILE* f = fopen(path, "rb");
+  struct stat st;
+  char* data;
+
+  if (f == NULL)
+    return NULL;
+  if (fstat(fileno(f), &st) != 0) {
+    fclose(f);
+    return NULL;
+  }
+  /* One extra byte, so an empty file still gets a pointer to free. */
+  data = malloc((size_t) st.st_size + 1);
+  if (data == NULL || fread(data, 1, (size_t) st.st_size, f) != (size_t) st.st_size) {
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  *len = (size_t) st.st_size;
+  return data;
+}
+
+#ifdef HAVE_ZLIB
+static char*
+gzip_data(const char* data, size_t len, size_t* out_len) {
+  z_stream z;
+  char* out;
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+  *out_len = deflateBound(&z, len);
+  out = malloc(*out_len);
+  if (out == NULL) {
+    deflateEnd(&z);
+    return NULL;
+  }
+  z.next_in = (Bytef*) data;
+  z.avail_in = (uInt) len;
+  z.next_out = (Bytef*) out;
+  z.avail_out = (uInt) *out_len;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&z);
+    free(out);
+    return NULL;
+  }
+  *out_len = z.total_out;
+  deflateEnd(&z);
+  return out;
+}
+#endif
+
+static uint64_t offset;
+
+static int
+emit(FILE* out, const void* data, size_t len, site_pack_span* span) {
+  span->offset = offset;
+  span->len = len;
+  if (len > 0 && fwrite(data, 1, len, out) != len)
+    return -1;
+  offset += len;
+  return 0;
+}
+
+static int
+emit_variant(FILE* out, const char* data, size_t len, const char* ctype, const char* extra, site_pack_variant* v) {
+  char header[1024];
+  int n;
+
+  n = render_ok_header(header, sizeof(header), len, ctype, extra, 0);
+  if (n < 0 || (size_t) n >= sizeof(header) || emit(out, header, (size_t) n, &v->header_close))
+    return -1;
+  n = render_ok_header(header, sizeof(header), len, ctype, extra, 1);
+  if (n < 0 || (size_t) n >= sizeof(header) || emit(out, header, (size_t) n, &v->header_keep_alive))
+    return -1;
+  return emit(out, data, len, &v->body);
+}
+
+static const char*
+content_type(const char* path) {
+  const char* ext = path_extension(path);
+  size_t i;
+  for (i = 0; i < sizeof(default_mime_types) / sizeof(default_mime_types[0]); i++)
+    if (!strcmp(default_mime_types[i].ext, ext))
+      return default_mime_types[i].type;
+  return DEFAULT_CONTENT_TYPE;
+}
+
+static int
+emit_file(FILE* out, pack_file* file) {
+  size_t len = 0;
+  char* data = read_file(file->fs_path, &len);
+  char* gz = NULL;
+  size_t gz_len = 0;
+  const char* ctype = content_type(file->url);
+  char cache_control[CACHE_CONTROL_LINE_MAX];
+  char extra[CACHE_CONTROL_LINE_MAX + 64];
+  int r;
+
+  if (data == NULL) {
+    fprintf(stderr, "Read error: %s: %s\n", file->fs_path, strerror(errno));
+    return -1;
+  }
+#ifdef HAVE_ZLIB
+  if (use_gzip && len > 0) {
+    gz = gzip_data(data, len, &gz_len);
+    if (gz != NULL && gz_len >= len) {
+      free(gz);
+      gz = NULL;
+    }
+  }
+#endif
+
+  render_cache_control(cache_control, sizeof(cache_control), file->url);
+  file->slot.hash = site_pack_hash(file->url, strlen(file->url));
+  r = emit(out, file->url, strlen(file->url), &file->slot.path);
+  /* A response that can differ by Accept-Encoding has to say so, or a shared
+   * cache would hand the gzip one to a client that cannot read it. */
+  if (r == 0) {
+    snprintf(extra, sizeof(extra), "%s%s", cache_control, gz ? "Vary: Accept-Encoding\r\n" : "");
+    r = emit_variant(out, data, len, ctype, extra, &file->slot.variants[SITE_PACK_IDENTITY]);
+  }
+  if (r == 0 && gz != NULL) {
+    snprintf(extra, sizeof(extra), "%sContent-Encoding: gzip\r\nVary: Accept-Encoding\r\n", cache_control);
+    r = emit_variant(out, gz, gz_len, ctype, extra, &file->slot.variants[SITE_PACK_GZIP]);
+  }
+  free(data);
+  free(gz);
+  return r;
+}
+
+int
+main(int argc, char* argv[]) {
+  const char* dir = NULL;
+  const char* pack = NULL;
+  char tmp[PATH_MAX];
+  site_pack_header header;
+  site_pack_slot* slots = NULL;
+  uint32_t nslots = 1;
+  size_t i;
+  FILE* out;
+
+  for (i = 1; i < (size_t) argc; i++) {
+#ifdef HAVE_ZLIB
+    if (!strcmp(argv[i], "-z")) {
+      use_gzip = 1;
+      continue;
+    }
+#endif
+    if (!strcmp(argv[i], "-c")) {
+      if (i == (size_t) argc - 1 || add_cache_rule(argv[++i]))
+        usage(argv[0]);
+      continue;
+    }
+    if (argv[i][0] == '-')
+      usage(argv[0]);
+    else if (dir == NULL)
+      dir = argv[i];
+    else if (pack == NULL)
+      pack = argv[i];
+    else
+      usage(argv[0]);
+  }
+  if (dir == NULL || pack == NULL)
+    usage(argv[0]);
+
+  if (walk(dir, "", 0))
+    return 1;
+  /* Sorted, so the same tree always packs to the same bytes. */
+  qsort(files, nfiles, sizeof(pack_file), compare_files);
+  while (nslots < nfiles * 2)
+    nslots *= 2;
+
+  /* Written beside the destination and renamed over it, so a server mapping
+   * the old pack never sees a half written one. */
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", pack) >= (int) sizeof(tmp)) {
+    fprintf(stderr, "Path too long: %s\n", pack);
+    return 1;
+  }
+  out = fopen(tmp, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Open error: %s: %s\n", tmp, strerror(errno));
+    return 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  if (fwrite(&header, sizeof(header), 1, out) != 1)
+    goto write_error;
+  offset = sizeof(header);
+  for (i = 0; i < nfiles; i++)
+    if (emit_file(out, &files[i]))
+      goto write_error;
+
+  slots = calloc(nslots, sizeof(site_pack_slot));
+  if (slots == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    fclose(out);
+    remove(tmp);
+    return 1;
+  }
+  for (i = 0; i < nfiles; i++) {
+    uint32_t k = (uint32_t) files[i].slot.hash & (nslots - 1);
+    while (slots[k].hash != 0)
+      k = (k + 1) & (nslots - 1);
+    slots[k] = files[i].slot;
+  }
+
+  /* Slots hold 64-bit fields, so the table starts aligned for them. */
+  while (offset % 8) {
+    if (fputc(0, out) == EOF)
+      goto write_error;
+    offset++;
+  }
+  memcpy(header.magic, SITE_PACK_MAGIC, sizeof(header.magic));
+  header.version = SITE_PACK_VERSION;
+  header.nslots = nslots;
+  header.slots_offset = offset;
+  header.size = offset + (uint64_t) nslots * sizeof(site_pack_slot);
+  if (fwrite(slots, sizeof(site_pack_slot), nslots, out) != nslots ||
+      fseek(out, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, out) != 1)
+    goto write_error;
+  free(slots);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "Write error: %s: %s\n", tmp, strerror(errno));
+    remove(tmp);
+    return 1;
+  }
+  if (rename(tmp, pack) != 0) {
+    fprintf(stderr, "Rename error: %s: %s\n", pack, strerror(errno));
+    remove(tmp);
+    return 1;
+  }
+  fprintf(stderr, "Packed %zu files into %s (%" PRIu64 " bytes)\n", nfiles, pack, header.size);
+  return 0;
+
+write_error:
+  fprintf(stderr, "Write error: %s: %s\n", tmp, strerror(errno));
+  free(slots);
+  fclose(out);
+  remove(tmp);
+  return 1;
+}
+
+/* vim:set et ts=2 sw=2 cino=>2: */
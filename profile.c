@@ -0,0 +1,473 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "profile.h"
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ucontext.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "khash.h"
+
+#define PROFILE_MAX_DEPTH 64
+/* Bounds the buffer, at 16 MB, whatever rate and length are asked for. */
+#define PROFILE_MAX_WORDS (2 * 1024 * 1024)
+
+/* Each sample is its depth followed by that many addresses, innermost first.
+ * Only the handler appends, and only while sampling is set, so the thread it
+ * interrupts reads them once it has cleared that. */
+static uintptr_t* samples;
+static size_t samples_cap;
+static size_t samples_len;
+static unsigned long samples_dropped;
+static volatile sig_atomic_t sampling;
+/* The top of the sampled thread's stack.  A frame pointer is only followed
+ * while it stays between the interrupted stack pointer and this, so a
+ * register that holds something else cannot send the walk off the stack. */
+static uintptr_t stack_top;
+static timer_t sample_timer;
+static struct sigaction saved_action;
+
+#ifdef __SANITIZE_ADDRESS__
+__attribute__((no_sanitize_address))
+#endif
+static void
+on_sigprof(int signum, siginfo_t* info, void* context) {
+  const ucontext_t* uc = (const ucontext_t*) context;
+  uintptr_t* sample;
+  uintptr_t fp, sp;
+  size_t depth = 0;
+  (void) signum;
+  (void) info;
+
+  if (!sampling)
+    return;
+  if (samples_len + 1 + PROFILE_MAX_DEPTH > samples_cap) {
+    samples_dropped++;
+    return;
+  }
+  sample = samples + samples_len;
+#if defined(__x86_64__)
+  sample[1 + depth++] = (uintptr_t) uc->uc_mcontext.gregs[REG_RIP];
+  fp = (uintptr_t) uc->uc_mcontext.gregs[REG_RBP];
+  sp = (uintptr_t) uc->uc_mcontext.gregs[REG_RSP];
+#else
+  sample[1 + depth++] = (uintptr_t) uc->uc_mcontext.pc;
+  fp = (uintptr_t) uc->uc_mcontext.regs[29];
+  sp = (uintptr_t) uc->uc_mcontext.sp;
+#endif
+  /* Each frame starts with the caller's frame pointer and the return
+   * address, and callers' frames are further up the stack. */
+  while (depth < PROFILE_MAX_DEPTH && fp >= sp && fp % sizeof(uintptr_t) == 0 &&
+      fp + 2 * sizeof(uintptr_t) <= stack_top) {
+    const uintptr_t* frame = (const uintptr_t*) fp;
+    if (frame[1] == 0)
+      break;
+    /* The call itself, rather than what follows it, which may be the next
+     * function if the callee does not return. */
+    sample[1 + depth++] = frame[1] - 1;
+    if (frame[0] <= fp)
+      break;
+    fp = frame[0];
+  }
+  sample[0] = depth;
+  samples_len += 1 + depth;
+}
+
+int
+profile_start(unsigned int hz, unsigned int seconds) {
+  pthread_attr_t attr;
+  void* stack_addr;
+  size_t stack_size;
+  struct sigaction action;
+  struct sigevent sev;
+  struct itimerspec its;
+  size_t words;
+
+  if (samples != NULL) {
+    errno = EBUSY;
+    return -1;
+  }
+  if (hz == 0 || hz > PROFILE_MAX_HZ || seconds == 0 || seconds > PROFILE_MAX_SECONDS) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (pthread_getattr_np(pthread_self(), &attr))
+    return -1;
+  if (pthread_attr_getstack(&attr, &stack_addr, &stack_size)) {
+    pthread_attr_destroy(&attr);
+    return -1;
+  }
+  pthread_attr_destroy(&attr);
+  stack_top = (uintptr_t) stack_addr + stack_size;
+
+  /* Room for every sample at full depth, and some over for timer slack. */
+  words = ((size_t) hz * seconds + hz / 10 + 1) * (1 + PROFILE_MAX_DEPTH);
+  if (words > PROFILE_MAX_WORDS)
+    words = PROFILE_MAX_WORDS;
+  samples = malloc(words * sizeof(samples[0]));
+  if (samples == NULL)
+    return -1;
+  samples_cap = words;
+  samples_len = 0;
+  samples_dropped = 0;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_sigprof;
+  /* The loop's system calls are restarted where they can be, and libuv
+   * retries the rest. */
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &saved_action))
+    goto fail;
+
+  /* Counts this thread's CPU time only, and signals this thread only. */
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+#ifdef sigev_notify_thread_id
+  sev.sigev_notify_thread_id = (pid_t) syscall(SYS_gettid);
+#else
+  sev._sigev_un._tid = (pid_t) syscall(SYS_gettid);
+#endif
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &sample_timer)) {
+    sigaction(SIGPROF, &saved_action, NULL);
+    goto fail;
+  }
+  /* At 1 Hz the interval is a whole second, which tv_nsec cannot hold. */
+  its.it_interval.tv_sec = 1 / hz;
+  its.it_interval.tv_nsec = 1000000000L / hz % 1000000000L;
+  its.it_value = its.it_interval;
+  sampling = 1;
+  if (timer_settime(sample_timer, 0, &its, NULL)) {
+    sampling = 0;
+    timer_delete(sample_timer);
+    sigaction(SIGPROF, &saved_action, NULL);
+    goto fail;
+  }
+  return 0;
+
+fail:
+  free(samples);
+  samples = NULL;
+  return -1;
+}
+
+/* Function symbols of the executable, sorted by address, with names pointing
+ * into its mapping. */
+typedef struct {
+  uintptr_t start;
+  uintptr_t end;
+  const char* name;
+} profile_symbol;
+
+typedef struct {
+  void* map;
+  size_t map_len;
+  profile_symbol* syms;
+  size_t nsyms;
+  uintptr_t bias;
+} profile_symbols;
+
+static int
+compare_symbols(const void* a, const void* b) {
+  const profile_symbol* x = a;
+  const profile_symbol* y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int
+find_executable_bias(struct dl_phdr_info* info, size_t size, void* data) {
+  (void) size;
+  /* The executable comes first. */
+  *(uintptr_t*) data = (uintptr_t) info->dlpi_addr;
+  return 1;
+}
+
+/* Reads .symtab, or .dynsym if the executable was stripped of that.  Leaves
+ * syms empty if there is nothing to be had. */
+static void
+load_symbols(profile_symbols* s) {
+  const ElfW(Ehdr)* eh;
+  const ElfW(Shdr)* sh;
+  const ElfW(Shdr)* table = NULL;
+  struct stat st;
+  size_t i, n;
+  int fd;
+
+  memset(s, 0, sizeof(*s));
+  dl_iterate_phdr(find_executable_bias, &s->bias);
+  fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) || (size_t) st.st_size < sizeof(ElfW(Ehdr))) {
+    close(fd);
+    return;
+  }
+  s->map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (s->map == MAP_FAILED) {
+    s->map = NULL;
+    return;
+  }
+  s->map_len = (size_t) st.st_size;
+
+  eh = s->map;
+  if (memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_shoff == 0 ||
+      eh->e_shentsize != sizeof(ElfW(Shdr)) ||
+      eh->e_shoff > s->map_len || eh->e_shnum > (s->map_len - eh->e_shoff) / sizeof(ElfW(Shdr)))
+    return;
+  sh = (const ElfW(Shdr)*) ((const char*) s->map + eh->e_shoff);
+  for (i = 0; i < eh->e_shnum; i++)
+    if (sh[i].sh_type == SHT_SYMTAB)
+      table = &sh[i];
+  for (i = 0; table == NULL && i < eh->e_shnum; i++)
+    if (sh[i].sh_type == SHT_DYNSYM)
+      table = &sh[i];
+  if (table == NULL || table->sh_link >= eh->e_shnum || table->sh_offset > s->map_len ||
+      table->sh_size > s->map_len - table->sh_offset ||
+      sh[table->sh_link].sh_offset > s->map_len ||
+      sh[table->sh_link].sh_size > s->map_len - sh[table->sh_link].sh_offset)
+    return;
+
+  const ElfW(Sym)* sym = (const ElfW(Sym)*) ((const char*) s->map + table->sh_offset);
+  const char* names = (const char*) s->map + sh[table->sh_link].sh_offset;
+  size_t names_len = sh[table->sh_link].sh_size;
+  n = table->sh_size / sizeof(ElfW(Sym));
+  s->syms = malloc(n * sizeof(s->syms[0]) + 1);
+  if (s->syms == NULL)
+    return;
+  for (i = 0; i < n; i++) {
+    if (ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC || sym[i].st_value == 0 || sym[i].st_size == 0 ||
+        sym[i].st_name >= names_len || memchr(names + sym[i].st_name, '\0', names_len - sym[i].st_name) == NULL)
+      continue;
+    s->syms[s->nsyms].start = (uintptr_t) sym[i].st_value;
+    s->syms[s->nsyms].end = (uintptr_t) (sym[i].st_value + sym[i].st_size);
+    s->syms[s->nsyms].name = names + sym[i].st_name;
+    s->nsyms++;
+  }
+  qsort(s->syms, s->nsyms, sizeof(s->syms[0]), compare_symbols);
+}
+
+static void
+unload_symbols(profile_symbols* s) {
+  free(s->syms);
+  if (s->map != NULL)
+    munmap(s->map, s->map_len);
+}
+
+/* A frame's name: its function in the executable, its symbol or library
+ * otherwise, and its address if nothing else is known. */
+static void
+symbolize(const profile_symbols* s, uintptr_t pc, char* buf, size_t cap) {
+  uintptr_t addr = pc - s->bias;
+  size_t lo = 0, hi = s->nsyms;
+  Dl_info info;
+  int found;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (s->syms[mid].start <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo > 0 && addr < s->syms[lo - 1].end) {
+    snprintf(buf, cap, "%s", s->syms[lo - 1].name);
+    return;
+  }
+  found = dladdr((void*) pc, &info);
+  if (found && info.dli_sname != NULL) {
+    snprintf(buf, cap, "%s", info.dli_sname);
+    return;
+  }
+  if (found && info.dli_fname != NULL) {
+    const char* base = strrchr(info.dli_fname, '/');
+    snprintf(buf, cap, "[%s]", base ? base + 1 : info.dli_fname);
+    return;
+  }
+  snprintf(buf, cap, "0x%" PRIxPTR, pc);
+}
+
+KHASH_MAP_INIT_STR(folded, unsigned long)
+
+typedef struct {
+  char* p;
+  size_t len;
+  size_t cap;
+} profile_buf;
+
+static int
+profile_append(profile_buf* b, const char* s, size_t n) {
+  if (b->len + n + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    char* grown;
+    while (cap < b->len + n + 1)
+      cap *= 2;
+    grown = realloc(b->p, cap);
+    if (grown == NULL)
+      return -1;
+    b->p = grown;
+    b->cap = cap;
+  }
+  memcpy(b->p + b->len, s, n);
+  b->len += n;
+  b->p[b->len] = '\0';
+  return 0;
+}
+
+int
+profile_stop(char** out, size_t* out_len) {
+  profile_symbols syms;
+  profile_buf stack = { NULL, 0, 0 };
+  profile_buf folded = { NULL, 0, 0 };
+  khash_t(folded)* counts;
+  size_t i;
+  int failed = 0;
+  khint_t k;
+
+  if (samples == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  sampling = 0;
+  timer_delete(sample_timer);
+  sigaction(SIGPROF, &saved_action, NULL);
+
+  counts = kh_init(folded);
+  if (counts == NULL) {
+    free(samples);
+    samples = NULL;
+    return -1;
+  }
+  load_symbols(&syms);
+
+  /* Distinct stacks are counted by their rendering, outermost frame first. */
+  for (i = 0; i < samples_len && !failed; i += 1 + samples[i]) {
+    size_t depth = samples[i];
+    size_t j;
+    int hr;
+
+    stack.len = 0;
+    for (j = depth; j > 0; j--) {
+      char name[256];
+      symbolize(&syms, samples[i + j], name, sizeof(name));
+      if ((j < depth && profile_append(&stack, ";", 1)) || profile_append(&stack, name, strlen(name))) {
+        failed = 1;
+        break;
+      }
+    }
+    if (failed || stack.len == 0)
+      continue;
+    k = kh_get(folded, counts, stack.p);
+    if (k != kh_end(counts)) {
+      kh_value(counts, k)++;
+      continue;
+    }
+    char* key = strdup(stack.p);
+    if (key == NULL) {
+      failed = 1;
+      break;
+    }
+    k = kh_put(folded, counts, key, &hr);
+    if (hr < 0) {
+      free(key);
+      failed = 1;
+      break;
+    }
+    kh_value(counts, k) = 1;
+  }
+
+  for (k = kh_begin(counts); k != kh_end(counts); k++) {
+    if (!kh_exist(counts, k))
+      continue;
+    if (!failed) {
+      char count[32];
+      int n = snprintf(count, sizeof(count), " %lu\n", kh_value(counts, k));
+      if (profile_append(&folded, kh_key(counts, k), strlen(kh_key(counts, k))) ||
+          profile_append(&folded, count, (size_t) n))
+        failed = 1;
+    }
+    free((char*) kh_key(counts, k));
+  }
+  kh_destroy(folded, counts);
+  unload_symbols(&syms);
+  free(stack.p);
+  free(samples);
+  samples = NULL;
+
+  if (failed) {
+    free(folded.p);
+    errno = ENOMEM;
+    return -1;
+  }
+  /* No samples at all is an empty profile, not a failure. */
+  if (folded.p == NULL && profile_append(&folded, "", 0)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  *out = folded.p;
+  *out_len = folded.len;
+  return 0;
+}
+
+#else
+
+int
+profile_start(unsigned int hz, unsigned int seconds) {
+  (void) hz;
+  (void) seconds;
+  errno = ENOSYS;
+  return -1;
+}
+
+int
+profile_stop(char** out, size_t* out_len) {
+  (void) out;
+  (void) out_len;
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+/* vim:set et ts=2 sw=2 cino=>2: */
@@ -0,0 +1,54 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+/* A sampling CPU profiler for the thread running the loop, for the -A
+ * PREFIX/profile endpoint.  A per-thread CPU timer raises SIGPROF hz times per
+ * second of CPU the thread uses, and the handler walks the stack by its frame
+ * pointers into a buffer allocated up front.  Stopping renders the samples as
+ * folded stacks, one "outer;...;inner count" line per distinct stack, which is
+ * what flamegraph.pl reads.
+ *
+ * Frames of code built without frame pointers are skipped over or end the
+ * walk, so the server has to be built with them (the FRAME_POINTERS CMake
+ * option, on by default) for whole stacks.  Names come from the executable's
+ * symbol table, or dladdr() for shared libraries; a stripped binary shows
+ * addresses.  Only Linux on x86-64 and arm64 is supported.  The libuv thread
+ * pool, which mostly waits on the disk, is not sampled. */
+
+#include <stddef.h>
+
+#define PROFILE_MAX_HZ 1000
+#define PROFILE_MAX_SECONDS 60
+
+/* Starts sampling the calling thread for up to seconds.  Returns -1 with errno
+ * set if it cannot: ENOSYS where it is not supported, EBUSY if it already is
+ * sampling. */
+int profile_start(unsigned int hz, unsigned int seconds);
+
+/* Stops sampling and renders what was collected into a malloc()ed buffer.
+ * Returns -1 with errno set if that fails, and stops sampling either way. */
+int profile_stop(char** out, size_t* out_len);
+
+#endif
@@ -20,8 +20,13 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+/* For O_DIRECT (-D). */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <strings.h>
@@ -30,7 +35,45 @@
 #include <sys/stat.h>
 #include <limits.h>
 #include <inttypes.h>
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <netinet/in.h>
+# include <netinet/tcp.h>
+# include <sys/un.h>
+#endif
+#if defined(__has_feature)
+# if __has_feature(address_sanitizer) && !defined(__SANITIZE_ADDRESS__)
+#  define __SANITIZE_ADDRESS__ 1
+# endif
+#endif
+#ifdef __SANITIZE_ADDRESS__
+# include <sanitizer/asan_interface.h>
+#endif
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__aarch64__)
+# include <arm_neon.h>
+#endif
+
+/* With ALLOC_STATS every heap allocation the server makes is counted and
+ * reported in the metrics, so a benchmark can check that serving settles
+ * into making none.  Allocations inside libuv are not seen. */
+#ifdef ALLOC_STATS
+static uint64_t heap_allocations;
+static void* counted_malloc(size_t n) { heap_allocations++; return malloc(n); }
+static void* counted_calloc(size_t n, size_t m) { heap_allocations++; return calloc(n, m); }
+static void* counted_realloc(void* p, size_t n) { heap_allocations++; return realloc(p, n); }
+# define malloc(n) counted_malloc(n)
+# define calloc(n, m) counted_calloc(n, m)
+# define realloc(p, n) counted_realloc(p, n)
+#endif
+
 #include "server.h"
+#include "common.h"
+#include "site_pack.h"
+#include "trace.h"
+#include "profile.h"
 #include "khash.h"
 
 #define ASSERT(expr)                                      \
@@ -76,6 +119,12 @@
 /* Appended when the request target names a directory. */
 #define INDEX_FILE "index.html"
 
+/* Content types of the two renderings of a directory listing, picked by the
+ * Accept header, which caches are told about. */
+#define LISTING_HTML_TYPE "text/html; charset=utf-8"
+#define LISTING_JSON_TYPE "application/json"
+#define LISTING_VARY "Vary: Accept\r\n"
+
 /* Windows accepts both characters as path separators, so a request target
  * carrying backslashes has to be split on them there as well. */
 #ifdef _WIN32
@@ -101,18 +150,313 @@
 static uv_loop_t* loop;
 static char* static_dir = "./public";
 static int static_dir_len = -1;
+/* Whether a directory without an index file is answered with a listing of its
+ * contents rather than a 404. */
+static int dir_listing = 0;
+
+/* Overload protection (-L).  Loop lag -- how late a periodic timer fires -- is
+ * how long anything that becomes ready now waits before the server gets to
+ * it.  Past pause_lag_ms new connections are left in the listen backlog; past
+ * shed_lag_ms new requests are refused with a canned 503, so the ones already
+ * accepted stay fast.  Negative disables either. */
+#define LAG_SAMPLE_MS 50
+static long pause_lag_ms = -1;
+static long shed_lag_ms = -1;
+static uv_timer_t lag_timer;
+static uint64_t lag_expected;
+/* Set while on_connection is holding connections back; the listeners they
+ * came from are accepted on again once the lag drops and there is room under
+ * the connection cap. */
+static int accept_paused;
+static uv_stream_t* paused_listeners[2];
+
+/* Connection cap (-C).  Each connection costs a handle, an http_connection and
+ * its buffers, so without one a flood of connections that never finish is
+ * only stopped by running out of memory or descriptors.  At the cap the
+ * listeners are paused, as for lag, and resumed as connections close.
+ * Negative is no cap. */
+static long max_connections = -1;
+static long open_connections;
+/* All of them, newest first. */
+static http_connection* connections;
+
+/* TCP, and a Unix domain socket or named pipe (-u) for a proxy on the same
+ * host.  Connections from either are served alike. */
+static uv_tcp_t tcp_listener;
+static uv_pipe_t pipe_listener;
+static const char* pipe_path;
+/* Set once each listener is listening, for http_server_stop. */
+static int listening_tcp;
+static int listening_pipe;
+/* Set by http_server_stop: a connection is closed once its response has gone
+ * out, rather than read from again. */
+static int stopping;
+
+/* Operational endpoints (-A) under this prefix, never shed.  They are only
+ * answered on a listener of their own (-M): behind a proxy on the same host
+ * every client arrives from the loopback interface, or through the Unix
+ * socket, so neither tells an operator from anyone else.  A port is bound to
+ * the loopback interface; anything else is a Unix socket path.  That listener
+ * is never paused for lag or the connection cap. */
+static const char* admin_prefix;
+static size_t admin_prefix_len;
+static const char* admin_address;
+static int admin_port;
+static uv_tcp_t admin_tcp_listener;
+static uv_pipe_t admin_pipe_listener;
+/* Whichever of the two is listening, or NULL. */
+static uv_stream_t* admin_listener;
+
+/* Socket tuning (-S key=value).  Zero leaves the system default. */
+static struct {
+  int backlog; /* SOMAXCONN when unset */
+  /* Seconds the kernel holds a connection back waiting for its first data
+   * (TCP_DEFER_ACCEPT), so one that never sends anything never costs an
+   * accept or an http_connection. */
+  int defer_accept;
+  /* Length of the queue of pending TCP Fast Open requests. */
+  int fastopen;
+  int rcvbuf;
+  int sndbuf;
+  /* Cork a streamed response until its first body chunk is written, so the
+   * header does not go out in a segment of its own. */
+  int cork;
+} socket_tuning;
+
+/* Request trace (-t FILE), for bench/replay.py: a line per response as it
+ * starts, with the microseconds since the server started, the status, the
+ * bytes in the response, header included, and the method and target as they
+ * were sent.  Lines are buffered and written out when the buffer fills or once
+ * a second, so tracing costs the loop a write now and then rather than one per
+ * request. */
+#define REQUEST_TRACE_BUF_SIZE (64 * 1024)
+#define REQUEST_TRACE_FLUSH_MS 1000
+static FILE* request_trace;
+static uint64_t request_trace_started;
+static uv_timer_t request_trace_flusher;
+
+/* Probes fired from the cache are not handed the connection they are serving,
+ * but requests are handled one at a time, so it is noted here. */
+static uint64_t next_connection_id;
+static uint64_t current_connection_id;
+
+static struct {
+  uint64_t loop_lag_ns; /* smoothed */
+  uint64_t loop_lag_max_ns;
+  uint64_t accept_pauses;
+  uint64_t accepts_deferred;
+  uint64_t accepts_refused;
+  uint64_t requests_shed;
+  uint64_t target_cache_hits;
+  uint64_t missing_path_hits;
+  uint64_t write_slices;
+  uint64_t writes_throttled;
+  uint64_t direct_read_bytes;
+  uint64_t dropped_cache_bytes;
+} server_stats;
+
+/* TCP_INFO sampling (-T N).  Every Nth response completed on a TCP connection
+ * is sampled as its last byte goes to the kernel: the smoothed round trip
+ * time and its variation, the segments retransmitted on the connection so far,
+ * the delivery rate and the congestion window.  Each goes into a histogram by
+ * the size of the response, for the metrics.  Slow responses whose RTT or
+ * retransmits are up are slow on the network; ones whose RTT is not, while
+ * the loop lag is, are slow in the server. */
+#define TCP_SIZE_CLASSES 4
+#define TCP_MAX_BOUNDS 12
+enum { TCP_RTT, TCP_RTTVAR, TCP_RETRANSMITS, TCP_DELIVERY_RATE, TCP_CWND, TCP_METRICS };
+static unsigned long tcp_info_every;
+static uint64_t tcp_info_seen;
+
+typedef struct {
+  const char* name;
+  const char* help;
+  /* Upper bounds of the buckets, in what the kernel reports; microseconds
+   * are printed as seconds. */
+  uint64_t bounds[TCP_MAX_BOUNDS];
+  unsigned int nbounds;
+  int microseconds;
+} tcp_metric;
+
+static const tcp_metric tcp_metrics[TCP_METRICS] = {
+  { "http_server_tcp_rtt_seconds",
+    "Smoothed round trip time of the connection as a response completed.",
+    { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 }, 12, 1 },
+  { "http_server_tcp_rttvar_seconds",
+    "Round trip time variation of the connection as a response completed.",
+    { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000 }, 12, 1 },
+  { "http_server_tcp_retransmitted_segments",
+    "Segments retransmitted on the connection as a response completed.",
+    { 0, 1, 2, 4, 8, 16, 64, 256 }, 8, 0 },
+  { "http_server_tcp_delivery_rate_bytes",
+    "Delivery rate of the connection in bytes per second as a response completed.",
+    { 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000ULL }, 6, 0 },
+  { "http_server_tcp_cwnd_segments",
+    "Congestion window of the connection as a response completed.",
+    { 4, 10, 20, 40, 80, 160, 320, 640 }, 8, 0 },
+};
+
+/* By the size of the response, below each bound. */
+static const struct {
+  uint64_t below;
+  const char* label;
+} tcp_size_classes[TCP_SIZE_CLASSES] = {
+  { 16 * 1024, "<16k" },
+  { 256 * 1024, "<256k" },
+  { 4 * 1024 * 1024, "<4m" },
+  { UINT64_MAX, ">=4m" },
+};
+
+static struct {
+  uint64_t buckets[TCP_MAX_BOUNDS + 1];
+  uint64_t count;
+  uint64_t sum;
+} tcp_histograms[TCP_METRICS][TCP_SIZE_CLASSES];
+
+#if defined(__linux__) && defined(TCP_INFO)
+# define HAVE_TCP_INFO 1
+/* The kernel's struct tcp_info as far as tcpi_delivery_rate, which the C
+ * library's stops short of.  The kernel only ever appends to it, and says how
+ * much it filled in. */
+typedef struct {
+  uint8_t state, ca_state, retransmits, probes, backoff, options, wscale, flags;
+  uint32_t rto, ato, snd_mss, rcv_mss;
+  uint32_t unacked, sacked, lost, retrans, fackets;
+  uint32_t last_data_sent, last_ack_sent, last_data_recv, last_ack_recv;
+  uint32_t pmtu, rcv_ssthresh, rtt, rttvar, snd_ssthresh, snd_cwnd, advmss, reordering;
+  uint32_t rcv_rtt, rcv_space;
+  uint32_t total_retrans;
+  uint64_t pacing_rate, max_pacing_rate, bytes_acked, bytes_received;
+  uint32_t segs_out, segs_in;
+  uint32_t notsent_bytes, min_rtt, data_segs_in, data_segs_out;
+  uint64_t delivery_rate;
+} kernel_tcp_info;
+#endif
+
+/* Write scheduling (-W).  A response bigger than write_quota is sent a slice
+ * of at most that much at a time.  After each slice it goes to the back of a
+ * run queue, which is worked through once per loop iteration, so every
+ * connection gets one slice per iteration and they take turns: a few fast
+ * clients pulling large files can no longer fill whole iterations, or the
+ * socket buffers, ahead of the small responses waiting behind them.  With a
+ * rate, each such response is also held to that many bytes a second.  Off
+ * unless -W is given: every response then goes out as one write. */
+#define WRITE_THROTTLE_MS 10
+static size_t write_quota;
+static uint64_t write_rate;
+static http_response* ready_head;
+static http_response* ready_tail;
+static http_response* throttled;
+/* Idle rather than check, so that poll does not block while slices wait. */
+static uv_idle_t write_scheduler;
+static uv_timer_t write_throttle;
 
 KHASH_MAP_INIT_STR(mime_type, const char*)
 static khash_t(mime_type)* mime_type;
 
+/* A site pack served instead of static_dir (-P).  It is mapped whole and
+ * checked once when loaded, so serving from it takes no system calls beyond
+ * the write and no bounds checks. */
+static const char* site_pack_map;
+static const site_pack_header* site_pack;
+static const site_pack_slot* site_pack_slots;
+
+/* Cache storage.  Entries and bodies are carved out of large chunks rather
+ * than each taking several malloc()s of its own, so the memory behind the hot
+ * path is packed onto few pages (huge ones where the system allows), and a
+ * file churning on disk does not fragment the heap.  A chunk is given back as
+ * soon as nothing in it is live; one that is mostly dead is compacted by
+ * moving what is left in it elsewhere. */
+#define ARENA_CHUNK_SIZE (2 * 1024 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+/* Anything bigger gets a mapping of its own rather than leaving a hole most
+ * of a chunk wide when it goes. */
+#define ARENA_MAX_SHARED (ARENA_CHUNK_SIZE / 4)
+
+typedef struct arena_chunk {
+  struct arena_chunk* prev;
+  struct arena_chunk* next;
+  size_t size;
+  /* Bytes handed out from the start of the chunk, and how many of those still
+   * belong to live blobs. */
+  size_t used;
+  size_t live;
+  int dedicated;
+  int huge;
+} arena_chunk;
+
+/* Precedes every allocation, so freeing one finds its chunk. */
+typedef struct {
+  arena_chunk* chunk;
+  size_t size;
+} arena_blob;
+
+/* The arena hands out memory malloc() never saw, so AddressSanitizer has to be
+ * told which parts of it are allocated for it to catch overruns there. */
+#ifdef __SANITIZE_ADDRESS__
+# define ARENA_POISON(p, n) ASAN_POISON_MEMORY_REGION(p, n)
+# define ARENA_UNPOISON(p, n) ASAN_UNPOISON_MEMORY_REGION(p, n)
+#else
+# define ARENA_POISON(p, n) ((void) (p), (void) (n))
+# define ARENA_UNPOISON(p, n) ((void) (p), (void) (n))
+#endif
+
+#define ARENA_CHUNK_HDR ARENA_ROUND(sizeof(arena_chunk))
+#define ARENA_BLOB_HDR ARENA_ROUND(sizeof(arena_blob))
+
+static arena_chunk* arena_chunks;
+static arena_chunk* arena_current;
+/* An emptied chunk is kept back for the next one needed, so a cache that
+ * hovers around a chunk boundary does not map and unmap one per load. */
+static arena_chunk* arena_spare;
+/* Back chunks with explicit huge pages (MAP_HUGETLB) rather than only asking
+ * for transparent ones.  Cleared if the system turns out to have none. */
+static int arena_huge_pages = 0;
+/* Compaction walks the whole cache, so it is batched up: the first chunk to go
+ * sparse arms a timer, and everything sparse by the time it fires is dealt
+ * with in one pass. */
+#define ARENA_COMPACT_DELAY_MS 1000
+static uv_timer_t arena_compactor;
+static int arena_compacting;
+
+/* Cached bodies are shared by content: a docroot full of copies of the same
+ * file keeps one buffer for all of them.  Each is indexed by a hash of its
+ * bytes, confirmed with a full compare, and freed when the last entry using
+ * it goes. */
+typedef struct file_cache_body {
+  char* data;
+  size_t len;
+  uint64_t hash;
+  int refs;
+  /* A body whose hash collides with a different one already in the index is
+   * kept, but only by the entry that loaded it. */
+  int indexed;
+  /* Space in front of data set aside for a response header, and how much of
+   * it holds the keep-alive header of the entry that loaded the body.  Any
+   * entry with the same header sends header and body as one buffer. */
+  size_t header_room;
+  size_t header_len;
+} file_cache_body;
+KHASH_MAP_INIT_INT64(body_cache, file_cache_body*)
+static khash_t(body_cache)* body_cache;
+
 /* Every served file is kept in memory with both variants of its response
  * header rendered up front, so a hit costs one hash lookup and one write.
  * The size and mtime recorded at load time are checked against the disk copy
- * on every hit, so a modified file is reloaded instead of served stale. */
+ * on every hit, so a modified file is reloaded instead of served stale.
+ *
+ * An entry is a single arena allocation with its path and headers right
+ * behind it.  Compaction may move one that nothing holds a reference to, so
+ * anything keeping a pointer to an entry beyond the current callback has to
+ * hold one. */
 typedef struct file_cache_entry {
   char* path;
+  /* Points into shared, which may be used by other paths as well; the headers
+   * below are this path's own. */
   char* body;
   size_t body_len;
+  file_cache_body* shared;
   time_t mtime;
   const char* ctype;
   char* header_keep_alive;
@@ -124,10 +468,104 @@ typedef struct file_cache_entry {
    * freed once the last of them has finished writing. */
   int refs;
   int dead;
+  /* Set for a rendered directory listing rather than a file.  Its mtime is the
+   * directory's, which changes whenever an entry is added, removed or
+   * renamed, so that is what it is revalidated against. */
+  int listing;
+  /* header_keep_alive sits directly in front of body, so a keep-alive
+   * response is a single buffer. */
+  int contiguous;
 } file_cache_entry;
 KHASH_MAP_INIT_STR(file_cache, file_cache_entry*)
 static khash_t(file_cache)* file_cache;
 
+/* Files too big for the cache are streamed from disk, but their descriptors
+ * are kept open between requests along with what fstat() said and both
+ * renderings of the header, so a repeated download skips open, fstat and
+ * close.  Concurrent responses share a descriptor, each reading at its own
+ * offset.  Entries are revalidated like file_cache ones.  One left idle for
+ * OPEN_FILE_IDLE_MS is closed, so a file deleted from the tree does not keep
+ * its blocks allocated for long; past OPEN_FILE_MAX a file is opened per
+ * request as before. */
+#define OPEN_FILE_MAX 64
+#define OPEN_FILE_IDLE_MS 10000
+
+/* Files of at least uncached_size (-D) are streamed without filling the page
+ * cache, so a one-off download of a huge file does not evict the pages that
+ * the rest of the tree is served from.  Where the file system takes O_DIRECT
+ * they are read straight from the device, in whole blocks at block offsets
+ * into DIRECT_ALIGN aligned buffers of DIRECT_BUF_SIZE; direct reads get no
+ * readahead, so they are larger than the usual chunk.  Elsewhere each chunk
+ * is read as usual and its pages dropped once it is in the buffer. */
+#define DIRECT_ALIGN 4096
+#define DIRECT_BUF_SIZE (256 * 1024)
+enum { BYPASS_NONE, BYPASS_DIRECT, BYPASS_DROP };
+static uint64_t uncached_size;
+/* The kernel only drops cached folios that lie wholly in the range it is
+ * given, and they can be much bigger than a page, so what has been read is
+ * dropped a megabyte at a time, over the two megabytes behind the read. */
+#define DROP_BEHIND (1024 * 1024)
+
+typedef struct open_file {
+  char* path;
+  uv_file fd;
+  uint64_t size;
+  time_t mtime;
+  uint64_t ino;
+  char* header_keep_alive;
+  size_t header_keep_alive_len;
+  char* header_close;
+  size_t header_close_len;
+  uint64_t checked_at;
+  uint64_t used_at;
+  /* How it avoids the page cache, if it is at least uncached_size. */
+  int bypass;
+  /* One held by the table while the file is in it and one by each response
+   * streaming from it; the descriptor is closed when the last goes. */
+  int refs;
+} open_file;
+KHASH_MAP_INIT_STR(open_files, open_file*)
+static khash_t(open_files)* open_files;
+static uv_timer_t open_file_sweeper;
+
+/* Paths found not to exist, so that repeated requests for them -- scanners,
+ * broken links -- are answered without an open().  The deepest directory of
+ * each that does exist is watched, and any event there makes every entry
+ * depending on it stale; where no watch can be set an entry only lives for
+ * CACHE_REVALIDATE_MS, like a cached file.  Past MISSING_MAX entries the lot
+ * is dropped, which bounds it against a scanner that never repeats itself.
+ * At MISSING_WATCH_MAX watches those no entry depends on are closed, and if
+ * that frees none the entries are dropped first. */
+#define MISSING_MAX 4096
+#define MISSING_WATCH_MAX 64
+/* A safety net: a watch can miss events, for instance on a network mount. */
+#define MISSING_WATCHED_TTL_MS 60000
+
+typedef struct missing_watch {
+  uv_fs_event_t handle;
+  /* Bumped by every event in the directory; an entry made under an older
+   * generation is stale. */
+  uint64_t generation;
+  /* The watch saw an event, and may have been on a directory since removed,
+   * so it is set again before anything new relies on it. */
+  int fired;
+  /* One held by the table while the watch is in it and one by each entry
+   * made under it; the handle is closed when the last goes. */
+  int refs;
+  char path[1];
+} missing_watch;
+KHASH_MAP_INIT_STR(missing_watches, missing_watch*)
+static khash_t(missing_watches)* missing_watches;
+
+typedef struct missing_path {
+  missing_watch* watch; /* NULL if none could be set */
+  uint64_t generation;
+  uint64_t expires_at;
+  char path[1];
+} missing_path;
+KHASH_MAP_INIT_STR(missing_paths, missing_path*)
+static khash_t(missing_paths)* missing_paths;
+
 #if 0
 #include <sys/time.h>
 void
@@ -149,17 +587,111 @@ btime(int f) {
 
 static void on_write(uv_write_t*, int);
 static void on_write_cached(uv_write_t*, int);
+static void on_write_slice(uv_write_t*, int);
+static void next_slice(http_response*);
+static void send_slice(http_response*);
+static void make_ready(http_response*);
 static void on_write_header(uv_write_t*, int);
 static void start_body(http_response*);
-static void on_write_error_free_buf(uv_write_t*, int);
+static void on_write_status(uv_write_t*, int);
 static void on_read(uv_stream_t*, ssize_t, const uv_buf_t*);
 static void on_close(uv_handle_t*);
 static void on_connection(uv_stream_t*, int);
 static void on_alloc(uv_handle_t*, size_t, uv_buf_t*);
 static void on_fs_read(uv_fs_t*);
-static void response_error(uv_handle_t*, int, const char*, const char*);
+static void send_status(uv_handle_t*, int);
+static void respond_status(http_request*, int);
+static void respond_from_root(http_request*);
+static void trace_request(http_request*, const char*, uint64_t);
+static void sample_tcp_info(uv_handle_t*, uint64_t);
 static void respond_with_cache_entry(http_request*, file_cache_entry*);
+static void respond_with_buffers(http_request*, uv_buf_t*, size_t, size_t, file_cache_entry*);
+static void on_arena_compact(uv_timer_t*);
+static int header_lists(http_request*, int, const char*);
 static void file_cache_entry_unref(file_cache_entry*);
+static void open_file_unref(open_file*);
+
+/* Freelists for the objects every connection and response needs, so that once
+ * the server has seen its usual load it stops going to malloc() for them.
+ * Each keeps at most `keep` spares and frees the rest, so a burst does not
+ * pin its peak forever.  There is one loop, so these are simply global. */
+typedef struct pool_item {
+  struct pool_item* next;
+} pool_item;
+
+typedef struct {
+  size_t size;
+  unsigned int keep;
+  unsigned int spare;
+  pool_item* free;
+  /* Nonzero for buffers that have to start on a multiple of it. */
+  size_t align;
+} object_pool;
+
+#define OBJECT_POOL(size, keep) { (size), (keep), 0, NULL, 0 }
+#define ALIGNED_OBJECT_POOL(size, keep, align) { (size), (keep), 0, NULL, (align) }
+
+/* Request heads are read into buffers of this size, grown only for one that
+ * does not fit. */
+#define HEAD_BUF_SIZE 8192
+
+static object_pool connection_pool = OBJECT_POOL(sizeof(http_connection), 256);
+/* Connections come from either listener, so the handles are sized for both. */
+typedef union {
+  uv_tcp_t tcp;
+  uv_pipe_t pipe;
+} stream_storage;
+static object_pool stream_pool = OBJECT_POOL(sizeof(stream_storage), 1024);
+static object_pool head_pool = OBJECT_POOL(HEAD_BUF_SIZE, 256);
+static object_pool response_pool = OBJECT_POOL(sizeof(http_response), 1024);
+static object_pool fs_req_pool = OBJECT_POOL(sizeof(uv_fs_t), 256);
+static object_pool write_req_pool = OBJECT_POOL(sizeof(uv_write_t), 256);
+/* Streaming chunks, and the unsent part of a header, which is smaller. */
+static object_pool buffer_pool = OBJECT_POOL(WRITE_BUF_SIZE, 256);
+/* Chunks read with O_DIRECT.  Few are streamed at once, and each is big. */
+static object_pool direct_pool = ALIGNED_OBJECT_POOL(DIRECT_BUF_SIZE, 16, DIRECT_ALIGN);
+
+static void*
+pool_get(object_pool* pool) {
+  pool_item* item = pool->free;
+  if (item == NULL) {
+#ifndef _WIN32
+    void* p;
+    if (pool->align > 0)
+      return posix_memalign(&p, pool->align, pool->size) == 0 ? p : NULL;
+#endif
+    return malloc(pool->size);
+  }
+  ARENA_UNPOISON((char*) item + sizeof(pool_item), pool->size - sizeof(pool_item));
+  pool->free = item->next;
+  pool->spare--;
+  return item;
+}
+
+static void*
+pool_get_zeroed(object_pool* pool) {
+  void* p = pool_get(pool);
+  if (p != NULL)
+    memset(p, 0, pool->size);
+  return p;
+}
+
+/* Spares are poisoned past the link, so AddressSanitizer still catches a use
+ * after release even though the memory is never actually freed. */
+static void
+pool_put(object_pool* pool, void* p) {
+  pool_item* item = (pool_item*) p;
+  if (p == NULL)
+    return;
+  if (pool->spare >= pool->keep) {
+    free(p);
+    return;
+  }
+  item->next = pool->free;
+  pool->free = item;
+  pool->spare++;
+  ARENA_POISON((char*) item + sizeof(pool_item), pool->size - sizeof(pool_item));
+}
 
 /* Closing a handle twice aborts inside libuv, and with asserts off links it
  * into the closing queue twice so on_close() frees it twice, so every close
@@ -170,6 +702,12 @@ close_connection(uv_handle_t* handle) {
     uv_close(handle, on_close);
 }
 
+static uint64_t
+connection_id(uv_handle_t* handle) {
+  http_connection* conn = handle ? (http_connection*) handle->data : NULL;
+  return conn ? conn->id : 0;
+}
+
 /* The request is embedded in its connection, so releasing it is just clearing
  * the owner pointer; the storage is reclaimed with the connection. */
 static void
@@ -178,8 +716,12 @@ destroy_request(http_request* request, int close_handle) {
     http_connection* conn = (http_connection*) request->handle->data;
     if (conn)
       conn->request = NULL;
-    if (close_handle)
+    if (close_handle || stopping)
       close_connection(request->handle);
+    else if (conn && !uv_is_closing(request->handle))
+      /* Idle again: whatever the client sent meanwhile has waited in the
+       * socket, and is read now. */
+      uv_read_start((uv_stream_t*) request->handle, on_alloc, on_read);
   }
 }
 
@@ -190,15 +732,34 @@ close_file(uv_file fd) {
   uv_fs_req_cleanup(&close_req);
 }
 
+static void
+set_cork(uv_handle_t* handle, int on) {
+#ifdef TCP_CORK
+  uv_os_fd_t fd;
+  if (handle->type == UV_TCP && uv_fileno(handle, &fd) == 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#else
+  (void) handle;
+  (void) on;
+#endif
+}
+
 static void
 destroy_response(http_response* response, int close_handle) {
-  if (response->header) free(response->header);
-  if (response->pbuf) free(response->pbuf);
+  /* A HEAD response, or one that failed, never got to its first chunk. */
+  if (response->corked)
+    set_cork(response->handle, 0);
+  pool_put(&buffer_pool, response->header);
+  if (response->open_file != NULL && response->open_file->bypass == BYPASS_DIRECT)
+    pool_put(&direct_pool, response->pbuf);
+  else
+    pool_put(&buffer_pool, response->pbuf);
+  if (response->release != NULL)
+    response->release(response->owned);
   file_cache_entry_unref(response->cache_entry);
+  open_file_unref(response->open_file);
   if (response->request) destroy_request(response->request, close_handle);
-  if (response->fd != -1)
-    close_file((uv_file) response->fd);
-  free(response);
+  pool_put(&response_pool, response);
 }
 
 /* Continuation for a streamed (uncached) response: keep reading chunks until
@@ -214,16 +775,14 @@ on_write(uv_write_t* req, int status) {
   }
 
   if (response->response_offset >= response->response_size) {
+    TRACE2(write__complete, connection_id(response->handle), response->response_size);
+    if (tcp_info_every > 0)
+      sample_tcp_info(response->handle, response->response_size);
     destroy_response(response, !response->request->keep_alive);
     return;
   }
 
-  int r = uv_fs_read(loop, &response->read_req, (uv_file) response->fd, &response->buf, 1, response->response_offset, on_fs_read);
-  if (r) {
-    fprintf(stderr, "File read error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    response_error(response->handle, 500, "Internal Server Error", NULL);
-    destroy_response(response, 1);
-  }
+  next_slice(response);
 }
 
 /* Completion for a cached response: header and body went out in one write. */
@@ -236,35 +795,282 @@ on_write_cached(uv_write_t* req, int status) {
     destroy_response(response, 1);
     return;
   }
+  TRACE2(write__complete, connection_id(response->handle), response->response_size);
+  if (tcp_info_every > 0)
+    sample_tcp_info(response->handle, response->response_size);
   destroy_response(response, !response->request->keep_alive);
 }
 
 static const char*
 find_content_type(const char* path) {
-  const char* ctype = "application/octet-stream";
-  const char* dot = path;
-  const char* ptr = dot;
-  while (dot) {
-    ptr = dot;
-    dot = strchr(dot + 1, '.');
-  }
-  khint_t k = kh_get(mime_type, mime_type, ptr);
+  const char* ctype = DEFAULT_CONTENT_TYPE;
+  khint_t k = kh_get(mime_type, mime_type, path_extension(path));
   if (k != kh_end(mime_type)) {
     ctype = kh_value(mime_type, k);
   }
   return ctype;
 }
 
+static void*
+arena_map(size_t size, int* huge) {
+#ifdef _WIN32
+  *huge = 0;
+  return malloc(size);
+#else
+  void* p;
+# ifdef MAP_HUGETLB
+  if (*huge) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+      return p;
+    fprintf(stderr, "Huge page error: %s: using normal pages\n", strerror(errno));
+    arena_huge_pages = 0;
+  }
+# endif
+  *huge = 0;
+  if (size != ARENA_CHUNK_SIZE) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+  }
+
+  /* Transparent huge pages only back aligned ranges, so a chunk is cut out of
+   * a mapping big enough to hold an aligned one. */
+  char* base = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+  char* aligned = (char*) (((uintptr_t) base + size - 1) & ~(uintptr_t) (size - 1));
+  if (aligned > base)
+    munmap(base, aligned - base);
+  munmap(aligned + size, base + size - aligned);
+# ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+# endif
+  return aligned;
+#endif
+}
+
+static void
+arena_unmap(void* p, size_t size) {
+#ifdef _WIN32
+  (void) size;
+  free(p);
+#else
+  munmap(p, size);
+#endif
+}
+
+static arena_chunk*
+arena_new_chunk(size_t size, int dedicated) {
+  arena_chunk* chunk;
+  if (!dedicated && arena_spare != NULL) {
+    chunk = arena_spare;
+    arena_spare = NULL;
+  } else {
+    int huge = arena_huge_pages && !dedicated;
+    chunk = arena_map(size, &huge);
+    if (chunk == NULL)
+      return NULL;
+    chunk->size = size;
+    chunk->dedicated = dedicated;
+    chunk->huge = huge;
+  }
+  chunk->used = ARENA_CHUNK_HDR;
+  chunk->live = 0;
+  ARENA_POISON((char*) chunk + ARENA_CHUNK_HDR, chunk->size - ARENA_CHUNK_HDR);
+  chunk->prev = NULL;
+  chunk->next = arena_chunks;
+  if (arena_chunks != NULL)
+    arena_chunks->prev = chunk;
+  arena_chunks = chunk;
+  return chunk;
+}
+
+static void
+arena_release_chunk(arena_chunk* chunk) {
+  if (chunk->prev != NULL)
+    chunk->prev->next = chunk->next;
+  else
+    arena_chunks = chunk->next;
+  if (chunk->next != NULL)
+    chunk->next->prev = chunk->prev;
+  if (chunk == arena_current)
+    arena_current = NULL;
+  if (!chunk->dedicated && arena_spare == NULL)
+    arena_spare = chunk;
+  else
+    arena_unmap(chunk, chunk->size);
+}
+
+/* Mostly dead, and not going to fill up again because nothing is allocated
+ * from it any more. */
+static int
+arena_chunk_is_sparse(const arena_chunk* chunk) {
+  return !chunk->dedicated && chunk != arena_current && chunk->live * 4 < chunk->used;
+}
+
+static void
+arena_schedule_compaction(void) {
+  /* Compacted from a callback of its own, so nothing a request still has a
+   * pointer to can move under it. */
+  if (!arena_compacting && !uv_is_active((uv_handle_t*) &arena_compactor))
+    uv_timer_start(&arena_compactor, on_arena_compact, ARENA_COMPACT_DELAY_MS, 0);
+}
+
+static void*
+arena_alloc(size_t size) {
+  size_t need = ARENA_BLOB_HDR + ARENA_ROUND(size);
+  arena_chunk* chunk;
+
+  if (need > ARENA_MAX_SHARED) {
+    chunk = arena_new_chunk(ARENA_CHUNK_HDR + need, 1);
+  } else {
+    chunk = arena_current;
+    if (chunk == NULL || chunk->size - chunk->used < need) {
+      chunk = arena_new_chunk(ARENA_CHUNK_SIZE, 0);
+      if (chunk == NULL)
+        return NULL;
+      /* The chunk being retired stays until its last blob goes; it only has
+       * to be released here if that has already happened.  If it went sparse
+       * while it was current, nothing freed from it later may notice. */
+      arena_chunk* retired = arena_current;
+      arena_current = chunk;
+      if (retired != NULL && retired->live == 0)
+        arena_release_chunk(retired);
+      else if (retired != NULL && arena_chunk_is_sparse(retired))
+        arena_schedule_compaction();
+    }
+  }
+  if (chunk == NULL)
+    return NULL;
+
+  arena_blob* blob = (arena_blob*) ((char*) chunk + chunk->used);
+  ARENA_UNPOISON(blob, need);
+  blob->chunk = chunk;
+  blob->size = need;
+  chunk->used += need;
+  chunk->live += need;
+  return (char*) blob + ARENA_BLOB_HDR;
+}
+
+static arena_blob*
+arena_blob_of(void* p) {
+  return (arena_blob*) ((char*) p - ARENA_BLOB_HDR);
+}
+
+static void
+arena_free(void* p) {
+  if (p == NULL)
+    return;
+  arena_blob* blob = arena_blob_of(p);
+  arena_chunk* chunk = blob->chunk;
+
+  size_t size = blob->size;
+  chunk->live -= size;
+  /* The last blob handed out can simply be taken back, which is the common
+   * case of a freshly loaded body that turned out to be a duplicate. */
+  if ((char*) blob + size == (char*) chunk + chunk->used)
+    chunk->used -= size;
+  ARENA_POISON(blob, size);
+  if (chunk->live == 0) {
+    if (chunk == arena_current)
+      chunk->used = ARENA_CHUNK_HDR;
+    else
+      arena_release_chunk(chunk);
+  } else if (arena_chunk_is_sparse(chunk)) {
+    arena_schedule_compaction();
+  }
+}
+
+/* Not cryptographic: a match is always confirmed byte for byte, so this only
+ * has to spread typical file contents well and be quick over a megabyte. */
+static uint64_t
+hash_bytes(const char* p, size_t len) {
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t w;
+
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+    p += 8;
+    len -= 8;
+  }
+  w = 0;
+  memcpy(&w, p, len);
+  h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+/* Room for a rendered response header in front of a body of this type, with
+ * extra header lines of extra_len. */
+static size_t
+response_header_room(const char* ctype, size_t extra_len) {
+  return strlen(ctype) + extra_len + 128;
+}
+
+/* A body of len bytes to be filled in by the caller, with header_room bytes
+ * free in front of it. */
+static file_cache_body*
+new_file_cache_body(size_t len, size_t header_room) {
+  file_cache_body* body = arena_alloc(sizeof(file_cache_body) + header_room + len);
+  if (body == NULL)
+    return NULL;
+  memset(body, 0, sizeof(file_cache_body));
+  body->data = (char*) (body + 1) + header_room;
+  body->len = len;
+  body->header_room = header_room;
+  return body;
+}
+
+/* Takes ownership of a body fresh from new_file_cache_body, which is freed if
+ * an identical body is already cached and that one is returned instead. */
+static file_cache_body*
+intern_file_cache_body(file_cache_body* body) {
+  uint64_t hash = hash_bytes(body->data, body->len);
+  khint_t k = kh_get(body_cache, body_cache, hash);
+  if (k != kh_end(body_cache)) {
+    file_cache_body* found = kh_value(body_cache, k);
+    if (found->len == body->len && !memcmp(found->data, body->data, body->len)) {
+      arena_free(body);
+      found->refs++;
+      return found;
+    }
+  }
+
+  body->hash = hash;
+  body->refs = 1;
+  if (k == kh_end(body_cache)) {
+    int absent = 0;
+    k = kh_put(body_cache, body_cache, hash, &absent);
+    /* Not being indexed only costs sharing, so a failure here is not one. */
+    if (absent > 0) {
+      kh_value(body_cache, k) = body;
+      body->indexed = 1;
+    }
+  }
+  return body;
+}
+
+static void
+file_cache_body_unref(file_cache_body* body) {
+  if (body == NULL || --body->refs > 0)
+    return;
+  if (body->indexed) {
+    khint_t k = kh_get(body_cache, body_cache, body->hash);
+    if (k != kh_end(body_cache))
+      kh_del(body_cache, body_cache, k);
+  }
+  arena_free(body);
+}
+
 static void
 destroy_file_cache_entry(file_cache_entry* entry) {
   if (entry == NULL) {
     return;
   }
-  free(entry->path);
-  free(entry->body);
-  free(entry->header_keep_alive);
-  free(entry->header_close);
-  free(entry);
+  file_cache_body_unref(entry->shared);
+  arena_free(entry);
 }
 
 static void
@@ -277,69 +1083,320 @@ file_cache_entry_unref(file_cache_entry* entry) {
     destroy_file_cache_entry(entry);
 }
 
+/* Takes ownership of body, which is NULL for an empty file.  extra is header
+ * lines to add, as for render_ok_header. */
 static file_cache_entry*
-create_file_cache_entry(const char* path, const char* ctype, char* body, size_t body_len, time_t mtime) {
-  file_cache_entry* entry = calloc(1, sizeof(file_cache_entry));
-  if (entry == NULL) {
-    free(body);
+create_file_cache_entry(const char* path, const char* ctype, const char* extra, file_cache_body* body, size_t body_len, time_t mtime) {
+  char keep_alive[1024];
+  char closing[1024];
+
+  int keep_alive_len = render_ok_header(keep_alive, sizeof(keep_alive), body_len, ctype, extra, 1);
+  int close_len = render_ok_header(closing, sizeof(closing), body_len, ctype, extra, 0);
+  /* snprintf reports the length it wanted, not what it wrote; a length taken
+   * at face value would hand libuv a buffer descriptor past the allocation. */
+  if (keep_alive_len < 0 || (size_t) keep_alive_len >= sizeof(keep_alive) ||
+      close_len < 0 || (size_t) close_len >= sizeof(closing)) {
+    arena_free(body);
     return NULL;
   }
 
-  entry->path = strdup(path);
-  if (entry->path == NULL) {
-    free(body);
-    free(entry);
+  /* Before anything else is allocated, so that a duplicate body is still the
+   * last blob in its chunk and is taken straight back. */
+  file_cache_body* shared = body != NULL ? intern_file_cache_body(body) : NULL;
+
+  size_t path_len = strlen(path) + 1;
+  file_cache_entry* entry = arena_alloc(sizeof(file_cache_entry) + path_len + keep_alive_len + close_len);
+  if (entry == NULL) {
+    file_cache_body_unref(shared);
     return NULL;
   }
-  entry->body = body;
+  memset(entry, 0, sizeof(file_cache_entry));
+
+  char* p = (char*) (entry + 1);
+  entry->path = p;
+  memcpy(p, path, path_len);
+  p += path_len;
+  entry->header_keep_alive = p;
+  entry->header_keep_alive_len = (size_t) keep_alive_len;
+  memcpy(p, keep_alive, keep_alive_len);
+  p += keep_alive_len;
+  entry->header_close = p;
+  entry->header_close_len = (size_t) close_len;
+  memcpy(p, closing, close_len);
   entry->body_len = body_len;
   entry->mtime = mtime;
   entry->ctype = ctype;
 
-  size_t header_capacity = strlen(ctype) + 128;
-  entry->header_keep_alive = malloc(header_capacity);
-  entry->header_close = malloc(header_capacity);
-  if (entry->header_keep_alive == NULL || entry->header_close == NULL) {
-    destroy_file_cache_entry(entry);
-    return NULL;
+  if (shared != NULL) {
+    /* The first entry to load a body gets its header put in front of it;
+     * later ones only share the slot if their header is the same. */
+    if (shared->header_len == 0 && (size_t) keep_alive_len <= shared->header_room) {
+      memcpy(shared->data - keep_alive_len, keep_alive, keep_alive_len);
+      shared->header_len = (size_t) keep_alive_len;
+    }
+    entry->shared = shared;
+    entry->body = shared->data;
+    entry->contiguous = shared->header_len == (size_t) keep_alive_len &&
+      !memcmp(shared->data - keep_alive_len, keep_alive, keep_alive_len);
   }
+  return entry;
+}
 
-  int keep_alive_len = snprintf(
-      entry->header_keep_alive,
-      header_capacity,
-      "HTTP/1.1 200 OK\r\n"
-      "Content-Length: %zu\r\n"
-      "Content-Type: %s\r\n"
-      "Connection: keep-alive\r\n"
-      "\r\n",
-      body_len,
-      ctype);
-  int close_len = snprintf(
-      entry->header_close,
-      header_capacity,
-      "HTTP/1.1 200 OK\r\n"
-      "Content-Length: %zu\r\n"
-      "Content-Type: %s\r\n"
-      "Connection: close\r\n"
-      "\r\n",
-      body_len,
-      ctype);
-  /* snprintf reports the length it wanted, not what it wrote; a length taken
-   * at face value would hand libuv a buffer descriptor past the allocation. */
-  if (keep_alive_len < 0 || (size_t) keep_alive_len >= header_capacity ||
-      close_len < 0 || (size_t) close_len >= header_capacity) {
-    destroy_file_cache_entry(entry);
+/* Moves an idle entry, or the body only it uses, out of a sparse chunk into
+ * the current one.  Only the table's pointers need updating: nothing else may
+ * point at an entry without holding a reference, and this only moves
+ * unreferenced ones. */
+static void
+on_arena_compact(uv_timer_t* handle) {
+  khint_t k;
+
+  (void) handle;
+  arena_compacting = 1;
+  for (k = kh_begin(file_cache); k != kh_end(file_cache); ++k) {
+    if (!kh_exist(file_cache, k))
+      continue;
+    file_cache_entry* entry = kh_value(file_cache, k);
+    if (entry->refs > 0)
+      continue;
+
+    file_cache_body* body = entry->shared;
+    if (body != NULL && body->refs == 1 && arena_chunk_is_sparse(arena_blob_of(body)->chunk)) {
+      size_t size = arena_blob_of(body)->size - ARENA_BLOB_HDR;
+      file_cache_body* moved = arena_alloc(size);
+      if (moved == NULL)
+        break;
+      memcpy(moved, body, size);
+      moved->data = (char*) moved + (body->data - (char*) body);
+      if (moved->indexed) {
+        khint_t b = kh_get(body_cache, body_cache, moved->hash);
+        if (b != kh_end(body_cache))
+          kh_value(body_cache, b) = moved;
+      }
+      entry->shared = moved;
+      entry->body = moved->data;
+      arena_free(body);
+    }
+
+    if (arena_chunk_is_sparse(arena_blob_of(entry)->chunk)) {
+      size_t size = arena_blob_of(entry)->size - ARENA_BLOB_HDR;
+      file_cache_entry* moved = arena_alloc(size);
+      if (moved == NULL)
+        break;
+      memcpy(moved, entry, size);
+      moved->path = (char*) moved + (entry->path - (char*) entry);
+      moved->header_keep_alive = (char*) moved + (entry->header_keep_alive - (char*) entry);
+      moved->header_close = (char*) moved + (entry->header_close - (char*) entry);
+      kh_key(file_cache, k) = moved->path;
+      kh_value(file_cache, k) = moved;
+      arena_free(entry);
+    }
+  }
+  arena_compacting = 0;
+}
+
+static void
+on_missing_watch_event(uv_fs_event_t* handle, const char* filename, int events, int status) {
+  missing_watch* watch = (missing_watch*) handle->data;
+  (void) filename;
+  (void) events;
+  (void) status;
+  watch->generation++;
+  watch->fired = 1;
+}
+
+static void
+on_missing_watch_close(uv_handle_t* handle) {
+  free(handle->data);
+}
+
+static void
+release_missing_watch(missing_watch* watch) {
+  if (--watch->refs == 0)
+    uv_close((uv_handle_t*) &watch->handle, on_missing_watch_close);
+}
+
+/* Takes the watch out of the table.  It no longer sees events, so the entries
+ * still holding it are made stale. */
+static void
+drop_missing_watch(khint_t k) {
+  missing_watch* watch = kh_value(missing_watches, k);
+  kh_del(missing_watches, missing_watches, k);
+  uv_fs_event_stop(&watch->handle);
+  watch->generation++;
+  release_missing_watch(watch);
+}
+
+static void
+free_missing_path(missing_path* missing) {
+  if (missing->watch != NULL)
+    release_missing_watch(missing->watch);
+  free(missing);
+}
+
+static void
+flush_missing_paths(void) {
+  khint_t k;
+  for (k = kh_begin(missing_paths); k != kh_end(missing_paths); ++k) {
+    if (kh_exist(missing_paths, k))
+      free_missing_path(kh_value(missing_paths, k));
+  }
+  kh_clear(missing_paths, missing_paths);
+}
+
+/* Closes the watches no entry depends on, and returns how many. */
+static int
+drop_unused_missing_watches(void) {
+  int dropped = 0;
+  khint_t k;
+  for (k = kh_begin(missing_watches); k != kh_end(missing_watches); ++k) {
+    if (kh_exist(missing_watches, k) && kh_value(missing_watches, k)->refs == 1) {
+      drop_missing_watch(k);
+      dropped++;
+    }
+  }
+  return dropped;
+}
+
+/* Returns a watch on dir, set up if need be, or NULL with the error from
+ * setting it in *err.  *armed is set if it was set up just now, so events
+ * from before this call were not seen. */
+static missing_watch*
+watch_directory(const char* dir, size_t len, int* err, int* armed) {
+  char path[PATH_MAX];
+  memcpy(path, dir, len);
+  path[len] = '\0';
+
+  khint_t k = kh_get(missing_watches, missing_watches, path);
+  if (k != kh_end(missing_watches)) {
+    missing_watch* watch = kh_value(missing_watches, k);
+    if (!watch->fired)
+      return watch;
+    uv_fs_event_stop(&watch->handle);
+    *err = uv_fs_event_start(&watch->handle, on_missing_watch_event, watch->path, 0);
+    if (*err) {
+      drop_missing_watch(k);
+      return NULL;
+    }
+    watch->fired = 0;
+    *armed = 1;
+    return watch;
+  }
+
+  if (kh_size(missing_watches) >= MISSING_WATCH_MAX && !drop_unused_missing_watches()) {
+    flush_missing_paths();
+    drop_unused_missing_watches();
+  }
+  *err = UV_ENOMEM;
+  missing_watch* watch = malloc(sizeof(missing_watch) + len);
+  if (watch == NULL)
+    return NULL;
+  memcpy(watch->path, path, len + 1);
+  watch->generation = 0;
+  watch->fired = 0;
+  watch->refs = 1;
+  *err = uv_fs_event_init(loop, &watch->handle);
+  if (*err) {
+    free(watch);
     return NULL;
   }
-  entry->header_keep_alive_len = (size_t) keep_alive_len;
-  entry->header_close_len = (size_t) close_len;
-  return entry;
+  watch->handle.data = watch;
+  *err = uv_fs_event_start(&watch->handle, on_missing_watch_event, watch->path, 0);
+  if (*err == 0) {
+    int absent = 0;
+    k = kh_put(missing_watches, missing_watches, watch->path, &absent);
+    if (absent > 0) {
+      kh_value(missing_watches, k) = watch;
+      /* Watching is no reason to keep the loop alive. */
+      uv_unref((uv_handle_t*) &watch->handle);
+      *armed = 1;
+      return watch;
+    }
+    *err = UV_ENOMEM;
+  }
+  uv_close((uv_handle_t*) &watch->handle, on_missing_watch_close);
+  return NULL;
+}
+
+/* The file appearing, or any directory on the way to it, is an event in the
+ * deepest directory that already exists, so that is the one watched. */
+static missing_watch*
+watch_for_missing(const char* path, int* armed) {
+  size_t len = strlen(path);
+  int err = 0;
+
+  while (len > (size_t) static_dir_len) {
+    do
+      len--;
+    while (len > (size_t) static_dir_len && !IS_PATH_SEP(path[len]));
+    missing_watch* watch = watch_directory(path, len, &err, armed);
+    if (watch != NULL)
+      return watch;
+    if (err != UV_ENOENT && err != UV_ENOTDIR)
+      return NULL;
+  }
+  return NULL;
+}
+
+static void
+remember_missing(const char* path) {
+  if (kh_size(missing_paths) >= MISSING_MAX)
+    flush_missing_paths();
+
+  size_t len = strlen(path);
+  missing_path* missing = malloc(sizeof(missing_path) + len);
+  if (missing == NULL)
+    return;
+  memcpy(missing->path, path, len + 1);
+  int armed = 0;
+  missing->watch = watch_for_missing(path, &armed);
+  if (missing->watch != NULL) {
+    missing->watch->refs++;
+    /* A watch set after the open() failed would not have seen the file appear
+     * in between, so it is looked for once more. */
+    if (armed && access(path, F_OK) == 0) {
+      free_missing_path(missing);
+      return;
+    }
+  }
+  missing->generation = missing->watch ? missing->watch->generation : 0;
+  missing->expires_at = uv_now(loop) + (missing->watch ? MISSING_WATCHED_TTL_MS : CACHE_REVALIDATE_MS);
+
+  int absent = 0;
+  khint_t k = kh_put(missing_paths, missing_paths, missing->path, &absent);
+  if (absent < 0) {
+    free_missing_path(missing);
+    return;
+  }
+  if (!absent) {
+    free_missing_path(kh_value(missing_paths, k));
+    kh_key(missing_paths, k) = missing->path;
+  }
+  kh_value(missing_paths, k) = missing;
+}
+
+/* Whether path is known not to exist.  A stale entry is dropped. */
+static int
+path_is_missing(const char* path) {
+  khint_t k = kh_get(missing_paths, missing_paths, path);
+  if (k == kh_end(missing_paths))
+    return 0;
+  missing_path* missing = kh_value(missing_paths, k);
+  if (uv_now(loop) < missing->expires_at &&
+      (missing->watch == NULL || missing->watch->generation == missing->generation)) {
+    server_stats.missing_path_hits++;
+    return 1;
+  }
+  kh_del(missing_paths, missing_paths, k);
+  free_missing_path(missing);
+  return 0;
 }
 
 static file_cache_entry*
 load_file_cache_entry(const char* path, int* too_large) {
   int fd = open(path, O_RDONLY);
   if (fd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR)
+      remember_missing(path);
     return NULL;
   }
 
@@ -357,10 +1414,14 @@ load_file_cache_entry(const char* path, int* too_large) {
     return NULL;
   }
 
+  const char* ctype = find_content_type(path);
+  char cache_control[CACHE_CONTROL_LINE_MAX];
+  render_cache_control(cache_control, sizeof(cache_control), path + static_dir_len);
   size_t body_len = (size_t) st.st_size;
-  char* body = NULL;
+  file_cache_body* body = NULL;
   if (body_len > 0) {
-    body = malloc(body_len);
+    /* Read straight into cache storage, leaving room for the header. */
+    body = new_file_cache_body(body_len, response_header_room(ctype, strlen(cache_control)));
     if (body == NULL) {
       close(fd);
       return NULL;
@@ -368,11 +1429,11 @@ load_file_cache_entry(const char* path, int* too_large) {
 
     size_t offset = 0;
     while (offset < body_len) {
-      ssize_t nread = read(fd, body + offset, body_len - offset);
+      ssize_t nread = read(fd, body->data + offset, body_len - offset);
       if (nread < 0 && errno == EINTR)
         continue;
       if (nread <= 0) {
-        free(body);
+        arena_free(body);
         close(fd);
         return NULL;
       }
@@ -382,41 +1443,57 @@ load_file_cache_entry(const char* path, int* too_large) {
 
   close(fd);
 
-  return create_file_cache_entry(path, find_content_type(path), body, body_len, st.st_mtime);
+  return create_file_cache_entry(path, ctype, cache_control, body, body_len, st.st_mtime);
+}
+
+/* Whether what is on disk at path is still what entry was built from. */
+static int
+file_cache_entry_is_current(const file_cache_entry* entry, const char* path) {
+  struct stat st;
+  if (stat(path, &st) != 0 || st.st_mtime != entry->mtime)
+    return 0;
+  if (entry->listing)
+    return S_ISDIR(st.st_mode);
+  return S_ISREG(st.st_mode) && (size_t) st.st_size == entry->body_len;
 }
 
+/* Returns the cached entry for path if there is one and it is still current.
+ * One that is not is dropped, so the caller can load a replacement. */
 static file_cache_entry*
-get_or_load_file_cache_entry(const char* path, int* too_large) {
+lookup_file_cache_entry(const char* path) {
   khint_t k = kh_get(file_cache, file_cache, path);
-  if (k != kh_end(file_cache)) {
-    file_cache_entry* entry = kh_value(file_cache, k);
-    uint64_t now = uv_now(loop);
-    if (now - entry->checked_at < CACHE_REVALIDATE_MS) {
-      return entry;
-    }
-    struct stat st;
-    if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
-        (size_t) st.st_size == entry->body_len && st.st_mtime == entry->mtime) {
-      entry->checked_at = now;
-      return entry;
-    }
-    /* The disk copy changed or went away; drop the entry and reload.  It may
-     * still be referenced by responses in flight, so it is only marked dead
-     * here and freed by the last unref. */
-    kh_del(file_cache, file_cache, k);
-    entry->dead = 1;
-    if (entry->refs == 0)
-      destroy_file_cache_entry(entry);
+  if (k == kh_end(file_cache)) {
+    TRACE2(cache__miss, current_connection_id, path);
+    return NULL;
   }
 
-  file_cache_entry* entry = load_file_cache_entry(path, too_large);
-  if (entry == NULL) {
-    return NULL;
+  file_cache_entry* entry = kh_value(file_cache, k);
+  uint64_t now = uv_now(loop);
+  if (now - entry->checked_at < CACHE_REVALIDATE_MS) {
+    TRACE3(cache__hit, current_connection_id, path, entry->body_len);
+    return entry;
   }
-  entry->checked_at = uv_now(loop);
+  if (file_cache_entry_is_current(entry, path)) {
+    entry->checked_at = now;
+    TRACE3(cache__hit, current_connection_id, path, entry->body_len);
+    return entry;
+  }
+  TRACE2(cache__reload, current_connection_id, path);
+  /* The disk copy changed or went away; drop the entry and reload.  It may
+   * still be referenced by responses in flight, so it is only marked dead
+   * here and freed by the last unref. */
+  kh_del(file_cache, file_cache, k);
+  entry->dead = 1;
+  if (entry->refs == 0)
+    destroy_file_cache_entry(entry);
+  return NULL;
+}
 
+static file_cache_entry*
+insert_file_cache_entry(file_cache_entry* entry) {
   int absent = 0;
-  k = kh_put(file_cache, file_cache, entry->path, &absent);
+  entry->checked_at = uv_now(loop);
+  khint_t k = kh_put(file_cache, file_cache, entry->path, &absent);
   if (absent < 0) {
     destroy_file_cache_entry(entry);
     return NULL;
@@ -425,43 +1502,558 @@ get_or_load_file_cache_entry(const char* path, int* too_large) {
   return entry;
 }
 
-static void
-respond_with_cache_entry(http_request* request, file_cache_entry* entry) {
-  uv_buf_t bufs[2];
-  size_t nbufs = 0;
-  size_t total_len = 0;
+static file_cache_entry*
+get_or_load_file_cache_entry(const char* path, int* too_large) {
+  file_cache_entry* entry = lookup_file_cache_entry(path);
+  if (entry != NULL)
+    return entry;
 
-  if (request->keep_alive) {
-    bufs[nbufs++] = uv_buf_init(entry->header_keep_alive, (unsigned int) entry->header_keep_alive_len);
-    total_len += entry->header_keep_alive_len;
-  } else {
-    bufs[nbufs++] = uv_buf_init(entry->header_close, (unsigned int) entry->header_close_len);
-    total_len += entry->header_close_len;
-  }
-  /* A HEAD response is the header and nothing else. */
-  if (!request->head_only && entry->body_len > 0) {
-    bufs[nbufs++] = uv_buf_init(entry->body, (unsigned int) entry->body_len);
-    total_len += entry->body_len;
+  /* A file already open for streaming is known to be too big, which saves
+   * opening it just to find that out again. */
+  if (kh_get(open_files, open_files, path) != kh_end(open_files)) {
+    *too_large = 1;
+    return NULL;
   }
+  if (path_is_missing(path))
+    return NULL;
 
-#ifndef _WIN32
-  /* Header and body usually leave in one synchronous writev, which saves an
-   * allocation and a trip round the loop per response.  The buffers point into
-   * the cache entry, which outlives any partial write that has to be queued. */
-  int written = uv_try_write((uv_stream_t*) request->handle, bufs, (unsigned int) nbufs);
-  if (written == (int) total_len) {
-    destroy_request(request, !request->keep_alive);
+  entry = load_file_cache_entry(path, too_large);
+  if (entry == NULL)
+    return NULL;
+  TRACE3(cache__load, current_connection_id, path, entry->body_len);
+  return insert_file_cache_entry(entry);
+}
+
+static void
+open_file_unref(open_file* file) {
+  if (file == NULL || --file->refs > 0)
     return;
-  }
-  if (written < 0 && written != UV_EAGAIN) {
-    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(written), uv_strerror(written));
-    destroy_request(request, 1);
+  close_file(file->fd);
+  free(file);
+}
+
+/* Takes ownership of fd unless it returns NULL.  The caller holds the one
+ * reference the result starts with. */
+static open_file*
+create_open_file(const char* path, uv_file fd, const uv_stat_t* st) {
+  char keep_alive[1024];
+  char closing[1024];
+  const char* ctype = find_content_type(path);
+  char cache_control[CACHE_CONTROL_LINE_MAX];
+  render_cache_control(cache_control, sizeof(cache_control), path + static_dir_len);
+
+  int keep_alive_len = render_ok_header(keep_alive, sizeof(keep_alive), st->st_size, ctype, cache_control, 1);
+  int close_len = render_ok_header(closing, sizeof(closing), st->st_size, ctype, cache_control, 0);
+  if (keep_alive_len < 0 || (size_t) keep_alive_len >= sizeof(keep_alive) ||
+      close_len < 0 || (size_t) close_len >= sizeof(closing))
+    return NULL;
+
+  size_t path_len = strlen(path) + 1;
+  open_file* file = malloc(sizeof(open_file) + path_len + keep_alive_len + close_len);
+  if (file == NULL)
+    return NULL;
+  char* p = (char*) (file + 1);
+  file->path = p;
+  memcpy(p, path, path_len);
+  p += path_len;
+  file->header_keep_alive = p;
+  file->header_keep_alive_len = (size_t) keep_alive_len;
+  memcpy(p, keep_alive, keep_alive_len);
+  p += keep_alive_len;
+  file->header_close = p;
+  file->header_close_len = (size_t) close_len;
+  memcpy(p, closing, close_len);
+  file->fd = fd;
+  file->size = st->st_size;
+  file->mtime = (time_t) st->st_mtim.tv_sec;
+  file->ino = st->st_ino;
+  file->checked_at = file->used_at = uv_now(loop);
+  file->bypass = BYPASS_NONE;
+  file->refs = 1;
+  return file;
+}
+
+/* Switches a file of at least uncached_size to reading past the page cache:
+ * O_DIRECT if the file system allows it, or else dropping what each read
+ * brought in. */
+static void
+bypass_page_cache(open_file* file) {
+#ifdef O_DIRECT
+  int flags = fcntl(file->fd, F_GETFL);
+  if (flags >= 0 && fcntl(file->fd, F_SETFL, flags | O_DIRECT) == 0) {
+    file->bypass = BYPASS_DIRECT;
+    return;
+  }
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  file->bypass = BYPASS_DROP;
+#else
+  (void) file;
+#endif
+}
+
+/* Whether path still names the file that was opened.  A file replaced by a
+ * rename can keep its size and mtime, so the inode is compared too where
+ * stat() reports one. */
+static int
+open_file_is_current(const open_file* file) {
+  struct stat st;
+  if (stat(file->path, &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_mtime != file->mtime || (uint64_t) st.st_size != file->size)
+    return 0;
+#ifndef _WIN32
+  if ((uint64_t) st.st_ino != file->ino)
+    return 0;
+#endif
+  return 1;
+}
+
+/* Returns the open file for path if there is one and it is still current,
+ * without taking a reference. */
+static open_file*
+lookup_open_file(const char* path) {
+  khint_t k = kh_get(open_files, open_files, path);
+  if (k == kh_end(open_files))
+    return NULL;
+
+  open_file* file = kh_value(open_files, k);
+  uint64_t now = uv_now(loop);
+  if (now - file->checked_at >= CACHE_REVALIDATE_MS) {
+    if (!open_file_is_current(file)) {
+      TRACE2(cache__reload, current_connection_id, path);
+      /* Responses still streaming the old file keep its descriptor. */
+      kh_del(open_files, open_files, k);
+      open_file_unref(file);
+      return NULL;
+    }
+    file->checked_at = now;
+  }
+  file->used_at = now;
+  TRACE3(file__reuse, current_connection_id, path, file->size);
+  return file;
+}
+
+static void
+insert_open_file(open_file* file) {
+  int absent = 0;
+  if (kh_size(open_files) >= OPEN_FILE_MAX)
+    return;
+  khint_t k = kh_put(open_files, open_files, file->path, &absent);
+  if (absent < 0)
+    return;
+  if (!absent) {
+    /* Two requests missed at once and both opened the file; the later one
+     * replaces the other, which closes when its responses finish. */
+    open_file* old = kh_value(open_files, k);
+    kh_key(open_files, k) = file->path;
+    open_file_unref(old);
+  }
+  kh_value(open_files, k) = file;
+  file->refs++;
+}
+
+/* Closes descriptors nothing has streamed from in a while. */
+static void
+on_open_file_sweep(uv_timer_t* handle) {
+  uint64_t now = uv_now(loop);
+  khint_t k;
+
+  (void) handle;
+  for (k = kh_begin(open_files); k != kh_end(open_files); ++k) {
+    if (!kh_exist(open_files, k))
+      continue;
+    open_file* file = kh_value(open_files, k);
+    if (file->refs == 1 && now - file->used_at >= OPEN_FILE_IDLE_MS) {
+      kh_del(open_files, open_files, k);
+      open_file_unref(file);
+    }
+  }
+}
+
+/* Front cache: raw request target, exactly as received, to the entry it
+ * resolved to, so that a hot hit skips build_file_path and hashing the full
+ * path.  Direct mapped and small, since only the hottest targets need to be
+ * in it; a collision just evicts.  Each slot holds a reference, which keeps
+ * the entry in place (compaction leaves referenced entries alone) and alive
+ * after it has been displaced, when the dead flag tells the lookup to let go.
+ * Listings are not kept, as the same target renders differently by Accept. */
+#define TARGET_CACHE_SLOTS 256
+#define TARGET_CACHE_MAX_LEN 112
+
+typedef struct {
+  uint64_t hash;
+  file_cache_entry* entry;
+  size_t len;
+  char target[TARGET_CACHE_MAX_LEN];
+} target_cache_slot;
+
+static target_cache_slot target_cache[TARGET_CACHE_SLOTS];
+
+static target_cache_slot*
+target_cache_slot_for(const char* target, size_t len, uint64_t* hash) {
+  *hash = hash_bytes(target, len);
+  return &target_cache[*hash & (TARGET_CACHE_SLOTS - 1)];
+}
+
+/* An entry due for revalidation is not returned; the caller goes the long
+ * way round, which revalidates it and puts it back. */
+static file_cache_entry*
+lookup_target_cache(const char* target, size_t len) {
+  uint64_t hash;
+  target_cache_slot* slot;
+  file_cache_entry* entry;
+
+  if (len > TARGET_CACHE_MAX_LEN)
+    return NULL;
+  slot = target_cache_slot_for(target, len, &hash);
+  entry = slot->entry;
+  if (entry == NULL || slot->hash != hash || slot->len != len || memcmp(slot->target, target, len))
+    return NULL;
+  if (entry->dead) {
+    slot->entry = NULL;
+    file_cache_entry_unref(entry);
+    return NULL;
+  }
+  if (uv_now(loop) - entry->checked_at >= CACHE_REVALIDATE_MS)
+    return NULL;
+  return entry;
+}
+
+static void
+remember_target(const char* target, size_t len, file_cache_entry* entry) {
+  uint64_t hash;
+  target_cache_slot* slot;
+
+  if (len > TARGET_CACHE_MAX_LEN || entry->listing)
+    return;
+  slot = target_cache_slot_for(target, len, &hash);
+  if (slot->entry == entry && slot->len == len && !memcmp(slot->target, target, len))
+    return;
+  entry->refs++;
+  file_cache_entry_unref(slot->entry);
+  slot->entry = entry;
+  slot->hash = hash;
+  slot->len = len;
+  memcpy(slot->target, target, len);
+}
+
+/* Growable buffer that listings and other generated responses are rendered
+ * into.  An allocation failure is remembered rather than reported at every
+ * append, and checked once at the end. */
+typedef struct {
+  char* p;
+  size_t len;
+  size_t cap;
+  int failed;
+} text_buf;
+
+static void
+text_append(text_buf* b, const char* s, size_t n) {
+  if (b->failed)
     return;
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    char* grown;
+    while (cap < b->len + n)
+      cap *= 2;
+    grown = realloc(b->p, cap);
+    if (grown == NULL) {
+      b->failed = 1;
+      return;
+    }
+    b->p = grown;
+    b->cap = cap;
+  }
+  memcpy(b->p + b->len, s, n);
+  b->len += n;
+}
+
+static void
+text_puts(text_buf* b, const char* s) {
+  text_append(b, s, strlen(s));
+}
+
+/* Names come straight from the file system, so they are escaped for whatever
+ * they are embedded in: markup, a URL, or a JSON string. */
+static void
+listing_put_html(text_buf* b, const char* s, size_t n) {
+  size_t i;
+  for (i = 0; i < n; i++) {
+    switch (s[i]) {
+    case '&': text_puts(b, "&amp;"); break;
+    case '<': text_puts(b, "&lt;"); break;
+    case '>': text_puts(b, "&gt;"); break;
+    case '"': text_puts(b, "&quot;"); break;
+    case '\'': text_puts(b, "&#39;"); break;
+    default: text_append(b, s + i, 1); break;
+    }
+  }
+}
+
+static void
+listing_put_url(text_buf* b, const char* s) {
+  static const char hex[] = "0123456789ABCDEF";
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '-' || c == '_' || c == '.' || c == '~')
+      text_append(b, s, 1);
+    else {
+      char esc[3] = { '%', hex[c >> 4], hex[c & 15] };
+      text_append(b, esc, 3);
+    }
+  }
+}
+
+static void
+listing_put_json(text_buf* b, const char* s) {
+  for (; *s; s++) {
+    unsigned char c = (unsigned char) *s;
+    if (c == '"' || c == '\\') {
+      char esc[2] = { '\\', (char) c };
+      text_append(b, esc, 2);
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      text_puts(b, esc);
+    } else
+      text_append(b, s, 1);
+  }
+}
+
+/* Renders the listing of the directory named by the first dir_len bytes of
+ * key (which end in a separator) as HTML or as a JSON array.  The directory is
+ * stat()ed before it is read, so an entry added while it is being rendered
+ * moves the mtime past the recorded one and the next revalidation catches it. */
+static file_cache_entry*
+render_dir_listing(const char* key, size_t dir_len, int json) {
+  char dir[PATH_MAX];
+  char child[PATH_MAX];
+  struct stat st;
+  uv_fs_t req;
+  uv_dirent_t ent;
+  text_buf b = { NULL, 0, 0, 0 };
+  const char* url = key + static_dir_len;
+  size_t url_len = dir_len - static_dir_len;
+  int first = 1;
+  int r;
+
+  memcpy(dir, key, dir_len);
+  dir[dir_len] = 0;
+  if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+    return NULL;
+
+  r = uv_fs_scandir(loop, &req, dir, 0, NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return NULL;
+  }
+
+  if (json)
+    text_puts(&b, "[");
+  else {
+    text_puts(&b, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ");
+    listing_put_html(&b, url, url_len);
+    text_puts(&b, "</title></head>\n<body><h1>Index of ");
+    listing_put_html(&b, url, url_len);
+    text_puts(&b, "</h1>\n<ul>\n<li><a href=\"../\">../</a></li>\n");
   }
+
+  while (uv_fs_scandir_next(&req, &ent) != UV_EOF) {
+    struct stat cst;
+    size_t name_len = strlen(ent.name);
+    int is_dir;
+    char num[64];
+
+    if (dir_len + name_len >= sizeof(child))
+      continue;
+    memcpy(child, dir, dir_len);
+    memcpy(child + dir_len, ent.name, name_len + 1);
+    /* Follow links, since that is what serving the name would do; a dangling
+     * one would only ever 404, so it is left out. */
+    if (stat(child, &cst) != 0)
+      continue;
+    is_dir = S_ISDIR(cst.st_mode);
+
+    if (json) {
+      if (!first)
+        text_puts(&b, ",");
+      text_puts(&b, "\n{\"name\":\"");
+      listing_put_json(&b, ent.name);
+      snprintf(num, sizeof(num), "\",\"type\":\"%s\",\"size\":%" PRIu64 ",\"mtime\":%lld}",
+          is_dir ? "directory" : "file", (uint64_t) cst.st_size, (long long) cst.st_mtime);
+      text_puts(&b, num);
+    } else {
+      text_puts(&b, "<li><a href=\"");
+      listing_put_url(&b, ent.name);
+      if (is_dir)
+        text_puts(&b, "/");
+      text_puts(&b, "\">");
+      listing_put_html(&b, ent.name, name_len);
+      if (is_dir)
+        text_puts(&b, "/</a></li>\n");
+      else {
+        snprintf(num, sizeof(num), "</a> %" PRIu64 "</li>\n", (uint64_t) cst.st_size);
+        text_puts(&b, num);
+      }
+    }
+    first = 0;
+  }
+  uv_fs_req_cleanup(&req);
+
+  text_puts(&b, json ? "\n]\n" : "</ul>\n</body></html>\n");
+  if (b.failed) {
+    free(b.p);
+    return NULL;
+  }
+
+  const char* ctype = json ? LISTING_JSON_TYPE : LISTING_HTML_TYPE;
+  file_cache_body* body = new_file_cache_body(b.len, response_header_room(ctype, strlen(LISTING_VARY)));
+  if (body == NULL) {
+    free(b.p);
+    return NULL;
+  }
+  memcpy(body->data, b.p, b.len);
+  free(b.p);
+
+  /* A listing changes with the directory, and is not covered by the cache
+   * rules. */
+  file_cache_entry* entry = create_file_cache_entry(key, ctype, LISTING_VARY, body, b.len, st.st_mtime);
+  if (entry != NULL)
+    entry->listing = 1;
+  return entry;
+}
+
+/* index_path is a resolved target that names a directory, so it ends in the
+ * INDEX_FILE that build_file_path appended.  Listings are cached under the
+ * directory's own path with its trailing separator, which no file path ends
+ * in; the JSON rendering gets a second separator so the two are kept apart.
+ * Both still stat() as the directory when they are revalidated. */
+static file_cache_entry*
+get_or_load_dir_listing(const char* index_path, int json) {
+  char key[PATH_MAX];
+  size_t dir_len = strlen(index_path) - (sizeof(INDEX_FILE) - 1);
+  size_t key_len = dir_len;
+
+  memcpy(key, index_path, dir_len);
+  if (json)
+    key[key_len++] = '/';
+  key[key_len] = 0;
+
+  file_cache_entry* entry = lookup_file_cache_entry(key);
+  if (entry != NULL)
+    return entry;
+
+  entry = render_dir_listing(key, dir_len, json);
+  if (entry == NULL)
+    return NULL;
+  TRACE3(cache__load, current_connection_id, key, entry->body_len);
+  return insert_file_cache_entry(entry);
+}
+
+/* As sent, but for anything that would break the line up. */
+static void
+trace_put_field(const char* p, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) p[i];
+    if (c <= 0x20 || c == 0x7f)
+      fprintf(request_trace, "%%%02X", c);
+    else
+      putc(c, request_trace);
+  }
+}
+
+/* header is the start of the response, where the status is. */
+static void
+trace_request(http_request* request, const char* header, uint64_t total_len) {
+  int status = 0;
+
+  if (!memcmp(header, "HTTP/1.", 7) && header[8] == ' ')
+    status = (header[9] - '0') * 100 + (header[10] - '0') * 10 + (header[11] - '0');
+  fprintf(request_trace, "%" PRIu64 "\t%d\t%" PRIu64 "\t",
+      uv_hrtime() / 1000 - request_trace_started, status, total_len);
+  trace_put_field(request->method, request->method_len);
+  putc('\t', request_trace);
+  trace_put_field(request->path, request->path_len);
+  if (request->query != NULL) {
+    putc('?', request_trace);
+    trace_put_field(request->query, request->query_len);
+  }
+  putc('\n', request_trace);
+}
+
+static void
+flush_request_trace(void) {
+  if (fflush(request_trace)) {
+    fprintf(stderr, "Trace write error: %s\n", strerror(errno));
+    /* Whatever is still buffered is lost along with it. */
+    fclose(request_trace);
+    request_trace = NULL;
+    uv_timer_stop(&request_trace_flusher);
+  }
+}
+
+static void
+on_request_trace_flush(uv_timer_t* handle) {
+  (void) handle;
+  flush_request_trace();
+}
+
+static void
+respond_with_cache_entry(http_request* request, file_cache_entry* entry) {
+  uv_buf_t bufs[2];
+  size_t nbufs = 0;
+  size_t total_len = 0;
+
+  if (request->keep_alive && entry->contiguous && !request->head_only) {
+    /* The header is laid out right in front of the body. */
+    total_len = entry->header_keep_alive_len + entry->body_len;
+    bufs[nbufs++] = uv_buf_init(entry->body - entry->header_keep_alive_len, (unsigned int) total_len);
+  } else {
+    if (request->keep_alive) {
+      bufs[nbufs++] = uv_buf_init(entry->header_keep_alive, (unsigned int) entry->header_keep_alive_len);
+      total_len += entry->header_keep_alive_len;
+    } else {
+      bufs[nbufs++] = uv_buf_init(entry->header_close, (unsigned int) entry->header_close_len);
+      total_len += entry->header_close_len;
+    }
+    /* A HEAD response is the header and nothing else. */
+    if (!request->head_only && entry->body_len > 0) {
+      bufs[nbufs++] = uv_buf_init(entry->body, (unsigned int) entry->body_len);
+      total_len += entry->body_len;
+    }
+  }
+
+  respond_with_buffers(request, bufs, nbufs, total_len, entry);
+}
+
+/* Writes as much of a response as goes out synchronously.  Returns nonzero
+ * once the request is finished with, sent in full or failed; otherwise bufs
+ * and nbufs are left describing what is still to go. */
+static int
+write_now(http_request* request, uv_buf_t* bufs, size_t* nbufs, size_t total_len) {
+#ifndef _WIN32
+  /* Header and body usually leave in one synchronous writev, which saves an
+   * allocation and a trip round the loop per response. */
+  int written = uv_try_write((uv_stream_t*) request->handle, bufs, (unsigned int) *nbufs);
+  if (written == (int) total_len) {
+    TRACE2(write__complete, connection_id(request->handle), total_len);
+    if (tcp_info_every > 0)
+      sample_tcp_info(request->handle, total_len);
+    destroy_request(request, !request->keep_alive);
+    return 1;
+  }
+  if (written < 0 && written != UV_EAGAIN) {
+    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(written), uv_strerror(written));
+    destroy_request(request, 1);
+    return 1;
+  }
+  TRACE3(write__partial, connection_id(request->handle), written > 0 ? (size_t) written : 0, total_len);
   if (written > 0) {
     size_t remaining = (size_t) written;
     size_t i;
-    for (i = 0; i < nbufs && remaining > 0; i++) {
+    for (i = 0; i < *nbufs && remaining > 0; i++) {
       if (remaining >= bufs[i].len) {
         remaining -= bufs[i].len;
         bufs[i].base += bufs[i].len;
@@ -472,17 +2064,33 @@ respond_with_cache_entry(http_request* request, file_cache_entry* entry) {
         remaining = 0;
       }
     }
-    while (nbufs > 0 && bufs[0].len == 0) {
-      memmove(bufs, bufs + 1, sizeof(bufs[0]) * (nbufs - 1));
-      nbufs--;
+    while (*nbufs > 0 && bufs[0].len == 0) {
+      memmove(bufs, bufs + 1, sizeof(bufs[0]) * (*nbufs - 1));
+      (*nbufs)--;
     }
   }
+#else
+  (void) request;
+  (void) bufs;
+  (void) nbufs;
+  (void) total_len;
 #endif
+  return 0;
+}
 
-  http_response* response = calloc(1, sizeof(http_response));
+/* Queues what is left of a response.  entry, if set, is held until it has been
+ * written.  header, if set, is a buffer from buffer_pool, released then, and
+ * owned is handed to release, if set, then. */
+static void
+queue_response(http_request* request, uv_buf_t* bufs, size_t nbufs, size_t total_len, file_cache_entry* entry,
+    char* header, void* owned, void (*release)(void*)) {
+  http_response* response = pool_get_zeroed(&response_pool);
   if (response == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    response_error(request->handle, 500, "Internal Server Error", NULL);
+    pool_put(&buffer_pool, header);
+    if (release != NULL)
+      release(owned);
+    send_status(request->handle, 500);
     destroy_request(request, 1);
     return;
   }
@@ -491,8 +2099,13 @@ respond_with_cache_entry(http_request* request, file_cache_entry* entry) {
   response->request = request;
   response->handle = request->handle;
   response->write_req.data = response;
+  response->response_size = total_len;
+  response->header = header;
+  response->owned = owned;
+  response->release = release;
   response->cache_entry = entry;
-  entry->refs++;
+  if (entry != NULL)
+    entry->refs++;
 
   int r = uv_write(&response->write_req, (uv_stream_t*) request->handle, bufs, (unsigned int) nbufs, on_write_cached);
   if (r) {
@@ -502,61 +2115,582 @@ respond_with_cache_entry(http_request* request, file_cache_entry* entry) {
 }
 
 static void
-on_fs_open(uv_fs_t* req) {
-  http_request* request = (http_request*) req->data;
-  ssize_t result = req->result;
+on_write_scheduler(uv_idle_t* handle) {
+  /* Only what was ready when the pass began: a response finishing a slice
+   * during it waits for the next iteration. */
+  http_response* list = ready_head;
+  ready_head = ready_tail = NULL;
+  while (list != NULL) {
+    http_response* response = list;
+    list = response->next_ready;
+    send_slice(response);
+  }
+  if (ready_head == NULL)
+    uv_idle_stop(handle);
+}
 
-  uv_fs_req_cleanup(req);
-  free(req);
-  if (result < 0) {
-    fprintf(stderr, "Open error: %s: %s: %s\n", request->file_path, uv_err_name(result), uv_strerror(result));
-    response_error(request->handle, 404, "Not Found", NULL);
-    destroy_request(request, 1);
+static void
+on_write_throttle(uv_timer_t* handle) {
+  http_response* list = throttled;
+  (void) handle;
+  throttled = NULL;
+  while (list != NULL) {
+    http_response* response = list;
+    list = response->next_ready;
+    make_ready(response);
+  }
+}
+
+static void
+make_ready(http_response* response) {
+  response->next_ready = NULL;
+  if (ready_tail != NULL)
+    ready_tail->next_ready = response;
+  else
+    ready_head = response;
+  ready_tail = response;
+  if (!uv_is_active((uv_handle_t*) &write_scheduler))
+    uv_idle_start(&write_scheduler, on_write_scheduler);
+}
+
+/* Whether the response reads its file with O_DIRECT, in whole blocks. */
+static int
+reads_direct(const http_response* response) {
+  return response->open_file != NULL && response->open_file->bypass == BYPASS_DIRECT;
+}
+
+/* How much the response may send now under the rate cap.  The allowance
+ * builds up for at most a tenth of a second, and to at least one chunk, so a
+ * response that has been waiting does not then burst. */
+static uint64_t
+write_allowance(http_response* response) {
+  if (write_rate == 0)
+    return UINT64_MAX;
+  uint64_t now = uv_now(loop);
+  uint64_t chunk = reads_direct(response) ? DIRECT_ALIGN : WRITE_BUF_SIZE;
+  uint64_t cap = write_rate / 10 > chunk ? write_rate / 10 : chunk;
+  response->tokens += (now - response->refilled_at) * write_rate / 1000;
+  response->refilled_at = now;
+  if (response->tokens > cap)
+    response->tokens = cap;
+  return response->tokens;
+}
+
+/* Sends the next slice of a response: the next chunk read from its file, or
+ * up to write_quota bytes of what it has in memory. */
+static void
+send_slice(http_response* response) {
+  uint64_t slice = response->response_size - response->response_offset;
+  uint64_t allowed = write_allowance(response);
+  int r;
+
+  /* A direct read cannot be made smaller than a block, so it waits for a
+   * block's worth rather than overdrawing the allowance. */
+  if (allowed == 0 || (reads_direct(response) && allowed < DIRECT_ALIGN)) {
+    server_stats.writes_throttled++;
+    response->next_ready = throttled;
+    throttled = response;
+    if (!uv_is_active((uv_handle_t*) &write_throttle))
+      uv_timer_start(&write_throttle, on_write_throttle, WRITE_THROTTLE_MS, 0);
+    return;
+  }
+  if (write_quota > 0 && slice > write_quota)
+    slice = write_quota;
+  if (slice > allowed)
+    slice = allowed;
+  server_stats.write_slices++;
+
+  if (response->open_file != NULL) {
+    if (reads_direct(response)) {
+      /* Whole blocks only, so the offset stays on a block boundary; the read
+       * that reaches the end of the file comes back short.  Rounding up only
+       * happens there, or below a block of quota, and the allowance is at
+       * least a block. */
+      if (slice > DIRECT_BUF_SIZE)
+        slice = DIRECT_BUF_SIZE;
+      slice = slice < DIRECT_ALIGN ? DIRECT_ALIGN : slice & ~(uint64_t) (DIRECT_ALIGN - 1);
+    } else if (slice > WRITE_BUF_SIZE)
+      slice = WRITE_BUF_SIZE;
+    if (write_rate > 0)
+      response->tokens -= slice;
+    response->buf.len = (size_t) slice;
+    /* The descriptor may be shared with other responses, so every read says
+     * where it is from rather than relying on the file position. */
+    r = uv_fs_read(loop, &response->read_req, response->fd, &response->buf, 1, response->response_offset, on_fs_read);
+    if (r) {
+      fprintf(stderr, "File read error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      destroy_response(response, 1);
+    }
     return;
   }
 
-  uv_fs_t stat_req;
-  int r = uv_fs_fstat(loop, &stat_req, result, NULL);
-  if (r < 0) {
-    fprintf(stderr, "Stat error: %s: %s: %s\n", request->file_path, uv_err_name(r), uv_strerror(r));
-    uv_fs_req_cleanup(&stat_req);
-    close_file((uv_file) result);
-    response_error(request->handle, 404, "Not Found", NULL);
+  uv_buf_t bufs[3];
+  unsigned int nbufs = 0;
+  uint64_t left = slice;
+  while (left > 0) {
+    uv_buf_t* b = &response->pending[response->pending_first];
+    size_t take = b->len < left ? b->len : (size_t) left;
+    bufs[nbufs++] = uv_buf_init(b->base, (unsigned int) take);
+    b->base += take;
+    b->len -= take;
+    left -= take;
+    if (b->len == 0)
+      response->pending_first++;
+  }
+  if (write_rate > 0)
+    response->tokens -= slice;
+  response->response_offset += slice;
+  r = uv_write(&response->write_req, (uv_stream_t*) response->handle, bufs, nbufs, on_write_slice);
+  if (r) {
+    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    destroy_response(response, 1);
+  }
+}
+
+/* Without a quota the next slice goes out at once, as it always used to. */
+static void
+next_slice(http_response* response) {
+  if (write_quota == 0)
+    send_slice(response);
+  else
+    make_ready(response);
+}
+
+static void
+on_write_slice(uv_write_t* req, int status) {
+  http_response* response = (http_response*) req->data;
+
+  if (status != 0) {
+    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(status), uv_strerror(status));
+    destroy_response(response, 1);
+    return;
+  }
+  if (response->response_offset >= response->response_size) {
+    TRACE2(write__complete, connection_id(response->handle), response->response_size);
+    if (tcp_info_every > 0)
+      sample_tcp_info(response->handle, response->response_size);
+    destroy_response(response, !response->request->keep_alive);
+    return;
+  }
+  next_slice(response);
+}
+
+/* Sends a response too big for one quota a slice at a time; the first goes
+ * out now.  The buffers stay valid for as long as entry is held; header and
+ * owned are released at the end as by queue_response. */
+static void
+schedule_response(http_request* request, uv_buf_t* bufs, size_t nbufs, size_t total_len, file_cache_entry* entry,
+    char* header, void* owned, void (*release)(void*)) {
+  http_response* response = pool_get_zeroed(&response_pool);
+  if (response == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    pool_put(&buffer_pool, header);
+    if (release != NULL)
+      release(owned);
+    send_status(request->handle, 500);
     destroy_request(request, 1);
     return;
   }
 
-  uint64_t response_size = stat_req.statbuf.st_size;
-  int regular = S_ISREG(stat_req.statbuf.st_mode);
-  uv_fs_req_cleanup(&stat_req);
+  ASSERT(nbufs <= sizeof(response->pending) / sizeof(response->pending[0]));
+  response->fd = -1;
+  response->request = request;
+  response->handle = request->handle;
+  response->write_req.data = response;
+  response->response_size = total_len;
+  memcpy(response->pending, bufs, sizeof(bufs[0]) * nbufs);
+  response->npending = (unsigned int) nbufs;
+  response->tokens = write_rate / 10;
+  response->refilled_at = uv_now(loop);
+  response->header = header;
+  response->owned = owned;
+  response->release = release;
+  response->cache_entry = entry;
+  if (entry != NULL)
+    entry->refs++;
+  send_slice(response);
+}
 
-  /* Opening a directory succeeds on Linux, but reading it fails afterwards,
-   * by which point a 200 and a Content-Length have already gone out. */
-  if (!regular) {
-    close_file((uv_file) result);
-    response_error(request->handle, 404, "Not Found", NULL);
+/* Sends a complete response.  The buffers have to stay valid for as long as
+ * entry is held, or for good if there is no entry, as with a site pack: they
+ * are queued as they are if they do not all go at once. */
+static void
+respond_with_buffers(http_request* request, uv_buf_t* bufs, size_t nbufs, size_t total_len, file_cache_entry* entry) {
+  TRACE2(write__start, connection_id(request->handle), total_len);
+  if (request_trace != NULL)
+    trace_request(request, bufs[0].base, total_len);
+  if (write_quota > 0 && total_len > write_quota) {
+    schedule_response(request, bufs, nbufs, total_len, entry, NULL, NULL, NULL);
+    return;
+  }
+  if (write_now(request, bufs, &nbufs, total_len))
+    return;
+  queue_response(request, bufs, nbufs, total_len, entry, NULL, NULL, NULL);
+}
+
+/* Sends a response rendered for this request alone; buf is malloc()ed and
+ * freed once written. */
+static void
+respond_with_owned_buffer(http_request* request, char* buf, size_t len) {
+  TRACE2(write__start, connection_id(request->handle), len);
+  if (request_trace != NULL)
+    trace_request(request, buf, len);
+  TRACE3(write__partial, connection_id(request->handle), (size_t) 0, len);
+  uv_buf_t b = uv_buf_init(buf, (unsigned int) len);
+  queue_response(request, &b, 1, len, NULL, NULL, buf, free);
+}
+
+/* Error responses, rendered once at startup in both a closing and a persistent
+ * form.  A 4xx for a request that parsed is the client's problem with that one
+ * target, so the connection can carry on; anything else closes it.  With -e a
+ * page called after the code, like 404.html, in the root is served instead of
+ * the canned text.  It is an ordinary cache entry, so it is revalidated like
+ * one; its absence is remembered for as long. */
+typedef struct {
+  int code;
+  const char* reason;
+  int persistent;
+  int missing;
+  uint64_t checked_at;
+  size_t header_close_len;
+  size_t close_len;
+  size_t header_keep_alive_len;
+  size_t keep_alive_len;
+  char close[256];
+  char keep_alive[256];
+} status_response;
+
+static status_response status_responses[] = {
+  { .code = 400, .reason = "Bad Request", .persistent = 1 },
+  { .code = 404, .reason = "Not Found", .persistent = 1 },
+  { .code = 414, .reason = "URI Too Long", .persistent = 1 },
+  { .code = 431, .reason = "Request Header Fields Too Large", .persistent = 0 },
+  { .code = 500, .reason = "Internal Server Error", .persistent = 0 },
+  { .code = 501, .reason = "Not Implemented", .persistent = 0 },
+};
+
+static int error_pages = 0;
+
+static int
+render_status_header(char* buf, size_t cap, const status_response* status, uint64_t body_len, const char* ctype, int keep_alive) {
+  return snprintf(buf, cap,
+      "HTTP/1.0 %d %s\r\n"
+      "Content-Length: %" PRIu64 "\r\n"
+      "Content-Type: %s\r\n"
+      "Connection: %s\r\n"
+      "\r\n",
+      status->code, status->reason, body_len, ctype, keep_alive ? "keep-alive" : "close");
+}
+
+static void
+render_status_responses(void) {
+  size_t i;
+  for (i = 0; i < sizeof(status_responses) / sizeof(status_responses[0]); i++) {
+    status_response* status = &status_responses[i];
+    size_t reason_len = strlen(status->reason);
+    int n;
+
+    n = render_status_header(status->close, sizeof(status->close), status, reason_len, "text/plain; charset=utf-8", 0);
+    ASSERT(n > 0 && (size_t) n + reason_len < sizeof(status->close));
+    memcpy(status->close + n, status->reason, reason_len);
+    status->header_close_len = (size_t) n;
+    status->close_len = (size_t) n + reason_len;
+
+    n = render_status_header(status->keep_alive, sizeof(status->keep_alive), status, reason_len, "text/plain; charset=utf-8", 1);
+    ASSERT(n > 0 && (size_t) n + reason_len < sizeof(status->keep_alive));
+    memcpy(status->keep_alive + n, status->reason, reason_len);
+    status->header_keep_alive_len = (size_t) n;
+    status->keep_alive_len = (size_t) n + reason_len;
+  }
+}
+
+/* Anything not in the table is answered as a 404. */
+static status_response*
+find_status_response(int code) {
+  size_t i;
+  for (i = 0; i < sizeof(status_responses) / sizeof(status_responses[0]); i++)
+    if (status_responses[i].code == code)
+      return &status_responses[i];
+  return find_status_response(404);
+}
+
+/* For when there is no request to answer, or no trusting its state: the head
+ * did not parse, or something failed underneath a response.  The caller
+ * closes the connection.  The buffer is static, so only a write that cannot
+ * finish at once costs an allocation, of the write request. */
+static void
+send_status(uv_handle_t* handle, int code) {
+  status_response* status = find_status_response(code);
+  uv_buf_t buf = uv_buf_init(status->close, (unsigned int) status->close_len);
+  int r;
+
+#ifndef _WIN32
+  r = uv_try_write((uv_stream_t*) handle, &buf, 1);
+  if (r == (int) buf.len)
+    return;
+  if (r < 0 && r != UV_EAGAIN)
+    return;
+  if (r > 0) {
+    buf.base += r;
+    buf.len -= (unsigned int) r;
+  }
+#endif
+
+  uv_write_t* write_req = pool_get(&write_req_pool);
+  if (write_req == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    return;
+  }
+  r = uv_write(write_req, (uv_stream_t*) handle, &buf, 1, on_write_status);
+  if (r) {
+    fprintf(stderr, "Write error %s: %s\n", uv_err_name(r), uv_strerror(r));
+    pool_put(&write_req_pool, write_req);
+  }
+}
+
+static file_cache_entry*
+find_error_page(status_response* status) {
+  char path[PATH_MAX];
+  int too_large = 0;
+  file_cache_entry* entry;
+  uint64_t now = uv_now(loop);
+
+  if (status->missing && now - status->checked_at < CACHE_REVALIDATE_MS)
+    return NULL;
+  snprintf(path, sizeof(path), "%s/%d.html", static_dir, status->code);
+  entry = get_or_load_file_cache_entry(path, &too_large);
+  status->missing = entry == NULL;
+  status->checked_at = now;
+  return entry;
+}
+
+/* The page's body is in the cache; only the header is made up here, on the
+ * stack, and copied out only if it does not go out at once. */
+static void
+respond_with_error_page(http_request* request, const status_response* status, file_cache_entry* page) {
+  char header[1024];
+  uv_buf_t bufs[2];
+  size_t nbufs = 0;
+  size_t total_len;
+  int n = render_status_header(header, sizeof(header), status, page->body_len, page->ctype, request->keep_alive);
+  if (n < 0 || (size_t) n >= sizeof(header)) {
+    send_status(request->handle, 500);
     destroy_request(request, 1);
     return;
   }
 
-  const char* ctype = find_content_type(request->file_path);
+  bufs[nbufs++] = uv_buf_init(header, (unsigned int) n);
+  total_len = (size_t) n;
+  if (!request->head_only && page->body_len > 0) {
+    bufs[nbufs++] = uv_buf_init(page->body, (unsigned int) page->body_len);
+    total_len += page->body_len;
+  }
+
+  TRACE2(write__start, connection_id(request->handle), total_len);
+  if (request_trace != NULL)
+    trace_request(request, header, total_len);
+  if (write_now(request, bufs, &nbufs, total_len))
+    return;
 
-  http_response* response = calloc(1, sizeof(http_response));
+  char* rest = NULL;
+  if (bufs[0].base >= header && bufs[0].base < header + n) {
+    /* Fits: the header buffer is smaller than a pooled one. */
+    rest = pool_get(&buffer_pool);
+    if (rest == NULL) {
+      fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+      destroy_request(request, 1);
+      return;
+    }
+    memcpy(rest, bufs[0].base, bufs[0].len);
+    bufs[0].base = rest;
+  }
+  queue_response(request, bufs, nbufs, total_len, page, rest, NULL, NULL);
+}
+
+static void
+respond_status(http_request* request, int status_code) {
+  status_response* status = find_status_response(status_code);
+  file_cache_entry* page = NULL;
+
+  if (!status->persistent)
+    request->keep_alive = 0;
+  if (error_pages)
+    page = find_error_page(status);
+  if (page != NULL) {
+    respond_with_error_page(request, status, page);
+    return;
+  }
+
+  uv_buf_t buf;
+  if (request->keep_alive)
+    buf = uv_buf_init(status->keep_alive,
+        (unsigned int) (request->head_only ? status->header_keep_alive_len : status->keep_alive_len));
+  else
+    buf = uv_buf_init(status->close,
+        (unsigned int) (request->head_only ? status->header_close_len : status->close_len));
+  respond_with_buffers(request, &buf, 1, buf.len, NULL);
+}
+
+static int
+site_pack_span_ok(const site_pack_span* span, uint64_t limit) {
+  return span->offset >= sizeof(site_pack_header) && span->offset <= limit &&
+    span->len <= limit - span->offset;
+}
+
+static int
+site_pack_variant_ok(const site_pack_variant* v, uint64_t limit) {
+  /* The keep-alive header has to run straight into the body, since the two
+   * are sent as one span. */
+  return site_pack_span_ok(&v->header_close, limit) && v->header_close.len > 0 &&
+    site_pack_span_ok(&v->header_keep_alive, limit) && v->header_keep_alive.len > 0 &&
+    site_pack_span_ok(&v->body, limit) && v->body.len <= SITE_PACK_MAX_BODY &&
+    v->header_keep_alive.offset + v->header_keep_alive.len == v->body.offset;
+}
+
+static int
+load_site_pack(const char* path) {
+#ifdef _WIN32
+  fprintf(stderr, "Site packs are not supported on this platform: %s\n", path);
+  return -1;
+#else
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Open error: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < sizeof(site_pack_header)) {
+    fprintf(stderr, "Not a site pack: %s\n", path);
+    close(fd);
+    return -1;
+  }
+  /* Shared, so every server mapping the same pack shares its page cache. */
+  void* map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Map error: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  const site_pack_header* header = map;
+  uint64_t size = (uint64_t) st.st_size;
+  if (memcmp(header->magic, SITE_PACK_MAGIC, sizeof(header->magic)) ||
+      header->version != SITE_PACK_VERSION ||
+      header->size != size ||
+      header->nslots == 0 || (header->nslots & (header->nslots - 1)) ||
+      header->slots_offset % 8 || header->slots_offset > size ||
+      (size - header->slots_offset) / sizeof(site_pack_slot) != header->nslots) {
+    fprintf(stderr, "Not a site pack, or a different version: %s\n", path);
+    munmap(map, (size_t) st.st_size);
+    return -1;
+  }
+
+  const site_pack_slot* slots = (const site_pack_slot*) ((const char*) map + header->slots_offset);
+  uint32_t i;
+  uint32_t nfiles = 0;
+  for (i = 0; i < header->nslots; i++) {
+    const site_pack_slot* slot = &slots[i];
+    if (slot->hash == 0)
+      continue;
+    const site_pack_variant* gz = &slot->variants[SITE_PACK_GZIP];
+    if (!site_pack_span_ok(&slot->path, header->slots_offset) ||
+        !site_pack_variant_ok(&slot->variants[SITE_PACK_IDENTITY], header->slots_offset) ||
+        (gz->header_close.len != 0 && !site_pack_variant_ok(gz, header->slots_offset))) {
+      fprintf(stderr, "Corrupt site pack: %s\n", path);
+      munmap(map, (size_t) st.st_size);
+      return -1;
+    }
+    nfiles++;
+  }
+  /* A full table would leave a lookup for a missing path nowhere to stop. */
+  if (nfiles == header->nslots) {
+    fprintf(stderr, "Corrupt site pack: %s\n", path);
+    munmap(map, (size_t) st.st_size);
+    return -1;
+  }
+
+  site_pack_map = map;
+  site_pack = header;
+  site_pack_slots = slots;
+  fprintf(stderr, "Serving %u files from %s\n", nfiles, path);
+  return 0;
+#endif
+}
+
+static const site_pack_slot*
+find_site_pack_slot(const char* path) {
+  size_t len = strlen(path);
+  uint64_t hash = site_pack_hash(path, len);
+  uint32_t mask = site_pack->nslots - 1;
+  uint32_t k = (uint32_t) hash & mask;
+
+  for (;;) {
+    const site_pack_slot* slot = &site_pack_slots[k];
+    if (slot->hash == 0)
+      return NULL;
+    if (slot->hash == hash && slot->path.len == len &&
+        !memcmp(site_pack_map + slot->path.offset, path, len))
+      return slot;
+    k = (k + 1) & mask;
+  }
+}
+
+static void
+respond_from_site_pack(http_request* request) {
+  const site_pack_slot* slot = find_site_pack_slot(request->file_path);
+  if (slot == NULL) {
+    respond_status(request, 404);
+    return;
+  }
+
+  const site_pack_variant* v = &slot->variants[SITE_PACK_IDENTITY];
+  if (slot->variants[SITE_PACK_GZIP].header_close.len > 0 &&
+      header_lists(request, HEADER_ACCEPT_ENCODING, "gzip"))
+    v = &slot->variants[SITE_PACK_GZIP];
+
+  uv_buf_t bufs[2];
+  size_t nbufs = 0;
+  size_t total_len;
+  if (request->head_only) {
+    const site_pack_span* h = request->keep_alive ? &v->header_keep_alive : &v->header_close;
+    total_len = (size_t) h->len;
+    bufs[nbufs++] = uv_buf_init((char*) site_pack_map + h->offset, (unsigned int) total_len);
+  } else if (request->keep_alive) {
+    total_len = (size_t) (v->header_keep_alive.len + v->body.len);
+    bufs[nbufs++] = uv_buf_init((char*) site_pack_map + v->header_keep_alive.offset, (unsigned int) total_len);
+  } else {
+    total_len = (size_t) (v->header_close.len + v->body.len);
+    bufs[nbufs++] = uv_buf_init((char*) site_pack_map + v->header_close.offset, (unsigned int) v->header_close.len);
+    if (v->body.len > 0)
+      bufs[nbufs++] = uv_buf_init((char*) site_pack_map + v->body.offset, (unsigned int) v->body.len);
+  }
+  respond_with_buffers(request, bufs, nbufs, total_len, NULL);
+}
+
+/* Streams a file too big for the cache from a descriptor that is already
+ * open, taking a reference to it for the length of the response. */
+static void
+respond_from_open_file(http_request* request, open_file* file) {
+  http_response* response = pool_get_zeroed(&response_pool);
   if (response == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    close_file((uv_file) result);
-    response_error(request->handle, 500, "Internal Server Error", NULL);
+    send_status(request->handle, 500);
     destroy_request(request, 1);
     return;
   }
-  response->response_size = response_size;
-  response->fd = result;
+  file->refs++;
+  response->open_file = file;
+  response->fd = file->fd;
+  response->response_size = file->size;
   response->request = request;
   response->handle = request->handle;
-  response->pbuf = malloc(WRITE_BUF_SIZE);
+  if (file->bypass == BYPASS_DIRECT)
+    response->pbuf = pool_get(&direct_pool);
+  else
+    response->pbuf = pool_get(&buffer_pool);
   if (response->pbuf == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    response_error(request->handle, 500, "Internal Server Error", NULL);
+    send_status(request->handle, 500);
     destroy_response(response, 1);
     return;
   }
@@ -564,64 +2698,101 @@ on_fs_open(uv_fs_t* req) {
   response->read_req.data = response;
   response->write_req.data = response;
 
-  char bufline[1024];
-  int nbuf = snprintf(bufline,
-      sizeof(bufline),
-      "HTTP/1.1 200 OK\r\n"
-      "Content-Length: %" PRId64 "\r\n"
-      "Content-Type: %s\r\n"
-      "Connection: %s\r\n"
-      "\r\n",
-      response_size,
-      ctype,
-      (request->keep_alive ? "keep-alive" : "close"));
-  if (nbuf < 0 || (size_t) nbuf >= sizeof(bufline)) {
-    fprintf(stderr, "Header too long: %s\n", request->file_path);
-    response_error(request->handle, 500, "Internal Server Error", NULL);
-    destroy_response(response, 1);
-    return;
+  uv_buf_t buf;
+  if (request->keep_alive)
+    buf = uv_buf_init(file->header_keep_alive, (unsigned int) file->header_keep_alive_len);
+  else
+    buf = uv_buf_init(file->header_close, (unsigned int) file->header_close_len);
+  size_t header_len = buf.len;
+  TRACE2(write__start, connection_id(request->handle), (uint64_t) header_len + (request->head_only ? 0 : file->size));
+  if (request_trace != NULL)
+    trace_request(request, buf.base, (uint64_t) header_len + (request->head_only ? 0 : file->size));
+  if (socket_tuning.cork) {
+    set_cork(request->handle, 1);
+    response->corked = 1;
   }
 
-  uv_buf_t buf = uv_buf_init(bufline, nbuf);
-  int written = 0;
-
+  int r;
 #ifndef _WIN32
   /* A header this small almost always leaves in one synchronous write, which
-   * saves an allocation and a trip round the loop per response.  uv_try_write
-   * is safe with a stack buffer precisely because it does not queue. */
+   * saves a trip round the loop per response. */
   r = uv_try_write((uv_stream_t*) request->handle, &buf, 1);
-  if (r == nbuf) {
+  if (r == (int) header_len) {
     start_body(response);
     return;
   }
-  if (r > 0)
-    written = r;
-  else if (r < 0 && r != UV_EAGAIN) {
+  if (r > 0) {
+    TRACE3(write__partial, connection_id(request->handle), (size_t) r, header_len);
+    buf.base += r;
+    buf.len -= r;
+  } else if (r < 0 && r != UV_EAGAIN) {
+    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    destroy_response(response, 1);
+    return;
+  }
+#endif
+
+  /* The header lives in the open file, which the response holds, so what is
+   * left of it can be queued as it is.  It needs its own request, because
+   * response->write_req is still to be used for the body chunks. */
+  response->header_req.data = response;
+  r = uv_write(&response->header_req, (uv_stream_t*) request->handle, &buf, 1, on_write_header);
+  if (r) {
     fprintf(stderr, "Write error: %s: %s\n", uv_err_name(r), uv_strerror(r));
     destroy_response(response, 1);
+  }
+}
+
+static void
+on_fs_open(uv_fs_t* req) {
+  http_request* request = (http_request*) req->data;
+  ssize_t result = req->result;
+
+  uv_fs_req_cleanup(req);
+  pool_put(&fs_req_pool, req);
+  if (result < 0) {
+    fprintf(stderr, "Open error: %s: %s: %s\n", request->file_path, uv_err_name(result), uv_strerror(result));
+    respond_status(request, 404);
+    return;
+  }
+
+  uv_fs_t stat_req;
+  int r = uv_fs_fstat(loop, &stat_req, result, NULL);
+  if (r < 0) {
+    fprintf(stderr, "Stat error: %s: %s: %s\n", request->file_path, uv_err_name(r), uv_strerror(r));
+    uv_fs_req_cleanup(&stat_req);
+    close_file((uv_file) result);
+    respond_status(request, 404);
+    return;
+  }
+
+  /* Opening a directory succeeds on Linux, but reading it fails afterwards,
+   * by which point a 200 and a Content-Length have already gone out. */
+  if (!S_ISREG(stat_req.statbuf.st_mode)) {
+    uv_fs_req_cleanup(&stat_req);
+    close_file((uv_file) result);
+    respond_status(request, 404);
     return;
   }
-#endif
 
-  /* Whatever is left has to be queued, so it needs a buffer that outlives this
-   * frame, and its own request, because response->write_req is still in use for
-   * the body chunks. */
-  response->header = malloc(nbuf - written);
-  if (response->header == NULL) {
-    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    response_error(request->handle, 500, "Internal Server Error", NULL);
-    destroy_response(response, 1);
+  open_file* file = create_open_file(request->file_path, (uv_file) result, &stat_req.statbuf);
+  uv_fs_req_cleanup(&stat_req);
+  if (file == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", request->file_path);
+    close_file((uv_file) result);
+    send_status(request->handle, 500);
+    destroy_request(request, 1);
     return;
   }
-  memcpy(response->header, bufline + written, nbuf - written);
-  response->header_req.data = response;
 
-  buf = uv_buf_init(response->header, nbuf - written);
-  r = uv_write(&response->header_req, (uv_stream_t*) request->handle, &buf, 1, on_write_header);
-  if (r) {
-    fprintf(stderr, "Write error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    destroy_response(response, 1);
-  }
+  if (uncached_size > 0 && file->size >= uncached_size)
+    bypass_page_cache(file);
+  /* A file that has shrunk since it was found too big is left for the cache
+   * to pick up next time. */
+  if (file->size > MAX_CACHE_FILE_SIZE)
+    insert_open_file(file);
+  respond_from_open_file(request, file);
+  open_file_unref(file);
 }
 
 /* The body is only read once the header has actually gone out, so a partial or
@@ -630,22 +2801,23 @@ static void
 start_body(http_response* response) {
   /* A HEAD response is the header and nothing else. */
   if (response->request->head_only) {
+    TRACE2(write__complete, connection_id(response->handle), (uint64_t) 0);
+    if (tcp_info_every > 0)
+      sample_tcp_info(response->handle, (uint64_t) 0);
     destroy_response(response, !response->request->keep_alive);
     return;
   }
 
-  int r = uv_fs_read(loop, &response->read_req, response->fd, &response->buf, 1, -1, on_fs_read);
-  if (r) {
-    fprintf(stderr, "File read error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    destroy_response(response, 1);
-  }
+  response->tokens = write_rate / 10;
+  response->refilled_at = uv_now(loop);
+  next_slice(response);
 }
 
 static void
 on_write_header(uv_write_t* req, int status) {
   http_response* response = (http_response*) req->data;
 
-  free(response->header);
+  pool_put(&buffer_pool, response->header);
   response->header = NULL;
 
   if (status != 0) {
@@ -665,69 +2837,227 @@ on_shutdown(uv_shutdown_t* req, int status) {
 }
 */
 
-/* The received name has to match in full.  Comparing only as many bytes as
- * arrived would make every prefix of the name match, so a header called "C"
- * would answer for "Connection". */
+/* Known field names, lower case, by kind.  Every one has a different length, so
+ * a name's length alone picks the only candidate it could be, and one compare
+ * settles it. */
+static const char known_header_names[HEADER_KNOWN][16] = {
+  "host",
+  "range",
+  "accept",
+  "connection",
+  "if-none-match",
+  "content-length",
+  "accept-encoding",
+};
+static const signed char known_header_by_len[16] = {
+  -1, -1, -1, -1,
+  HEADER_HOST, HEADER_RANGE, HEADER_ACCEPT, -1,
+  -1, -1, HEADER_CONNECTION, -1,
+  -1, HEADER_IF_NONE_MATCH, HEADER_CONTENT_LENGTH, HEADER_ACCEPT_ENCODING,
+};
+
+/* Whether name (len bytes, at most 16) is want, ignoring case.  The name is
+ * copied into a zeroed block so it can be compared sixteen bytes at once
+ * without reading past it.  Setting bit 5 folds letters to lower case; it is
+ * only applied where want has it set, which is every byte of a field name we
+ * look for (letters and '-') and none of the zero padding.  Letters are the
+ * only token characters that fold onto one of those, so nothing else can
+ * match. */
 static int
-header_name_is(const struct phr_header* header, const char* name) {
-  size_t len = strlen(name);
-  return header->name_len == len && !strncasecmp(header->name, name, len);
+header_name_equals(const char* name, size_t len, const char* want) {
+  unsigned char block[16] = { 0 };
+  memcpy(block, name, len);
+#if defined(__SSE2__)
+  __m128i x = _mm_loadu_si128((const __m128i*) block);
+  __m128i w = _mm_loadu_si128((const __m128i*) want);
+  __m128i fold = _mm_and_si128(w, _mm_set1_epi8(0x20));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(x, fold), w)) == 0xffff;
+#elif defined(__aarch64__)
+  uint8x16_t x = vld1q_u8(block);
+  uint8x16_t w = vld1q_u8((const uint8_t*) want);
+  uint8x16_t fold = vandq_u8(w, vdupq_n_u8(0x20));
+  return vminvq_u8(vceqq_u8(vorrq_u8(x, fold), w)) == 0xff;
+#else
+  size_t i;
+  for (i = 0; i < sizeof(block); i++)
+    if ((block[i] | (want[i] & 0x20)) != (unsigned char) want[i])
+      return 0;
+  return 1;
+#endif
+}
+
+/* Sorts the parsed headers by kind, in one pass.  Everything that reads a
+ * header goes through header_first/header_next afterwards. */
+static void
+classify_headers(http_request* request) {
+  signed char* last[HEADER_KNOWN];
+  size_t i;
+
+  for (i = 0; i < HEADER_KNOWN; i++) {
+    request->header_first[i] = -1;
+    last[i] = &request->header_first[i];
+  }
+  for (i = 0; i < request->num_headers; i++) {
+    const struct phr_header* h = &request->headers[i];
+    int kind;
+#ifdef DEBUG
+    printf("%.*s: %.*s\n", (int) h->name_len, h->name, (int) h->value_len, h->value);
+#endif
+    request->header_next[i] = -1;
+    if (h->name_len >= sizeof(known_header_by_len))
+      continue;
+    kind = known_header_by_len[h->name_len];
+    if (kind < 0 || !header_name_equals(h->name, h->name_len, known_header_names[kind]))
+      continue;
+    *last[kind] = (signed char) i;
+    last[kind] = &request->header_next[i];
+  }
+}
+
+/* The next a or b in [p, end), or end.  Values are mostly short, but a long
+ * Accept or Cookie-sized list is scanned sixteen bytes at a time. */
+static const char*
+scan_to(const char* p, const char* end, char a, char b) {
+#if defined(__SSE2__)
+  __m128i va = _mm_set1_epi8(a);
+  __m128i vb = _mm_set1_epi8(b);
+  while (end - p >= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*) p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+    if (mask)
+      return p + __builtin_ctz((unsigned int) mask);
+    p += 16;
+  }
+#elif defined(__aarch64__)
+  uint8x16_t va = vdupq_n_u8((uint8_t) a);
+  uint8x16_t vb = vdupq_n_u8((uint8_t) b);
+  while (end - p >= 16) {
+    uint8x16_t x = vld1q_u8((const uint8_t*) p);
+    if (vmaxvq_u8(vorrq_u8(vceqq_u8(x, va), vceqq_u8(x, vb))))
+      break;
+    p += 16;
+  }
+#endif
+  while (p < end && *p != a && *p != b)
+    p++;
+  return p;
 }
 
-/* Connection is a comma separated list of tokens, so a value has to be matched
- * one token at a time rather than against the whole field. */
+/* Calls back with each element of a comma separated field value, without its
+ * surrounding whitespace.  Elements of Accept-style fields can carry
+ * parameters after a ';'; with params set, the element stops there and the
+ * rest of it up to the next ',' is handed over separately. */
+typedef int (*header_element_cb)(const char* elem, size_t len, const char* params, const char* params_end, void* arg);
+
 static int
-header_has_token(const struct phr_header* header, const char* token) {
-  size_t token_len = strlen(token);
+for_each_element(const struct phr_header* header, int params, header_element_cb cb, void* arg) {
   const char* p = header->value;
   const char* end = p + header->value_len;
 
   while (p < end) {
     const char* start;
+    const char* stop;
     size_t len;
 
     while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
       p++;
+    if (p == end)
+      break;
     start = p;
-    while (p < end && *p != ',')
-      p++;
-    len = p - start;
+    stop = scan_to(p, end, ',', params ? ';' : ',');
+    len = stop - start;
     while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t'))
       len--;
-    if (len == token_len && !strncasecmp(start, token, token_len))
+    p = stop < end && *stop == ';' ? scan_to(stop, end, ',', ',') : stop;
+    if (cb(start, len, stop, p, arg))
       return 1;
   }
   return 0;
 }
 
+/* Tokens in the Connection field that decide persistence. */
+#define CONNECTION_CLOSE 1
+#define CONNECTION_KEEP_ALIVE 2
+
+static int
+note_connection_token(const char* elem, size_t len, const char* params, const char* params_end, void* arg) {
+  int* seen = (int*) arg;
+  (void) params;
+  (void) params_end;
+  if (len == 5 && !strncasecmp(elem, "close", 5))
+    *seen |= CONNECTION_CLOSE;
+  else if (len == 10 && !strncasecmp(elem, "keep-alive", 10))
+    *seen |= CONNECTION_KEEP_ALIVE;
+  return 0;
+}
+
+/* Both persistence tokens, from one walk over the Connection fields. */
+static int
+connection_tokens(http_request* request) {
+  int seen = 0;
+  int i;
+  for (i = request->header_first[HEADER_CONNECTION]; i >= 0; i = request->header_next[i])
+    for_each_element(&request->headers[i], 0, note_connection_token, &seen);
+  return seen;
+}
+
 static int
 content_length(http_request* request) {
-  size_t i;
+  int i = request->header_first[HEADER_CONTENT_LENGTH];
   char buf[16];
-  for (i = 0; i < request->num_headers; i++)
-    if (header_name_is(&request->headers[i], "content-length")) {
-      size_t len = request->headers[i].value_len;
-      if (len >= sizeof(buf)) len = sizeof(buf) - 1;
-      memcpy(buf, request->headers[i].value, len);
-      buf[len] = '\0';
-      return atol(buf);
+  size_t len;
+  if (i < 0)
+    return -1;
+  len = request->headers[i].value_len;
+  if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+  memcpy(buf, request->headers[i].value, len);
+  buf[len] = '\0';
+  return atol(buf);
+}
+
+/* Whether a q parameter, as found in Accept-style fields, is one of the
+ * spellings of zero, which marks the value it follows as refused. */
+static int
+is_zero_weight(const char* p, const char* end) {
+  while (p < end && *p != ',') {
+    const char* param;
+    while (p < end && (*p == ';' || *p == ' ' || *p == '\t'))
+      p++;
+    param = p;
+    while (p < end && *p != ';' && *p != ',')
+      p++;
+    if (p - param >= 3 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+      const char* v = param + 2;
+      if (*v++ != '0')
+        return 0;
+      if (v < p && *v == '.')
+        v++;
+      while (v < p && *v == '0')
+        v++;
+      while (v < p && (*v == ' ' || *v == '\t'))
+        v++;
+      return v == p;
     }
-  return -1;
+  }
+  return 0;
 }
 
 static int
-find_header_value(http_request* request, const char* name, const char* value) {
-  size_t i;
-  for (i = 0; i < request->num_headers; i++) {
-#ifdef DEBUG
-    printf("%.*s: %.*s\n",
-      (int) request->headers[i].name_len, request->headers[i].name,
-      (int) request->headers[i].value_len, request->headers[i].value);
-#endif
-    if (header_name_is(&request->headers[i], name) &&
-        header_has_token(&request->headers[i], value))
+is_listed_value(const char* elem, size_t len, const char* params, const char* params_end, void* arg) {
+  const char* value = (const char*) arg;
+  return len == strlen(value) && !strncasecmp(elem, value, len) && !is_zero_weight(params, params_end);
+}
+
+/* Whether any field of this kind lists value among its comma separated
+ * elements, ignoring their parameters.  Only an explicit mention counts: a
+ * wildcard is what browsers send, so it is no reason to pick a variant they
+ * did not ask for. */
+static int
+header_lists(http_request* request, int kind, const char* value) {
+  int i;
+  for (i = request->header_first[kind]; i >= 0; i = request->header_next[i])
+    if (for_each_element(&request->headers[i], 1, is_listed_value, (void*) value))
       return 1;
-  }
   return 0;
 }
 
@@ -745,12 +3075,13 @@ hex_value(unsigned char c) {
  * fit in file_path is rejected instead of truncated.  Returns 0 on success,
  * otherwise the HTTP status code to reject the request with.
  *
- * Decoding happens per segment and before the "."/".." checks, so an escaped
- * "%2e%2e" is resolved as a parent reference rather than reaching the file
- * system.  A separator that arrives escaped is refused outright: decoding it
- * in place would hand the kernel a separator the segment loop never saw. */
+ * This is the general case, which the fast path falls back on.  Decoding
+ * happens per segment and before the "."/".." checks, so an escaped "%2e%2e"
+ * is resolved as a parent reference rather than reaching the file system.  A
+ * separator that arrives escaped is refused outright: decoding it in place
+ * would hand the kernel a separator the segment loop never saw. */
 static int
-build_file_path(http_request* request) {
+resolve_target(http_request* request) {
   const char* p = request->path;
   const char* end = p + request->path_len;
   char* out;
@@ -821,7 +3152,8 @@ build_file_path(http_request* request) {
     out = w;
   }
 
-  if (out == root_end || IS_PATH_SEP(end[-1])) {
+  request->names_dir = out == root_end || IS_PATH_SEP(end[-1]);
+  if (request->names_dir) {
     *out++ = '/';
     memcpy(out, INDEX_FILE, sizeof(INDEX_FILE));
   } else
@@ -830,26 +3162,668 @@ build_file_path(http_request* request) {
   return 0;
 }
 
+/* Whether the target can be used as it stands: no escapes to decode, no empty
+ * segments to collapse, and no segment starting with a dot, which covers "."
+ * and "..".  That is nearly every target, and copying one is a single
+ * memcpy.  Anything else, including what only looks suspicious like
+ * "/.well-known", goes through resolve_target.  Checked sixteen bytes at a
+ * time: a second load one byte on gives each separator the byte after it. */
+static int
+target_is_plain(const char* p, size_t len) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i dot = _mm_set1_epi8('.');
+  const __m128i pct = _mm_set1_epi8('%');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  for (; i + 17 <= len; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*) (p + i));
+    __m128i y = _mm_loadu_si128((const __m128i*) (p + i + 1));
+    __m128i sep = _mm_cmpeq_epi8(x, slash);
+    __m128i after = _mm_or_si128(_mm_cmpeq_epi8(y, slash), _mm_cmpeq_epi8(y, dot));
+    __m128i bad = _mm_or_si128(_mm_and_si128(sep, after),
+        _mm_or_si128(_mm_cmpeq_epi8(x, pct), _mm_cmpeq_epi8(x, bslash)));
+    if (_mm_movemask_epi8(bad))
+      return 0;
+  }
+#elif defined(__aarch64__)
+  const uint8x16_t slash = vdupq_n_u8('/');
+  const uint8x16_t dot = vdupq_n_u8('.');
+  const uint8x16_t pct = vdupq_n_u8('%');
+  const uint8x16_t bslash = vdupq_n_u8('\\');
+  for (; i + 17 <= len; i += 16) {
+    uint8x16_t x = vld1q_u8((const uint8_t*) p + i);
+    uint8x16_t y = vld1q_u8((const uint8_t*) p + i + 1);
+    uint8x16_t sep = vceqq_u8(x, slash);
+    uint8x16_t after = vorrq_u8(vceqq_u8(y, slash), vceqq_u8(y, dot));
+    uint8x16_t bad = vorrq_u8(vandq_u8(sep, after), vorrq_u8(vceqq_u8(x, pct), vceqq_u8(x, bslash)));
+    if (vmaxvq_u8(bad))
+      return 0;
+  }
+#endif
+  /* Backslashes are separators on Windows and ordinary bytes elsewhere, so
+   * they are left to the general case on both. */
+  for (; i < len; i++) {
+    char c = p[i];
+    if (c == '%' || c == '\\')
+      return 0;
+    if (c == '/' && i + 1 < len && (p[i + 1] == '/' || p[i + 1] == '.'))
+      return 0;
+  }
+  return 1;
+}
+
+static int
+build_file_path(http_request* request) {
+  const char* p = request->path;
+  size_t len = request->path_len;
+  char* root_end = request->file_path + static_dir_len;
+  char* limit = request->file_path + sizeof(request->file_path) - sizeof(INDEX_FILE) - 1;
+
+  /* Anything near the length limit takes the general case too, so it is the
+   * only place that decides between a 414 and a fit. */
+  if (len == 0 || p[0] != '/' || root_end > limit || len >= (size_t) (limit - root_end) ||
+      !target_is_plain(p, len))
+    return resolve_target(request);
+
+  memcpy(request->file_path, static_dir, static_dir_len);
+  memcpy(root_end, p, len);
+  /* The copy keeps a trailing separator, which is where the index file's
+   * would have gone. */
+  request->names_dir = p[len - 1] == '/';
+  if (request->names_dir)
+    memcpy(root_end + len, INDEX_FILE, sizeof(INDEX_FILE));
+  else
+    root_end[len] = 0;
+
+#ifdef CHECK_PATH_FAST_PATH
+  {
+    char fast[PATH_MAX];
+    int fast_names_dir = request->names_dir;
+    memcpy(fast, request->file_path, sizeof(fast));
+    if (resolve_target(request) != 0 || strcmp(fast, request->file_path) ||
+        fast_names_dir != request->names_dir) {
+      fprintf(stderr, "Path fast path mismatch: %.*s: %s != %s\n",
+          (int) len, p, fast, request->file_path);
+      abort();
+    }
+  }
+#endif
+  return 0;
+}
+
+static int
+lag_exceeds(long threshold_ms) {
+  return threshold_ms >= 0 && server_stats.loop_lag_ns >= (uint64_t) threshold_ms * 1000000;
+}
+
+static int
+at_connection_cap(void) {
+  return max_connections >= 0 && open_connections >= max_connections;
+}
+
+/* Holding the connection back leaves libuv not watching the listener, so the
+ * rest queue up in the kernel's backlog instead; resume_accepting accepts it
+ * once that is no longer needed. */
 static void
-respond_status(http_request* request, int status_code) {
-  const char* status;
-  switch (status_code) {
-  case 400: status = "Bad Request"; break;
-  case 414: status = "URI Too Long"; break;
-  case 500: status = "Internal Server Error"; break;
-  case 501: status = "Not Implemented"; break;
-  default:
-    status_code = 404;
-    status = "Not Found";
-    break;
+pause_accepting(uv_stream_t* server) {
+  accept_paused = 1;
+  if (paused_listeners[0] == NULL || paused_listeners[0] == server)
+    paused_listeners[0] = server;
+  else
+    paused_listeners[1] = server;
+}
+
+/* Accepting the connection a listener was paused on has libuv watch it again,
+ * and it takes the rest of the backlog from there, several per wakeup, until
+ * it is paused again. */
+static void
+resume_accepting(void) {
+  if (!accept_paused || lag_exceeds(pause_lag_ms) || at_connection_cap())
+    return;
+  uv_stream_t* listeners[2] = { paused_listeners[0], paused_listeners[1] };
+  accept_paused = 0;
+  paused_listeners[0] = paused_listeners[1] = NULL;
+  if (listeners[0] != NULL)
+    on_connection(listeners[0], 0);
+  if (listeners[1] != NULL)
+    on_connection(listeners[1], 0);
+}
+
+static void
+on_lag_sample(uv_timer_t* handle) {
+  uint64_t now = uv_hrtime();
+  uint64_t sample = now > lag_expected ? now - lag_expected : 0;
+  (void) handle;
+
+  lag_expected = now + (uint64_t) LAG_SAMPLE_MS * 1000000;
+  /* Smoothed so that one slow iteration does not flap the listener, while a
+   * real backlog still shows within a few samples. */
+  server_stats.loop_lag_ns = (server_stats.loop_lag_ns * 3 + sample) / 4;
+  if (sample > server_stats.loop_lag_max_ns)
+    server_stats.loop_lag_max_ns = sample;
+
+  resume_accepting();
+}
+
+/* One sample in the Prometheus text format.  Durations are kept in
+ * nanoseconds and printed as seconds, exactly. */
+static void
+put_metric(text_buf* b, const char* name, const char* type, const char* help, uint64_t value, int nanoseconds) {
+  char line[256];
+  if (nanoseconds)
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 ".%09" PRIu64 "\n",
+        name, help, name, type, name, value / 1000000000, value % 1000000000);
+  else
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n",
+        name, help, name, type, name, value);
+  text_puts(b, line);
+}
+
+static void
+tcp_observe(unsigned int metric, unsigned int size_class, uint64_t value) {
+  const tcp_metric* m = &tcp_metrics[metric];
+  unsigned int i;
+  for (i = 0; i < m->nbounds && value > m->bounds[i]; i++)
+    ;
+  tcp_histograms[metric][size_class].buckets[i]++;
+  tcp_histograms[metric][size_class].count++;
+  tcp_histograms[metric][size_class].sum += value;
+}
+
+/* Called as a response of size bytes completes; takes every tcp_info_every'th
+ * on a TCP connection. */
+static void
+sample_tcp_info(uv_handle_t* handle, uint64_t size) {
+#ifdef HAVE_TCP_INFO
+  kernel_tcp_info info;
+  socklen_t len = sizeof(info);
+  uv_os_fd_t fd;
+  unsigned int c;
+
+  if (handle == NULL || handle->type != UV_TCP || tcp_info_seen++ % tcp_info_every != 0)
+    return;
+  if (uv_fileno(handle, &fd) != 0)
+    return;
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    return;
+  for (c = 0; size >= tcp_size_classes[c].below; c++)
+    ;
+  tcp_observe(TCP_RTT, c, info.rtt);
+  tcp_observe(TCP_RTTVAR, c, info.rttvar);
+  tcp_observe(TCP_RETRANSMITS, c, info.total_retrans);
+  tcp_observe(TCP_CWND, c, info.snd_cwnd);
+  /* Kernels before 4.9 stop short of it, and it is 0 until something has
+   * been acknowledged. */
+  if (len >= offsetof(kernel_tcp_info, delivery_rate) + sizeof(info.delivery_rate) && info.delivery_rate > 0)
+    tcp_observe(TCP_DELIVERY_RATE, c, info.delivery_rate);
+#else
+  (void) handle;
+  (void) size;
+#endif
+}
+
+static void
+format_tcp_value(char* buf, size_t cap, uint64_t value, int microseconds) {
+  if (microseconds)
+    snprintf(buf, cap, "%" PRIu64 ".%06" PRIu64, value / 1000000, value % 1000000);
+  else
+    snprintf(buf, cap, "%" PRIu64, value);
+}
+
+/* The -T histograms, cumulative by bucket as Prometheus has them. */
+static void
+render_tcp_histograms(text_buf* b) {
+  char line[512];
+  char bound[32];
+  unsigned int m, c, i;
+
+  for (m = 0; m < TCP_METRICS; m++) {
+    const tcp_metric* metric = &tcp_metrics[m];
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s histogram\n", metric->name, metric->help, metric->name);
+    text_puts(b, line);
+    for (c = 0; c < TCP_SIZE_CLASSES; c++) {
+      uint64_t cumulative = 0;
+      for (i = 0; i <= metric->nbounds; i++) {
+        cumulative += tcp_histograms[m][c].buckets[i];
+        if (i < metric->nbounds)
+          format_tcp_value(bound, sizeof(bound), metric->bounds[i], metric->microseconds);
+        else
+          strcpy(bound, "+Inf");
+        snprintf(line, sizeof(line), "%s_bucket{size=\"%s\",le=\"%s\"} %" PRIu64 "\n",
+            metric->name, tcp_size_classes[c].label, bound, cumulative);
+        text_puts(b, line);
+      }
+      format_tcp_value(bound, sizeof(bound), tcp_histograms[m][c].sum, metric->microseconds);
+      snprintf(line, sizeof(line), "%s_sum{size=\"%s\"} %s\n%s_count{size=\"%s\"} %" PRIu64 "\n",
+          metric->name, tcp_size_classes[c].label, bound,
+          metric->name, tcp_size_classes[c].label, tcp_histograms[m][c].count);
+      text_puts(b, line);
+    }
+  }
+}
+
+static void
+render_metrics(text_buf* b) {
+  put_metric(b, "http_server_loop_lag_seconds", "gauge",
+      "Smoothed delay before the event loop gets to work that is ready.",
+      server_stats.loop_lag_ns, 1);
+  put_metric(b, "http_server_loop_lag_max_seconds", "gauge",
+      "Largest single loop lag sample since start.",
+      server_stats.loop_lag_max_ns, 1);
+  put_metric(b, "http_server_accept_paused", "gauge",
+      "Whether new connections are being left in the listen backlog.",
+      (uint64_t) accept_paused, 0);
+  put_metric(b, "http_server_accept_pauses_total", "counter",
+      "Times accepting was paused because of loop lag.",
+      server_stats.accept_pauses, 0);
+  put_metric(b, "http_server_connections", "gauge",
+      "Connections open now.",
+      (uint64_t) open_connections, 0);
+  put_metric(b, "http_server_accepts_deferred_total", "counter",
+      "Times a connection was left in the backlog at the connection cap.",
+      server_stats.accepts_deferred, 0);
+  put_metric(b, "http_server_accepts_refused_total", "counter",
+      "Connections dropped when accepted, for want of descriptors or memory.",
+      server_stats.accepts_refused, 0);
+  put_metric(b, "http_server_requests_shed_total", "counter",
+      "Requests refused with 503 because of loop lag.",
+      server_stats.requests_shed, 0);
+  put_metric(b, "http_server_target_cache_hits_total", "counter",
+      "Requests answered straight from the raw target cache.",
+      server_stats.target_cache_hits, 0);
+  put_metric(b, "http_server_missing_path_hits_total", "counter",
+      "Requests for paths known not to exist, answered without an open().",
+      server_stats.missing_path_hits, 0);
+  put_metric(b, "http_server_write_slices_total", "counter",
+      "Slices of large responses sent through the write scheduler.",
+      server_stats.write_slices, 0);
+  put_metric(b, "http_server_writes_throttled_total", "counter",
+      "Times a response had to wait for its bandwidth allowance.",
+      server_stats.writes_throttled, 0);
+  put_metric(b, "http_server_direct_read_bytes_total", "counter",
+      "Bytes of files of at least -D read with O_DIRECT.",
+      server_stats.direct_read_bytes, 0);
+  put_metric(b, "http_server_dropped_cache_bytes_total", "counter",
+      "Bytes of files of at least -D dropped from the page cache after reading.",
+      server_stats.dropped_cache_bytes, 0);
+  put_metric(b, "http_server_open_files", "gauge",
+      "Descriptors of large files held open for streaming.",
+      (uint64_t) kh_size(open_files), 0);
+#ifdef ALLOC_STATS
+  put_metric(b, "http_server_heap_allocations_total", "counter",
+      "Heap allocations made by the server itself, not counting libuv's.",
+      heap_allocations, 0);
+#endif
+  if (tcp_info_every > 0)
+    render_tcp_histograms(b);
+}
+
+/* A CPU profile of the loop (PREFIX/profile?seconds=N&hz=H), answered with
+ * folded stacks once it has been taken.  One is taken at a time. */
+#define PROFILE_DEFAULT_SECONDS 10
+#define PROFILE_DEFAULT_HZ 99
+static uv_timer_t profile_timer;
+static int profile_timer_ready;
+static http_request* profile_request;
+
+static void
+on_profile_done(uv_timer_t* handle) {
+  http_request* request = profile_request;
+  char* out;
+  size_t len;
+  (void) handle;
+
+  profile_request = NULL;
+  if (profile_stop(&out, &len)) {
+    fprintf(stderr, "Profile error: %s\n", strerror(errno));
+    send_status(request->handle, 500);
+    destroy_request(request, 1);
+    return;
+  }
+  http_respond(request, 200, "text/plain; charset=utf-8", "Cache-Control: no-store\r\n", out, len);
+  free(out);
+}
+
+/* Reads name=N from the query string into value, which is left alone if it
+ * is not there.  Returns -1 if it is there but not a number from 1 to max. */
+static int
+query_number(const http_request* request, const char* name, unsigned long max, unsigned int* value) {
+  const char* p = request->query;
+  const char* end;
+  size_t name_len = strlen(name);
+
+  if (p == NULL)
+    return 0;
+  end = p + request->query_len;
+  while (p < end) {
+    const char* amp = memchr(p, '&', (size_t) (end - p));
+    const char* field_end = amp ? amp : end;
+    if ((size_t) (field_end - p) > name_len && !memcmp(p, name, name_len) && p[name_len] == '=') {
+      unsigned long n = 0;
+      const char* d = p + name_len + 1;
+      if (d == field_end)
+        return -1;
+      for (; d < field_end; d++) {
+        if (*d < '0' || *d > '9' || n > max)
+          return -1;
+        n = n * 10 + (unsigned long) (*d - '0');
+      }
+      if (n == 0 || n > max)
+        return -1;
+      *value = (unsigned int) n;
+      return 0;
+    }
+    p = amp ? amp + 1 : end;
+  }
+  return 0;
+}
+
+/* Samples for as long as asked while the loop carries on serving, and
+ * answers from a timer. */
+static void
+respond_profile(http_request* request) {
+  unsigned int seconds = PROFILE_DEFAULT_SECONDS;
+  unsigned int hz = PROFILE_DEFAULT_HZ;
+  char message[128];
+  int n;
+  int r;
+
+  if (query_number(request, "seconds", PROFILE_MAX_SECONDS, &seconds) ||
+      query_number(request, "hz", PROFILE_MAX_HZ, &hz)) {
+    n = snprintf(message, sizeof(message), "seconds is from 1 to %d and hz from 1 to %d\n",
+        PROFILE_MAX_SECONDS, PROFILE_MAX_HZ);
+    http_respond(request, 400, NULL, NULL, message, (size_t) n);
+    return;
+  }
+  if (profile_request != NULL) {
+    static const char busy[] = "a profile is already being taken\n";
+    http_respond_nocopy(request, 409, NULL, NULL, busy, sizeof(busy) - 1, NULL, NULL);
+    return;
+  }
+  if (!profile_timer_ready) {
+    r = uv_timer_init(loop, &profile_timer);
+    if (r) {
+      fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      send_status(request->handle, 500);
+      destroy_request(request, 1);
+      return;
+    }
+    profile_timer_ready = 1;
+  }
+  if (profile_start(hz, seconds)) {
+    int code = errno == ENOSYS ? 501 : 500;
+    n = snprintf(message, sizeof(message), "cannot profile: %s\n", strerror(errno));
+    http_respond(request, code, NULL, NULL, message, (size_t) n);
+    return;
+  }
+  profile_request = request;
+  uv_timer_start(&profile_timer, on_profile_done, (uint64_t) seconds * 1000, 0);
+}
+
+/* Answers an admin request, or returns 0 to have it served like any other:
+ * to anyone else the endpoints do not exist. */
+static int
+respond_admin(http_request* request) {
+  const char* p;
+  size_t n;
+  text_buf body = { NULL, 0, 0, 0 };
+  text_buf out = { NULL, 0, 0, 0 };
+  char header[256];
+  int header_len;
+
+  if (request->path_len < admin_prefix_len || memcmp(request->path, admin_prefix, admin_prefix_len))
+    return 0;
+  p = request->path + admin_prefix_len;
+  n = request->path_len - admin_prefix_len;
+  /* Any query string, which scrapers like to add, is already split off. */
+  if (n != 8 || (memcmp(p, "/metrics", 8) && memcmp(p, "/profile", 8)))
+    return 0;
+  if (!((http_connection*) request->handle->data)->admin)
+    return 0;
+  if (p[1] == 'p') {
+    respond_profile(request);
+    return 1;
+  }
+
+  render_metrics(&body);
+  header_len = render_ok_header(header, sizeof(header), body.len,
+      "text/plain; version=0.0.4; charset=utf-8", "Cache-Control: no-store\r\n", request->keep_alive);
+  text_append(&out, header, (size_t) header_len);
+  if (!request->head_only)
+    text_append(&out, body.p, body.len);
+  free(body.p);
+  if (body.failed || out.failed) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    free(out.p);
+    send_status(request->handle, 500);
+    destroy_request(request, 1);
+    return 1;
+  }
+  respond_with_owned_buffer(request, out.p, out.len);
+  return 1;
+}
+
+/* Pre-rendered so that refusing work costs next to nothing. */
+static char shed_response[] =
+  "HTTP/1.0 503 Service Unavailable\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static void
+shed_request(http_request* request) {
+  uv_buf_t buf = uv_buf_init(shed_response, sizeof(shed_response) - 1);
+  server_stats.requests_shed++;
+  TRACE1(request__shed, connection_id(request->handle));
+  request->keep_alive = 0;
+  respond_with_buffers(request, &buf, 1, buf.len, NULL);
+}
+
+/* Handlers embedded through http_server_route.  Routes are tried in the order
+ * they were added, after the admin endpoints and shedding and ahead of the
+ * files, so a server with none pays one comparison for them. */
+#define MAX_ROUTES 64
+
+typedef struct {
+  const char* pattern;
+  size_t len;
+  int prefix;
+  http_handler handler;
+  void* data;
+} http_route;
+
+static http_route routes[MAX_ROUTES];
+static size_t nroutes;
+
+int
+http_server_route(const char* pattern, http_handler handler, void* data) {
+  size_t len = strlen(pattern);
+  if (len == 0 || pattern[0] != '/' || handler == NULL || nroutes == MAX_ROUTES)
+    return -1;
+  routes[nroutes].pattern = pattern;
+  routes[nroutes].prefix = pattern[len - 1] == '*';
+  routes[nroutes].len = routes[nroutes].prefix ? len - 1 : len;
+  routes[nroutes].handler = handler;
+  routes[nroutes].data = data;
+  nroutes++;
+  return 0;
+}
+
+/* Hands the request to the first route that matches and takes it.  Returns 0
+ * if none did. */
+static int
+respond_from_route(http_request* request) {
+  size_t i;
+  for (i = 0; i < nroutes; i++) {
+    const http_route* route = &routes[i];
+    if (route->prefix ? request->path_len < route->len : request->path_len != route->len)
+      continue;
+    if (memcmp(request->path, route->pattern, route->len))
+      continue;
+    if (route->handler(request, route->data) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static const struct {
+  int code;
+  const char* reason;
+} status_reasons[] = {
+  { 200, "OK" },
+  { 201, "Created" },
+  { 202, "Accepted" },
+  { 204, "No Content" },
+  { 301, "Moved Permanently" },
+  { 302, "Found" },
+  { 303, "See Other" },
+  { 304, "Not Modified" },
+  { 307, "Temporary Redirect" },
+  { 308, "Permanent Redirect" },
+  { 400, "Bad Request" },
+  { 401, "Unauthorized" },
+  { 403, "Forbidden" },
+  { 404, "Not Found" },
+  { 405, "Method Not Allowed" },
+  { 409, "Conflict" },
+  { 429, "Too Many Requests" },
+  { 500, "Internal Server Error" },
+  { 501, "Not Implemented" },
+  { 502, "Bad Gateway" },
+  { 503, "Service Unavailable" },
+  { 504, "Gateway Timeout" },
+};
+
+/* The reason phrase is only for people reading along, so a code without one
+ * goes without. */
+static const char*
+status_reason(int code) {
+  size_t i;
+  for (i = 0; i < sizeof(status_reasons) / sizeof(status_reasons[0]); i++)
+    if (status_reasons[i].code == code)
+      return status_reasons[i].reason;
+  return "";
+}
+
+/* Sends a response a handler made up.  The header is rendered on the stack and
+ * the body is sent from where it lies, so a response that leaves in one
+ * synchronous write is never copied.  Whatever is left over is: the rest of
+ * the header into a pooled buffer, and the rest of the body as well unless the
+ * caller keeps it until done(data) (copy_body 0).  done is called on every
+ * path, once the body is no longer needed. */
+static void
+respond_with_made_up(http_request* request, int code, const char* ctype, const char* headers, const char* body, size_t len,
+    int copy_body, void (*done)(void*), void* data) {
+  char header[WRITE_BUF_SIZE];
+  uv_buf_t bufs[2];
+  size_t nbufs = 0;
+  size_t total_len;
+  size_t i;
+  char* rest = NULL;
+  char* owned = NULL;
+  int n = -1;
+
+  if (code >= 100 && code <= 999)
+    n = snprintf(header, sizeof(header),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Length: %" PRIu64 "\r\n"
+        "Content-Type: %s\r\n"
+        "%s"
+        "Connection: %s\r\n"
+        "\r\n",
+        code, status_reason(code), (uint64_t) len, ctype ? ctype : "text/plain; charset=utf-8",
+        headers ? headers : "", request->keep_alive ? "keep-alive" : "close");
+  if (n < 0 || (size_t) n >= sizeof(header)) {
+    fprintf(stderr, "Response error: %d: status or headers not valid\n", code);
+    send_status(request->handle, 500);
+    destroy_request(request, 1);
+    if (done != NULL)
+      done(data);
+    return;
   }
-  response_error(request->handle, status_code, status, NULL);
-  destroy_request(request, 1);
+
+  bufs[nbufs++] = uv_buf_init(header, (unsigned int) n);
+  total_len = (size_t) n;
+  if (!request->head_only && len > 0) {
+    bufs[nbufs++] = uv_buf_init((char*) body, (unsigned int) len);
+    total_len += len;
+  }
+
+  TRACE2(write__start, connection_id(request->handle), total_len);
+  if (request_trace != NULL)
+    trace_request(request, header, total_len);
+  int scheduled = write_quota > 0 && total_len > write_quota;
+  if (!scheduled && write_now(request, bufs, &nbufs, total_len)) {
+    if (done != NULL)
+      done(data);
+    return;
+  }
+
+  if (copy_body) {
+    size_t left = 0;
+    for (i = 0; i < nbufs; i++)
+      left += bufs[i].len;
+    owned = malloc(left);
+    if (owned == NULL) {
+      fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+      send_status(request->handle, 500);
+      destroy_request(request, 1);
+      return;
+    }
+    left = 0;
+    for (i = 0; i < nbufs; i++) {
+      memcpy(owned + left, bufs[i].base, bufs[i].len);
+      left += bufs[i].len;
+    }
+    bufs[0] = uv_buf_init(owned, (unsigned int) left);
+    nbufs = 1;
+  } else if (bufs[0].base >= header && bufs[0].base < header + n) {
+    rest = pool_get(&buffer_pool);
+    if (rest == NULL) {
+      fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+      send_status(request->handle, 500);
+      destroy_request(request, 1);
+      if (done != NULL)
+        done(data);
+      return;
+    }
+    memcpy(rest, bufs[0].base, bufs[0].len);
+    bufs[0].base = rest;
+  }
+  /* The copy is freed once written, or the caller's body handed back. */
+  if (scheduled)
+    schedule_response(request, bufs, nbufs, total_len, NULL, rest,
+        copy_body ? owned : data, copy_body ? free : done);
+  else
+    queue_response(request, bufs, nbufs, total_len, NULL, rest,
+        copy_body ? owned : data, copy_body ? free : done);
+}
+
+void
+http_respond(http_request* request, int status, const char* ctype, const char* headers, const char* body, size_t len) {
+  respond_with_made_up(request, status, ctype, headers, body, len, 1, NULL, NULL);
+}
+
+void
+http_respond_nocopy(http_request* request, int status, const char* ctype, const char* headers, const char* body, size_t len,
+    void (*done)(void* data), void* data) {
+  respond_with_made_up(request, status, ctype, headers, body, len, 0, done, data);
+}
+
+/* Answered exactly as a request for path would be, from the same caches. */
+void
+http_respond_file(http_request* request, const char* path) {
+  request->path = path;
+  request->path_len = strlen(path);
+  respond_from_root(request);
 }
 
 static void
 request_complete(http_request* request) {
-  int status;
+  current_connection_id = connection_id(request->handle);
 
   if (request->method_len == 3 && !memcmp(request->method, "GET", 3))
     request->head_only = 0;
@@ -860,37 +3834,82 @@ request_complete(http_request* request) {
     return;
   }
 
+  /* "close" overrides the version default either way, so it is checked first;
+   * otherwise HTTP/1.1 is persistent and HTTP/1.0 has to opt in. */
+  int connection = connection_tokens(request);
+  if (connection & CONNECTION_CLOSE)
+    request->keep_alive = 0;
+  else if (request->minor_version >= 1)
+    request->keep_alive = 1;
+  else
+    request->keep_alive = (connection & CONNECTION_KEEP_ALIVE) != 0;
+
+  /* Admin requests are exempt from shedding: an overloaded server is exactly
+   * when its metrics are wanted. */
+  if (admin_prefix != NULL && respond_admin(request))
+    return;
+  if (lag_exceeds(shed_lag_ms)) {
+    shed_request(request);
+    return;
+  }
+  if (nroutes > 0 && respond_from_route(request))
+    return;
+
+  respond_from_root(request);
+}
+
+/* Serves request->path from the document root or the site pack. */
+static void
+respond_from_root(http_request* request) {
+  int status;
+  file_cache_entry* entry = NULL;
+  if (site_pack == NULL)
+    entry = lookup_target_cache(request->path, request->path_len);
+  if (entry != NULL) {
+    server_stats.target_cache_hits++;
+    TRACE3(cache__hit, current_connection_id, entry->path, entry->body_len);
+    respond_with_cache_entry(request, entry);
+    return;
+  }
+
   status = build_file_path(request);
   if (status) {
     respond_status(request, status);
     return;
   }
-  /* "close" overrides the version default either way, so it is checked first;
-   * otherwise HTTP/1.1 is persistent and HTTP/1.0 has to opt in. */
-  if (find_header_value(request, "Connection", "close"))
-    request->keep_alive = 0;
-  else if (request->minor_version >= 1)
-    request->keep_alive = 1;
-  else
-    request->keep_alive = find_header_value(request, "Connection", "keep-alive");
+  TRACE2(request__resolved, current_connection_id, request->file_path);
+
+  if (site_pack != NULL) {
+    respond_from_site_pack(request);
+    return;
+  }
 
   int too_large = 0;
-  file_cache_entry* entry = get_or_load_file_cache_entry(request->file_path, &too_large);
+  entry = get_or_load_file_cache_entry(request->file_path, &too_large);
+  if (entry != NULL)
+    remember_target(request->path, request->path_len, entry);
+  else if (!too_large && dir_listing && request->names_dir)
+    entry = get_or_load_dir_listing(request->file_path, header_lists(request, HEADER_ACCEPT, LISTING_JSON_TYPE));
   if (entry != NULL) {
     respond_with_cache_entry(request, entry);
     return;
   }
   if (!too_large) {
-    response_error(request->handle, 404, "Not Found", NULL);
-    destroy_request(request, 1);
+    respond_status(request, 404);
     return;
   }
 
-  /* Too big to cache: stream it from disk asynchronously instead. */
-  uv_fs_t* open_req = malloc(sizeof(uv_fs_t));
+  /* Too big to cache: stream it from disk instead, from a descriptor left
+   * open by an earlier request if there is one, or opened asynchronously. */
+  open_file* file = lookup_open_file(request->file_path);
+  if (file != NULL) {
+    respond_from_open_file(request, file);
+    return;
+  }
+  uv_fs_t* open_req = pool_get(&fs_req_pool);
   if (open_req == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    response_error(request->handle, 500, "Internal Server Error", NULL);
+    send_status(request->handle, 500);
     destroy_request(request, 1);
     return;
   }
@@ -898,10 +3917,36 @@ request_complete(http_request* request) {
   int r = uv_fs_open(loop, open_req, request->file_path, O_RDONLY, S_IREAD, on_fs_open);
   if (r) {
     fprintf(stderr, "Open error: %s: %s: %s\n", request->file_path, uv_err_name(r), uv_strerror(r));
-    response_error(request->handle, 404, "Not Found", NULL);
-    destroy_request(request, 1);
-    free(open_req);
+    respond_status(request, 404);
+    pool_put(&fs_req_pool, open_req);
+  }
+}
+
+/* Appends part of a head that is arriving in pieces to conn->buf, growing it
+ * as need be.  Returns 0 if that fails. */
+static int
+append_head(http_connection* conn, const char* data, size_t len) {
+  if (conn->len + len > conn->cap) {
+    size_t cap = conn->cap ? conn->cap : HEAD_BUF_SIZE;
+    char* grown;
+    while (cap < conn->len + len)
+      cap *= 2;
+    /* Nearly every such head fits the first buffer, which comes from the
+     * pool. */
+    if (conn->buf == NULL && cap == HEAD_BUF_SIZE)
+      grown = pool_get(&head_pool);
+    else
+      grown = realloc(conn->buf, cap);
+    if (grown == NULL) {
+      fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+      return 0;
+    }
+    conn->buf = grown;
+    conn->cap = cap;
   }
+  memcpy(conn->buf + conn->len, data, len);
+  conn->len += len;
+  return 1;
 }
 
 static void
@@ -921,37 +3966,35 @@ on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
     return;
   }
 
-  /* One request per connection at a time.  Anything arriving while one is in
-   * flight -- a pipelined request, or garbage -- is ignored: serving it would
-   * give the connection a second owner, and whichever finished first would
-   * close the handle out from under the other. */
+  /* One request per connection at a time: serving a second would give the
+   * connection a second owner, and whichever finished first would close the
+   * handle out from under the other.  Reading stops while one is in flight,
+   * so this only happens to a connection without state. */
   if (conn == NULL || conn->request != NULL) {
     return;
   }
 
   if (conn->len + (size_t) nread > MAX_REQUEST_HEAD) {
     fprintf(stderr, "Request head too large\n");
-    response_error((uv_handle_t*) stream, 431, "Request Header Fields Too Large", NULL);
+    send_status((uv_handle_t*) stream, 431);
     close_connection((uv_handle_t*) stream);
     return;
   }
 
-  if (conn->len + (size_t) nread > conn->cap) {
-    size_t cap = conn->cap ? conn->cap : 8192;
-    char* grown;
-    while (cap < conn->len + (size_t) nread)
-      cap *= 2;
-    grown = realloc(conn->buf, cap);
-    if (grown == NULL) {
-      fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+  /* A head almost always arrives in one read, and is then parsed where it
+   * lies in read_buf.  Only one split across reads is copied into conn->buf,
+   * and the rest of it appended there. */
+  ASSERT(buf->base == conn->read_buf);
+  const char* head = buf->base;
+  size_t head_len = (size_t) nread;
+  if (conn->len > 0) {
+    if (!append_head(conn, buf->base, (size_t) nread)) {
       close_connection((uv_handle_t*) stream);
       return;
     }
-    conn->buf = grown;
-    conn->cap = cap;
+    head = conn->buf;
+    head_len = conn->len;
   }
-  memcpy(conn->buf + conn->len, buf->base, (size_t) nread);
-  conn->len += (size_t) nread;
 
   /* Parsed into locals first: an incomplete head has to be able to return
    * without having allocated a request. */
@@ -960,11 +4003,11 @@ on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
   const char* path;
   size_t path_len;
   int minor_version;
-  struct phr_header headers[32];
+  struct phr_header headers[MAX_HEADERS];
   size_t num_headers = sizeof(headers) / sizeof(headers[0]);
   int nparsed = phr_parse_request(
-          conn->buf,
-          conn->len,
+          head,
+          head_len,
           &method,
           &method_len,
           &path,
@@ -974,14 +4017,19 @@ on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
           &num_headers,
           conn->last_len);
   if (nparsed == -2) {
-    /* Not a whole head yet; keep it and wait for the rest. */
+    /* Not a whole head yet; keep it and wait for the rest.  The next read
+     * goes to the same read_buf, so a first piece has to be copied out. */
+    if (conn->len == 0 && !append_head(conn, buf->base, (size_t) nread)) {
+      close_connection((uv_handle_t*) stream);
+      return;
+    }
     conn->last_len = conn->len;
     return;
   }
   if (nparsed < 0) {
     conn->len = conn->last_len = 0;
     fprintf(stderr, "Invalid request\n");
-    response_error((uv_handle_t*) stream, 400, "Bad Request", NULL);
+    send_status((uv_handle_t*) stream, 400);
     close_connection((uv_handle_t*) stream);
     return;
   }
@@ -992,73 +4040,109 @@ on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
   request->method_len = method_len;
   request->path = path;
   request->path_len = path_len;
+  request->query = memchr(path, '?', path_len);
+  request->query_len = 0;
+  if (request->query != NULL) {
+    request->path_len = (size_t) (request->query - path);
+    request->query++;
+    request->query_len = path_len - request->path_len - 1;
+  }
   request->minor_version = minor_version;
-  memcpy(request->headers, headers, sizeof(headers));
+  /* Until request_complete knows better, anything sent is a whole response on
+   * a connection that closes after it. */
+  request->keep_alive = 0;
+  request->head_only = 0;
+  memcpy(request->headers, headers, sizeof(headers[0]) * num_headers);
   request->num_headers = num_headers;
+  classify_headers(request);
   /* TODO: handle reading whole payload */
-  request->payload = conn->buf + nparsed;
-  request->payload_len = conn->len - (size_t) nparsed;
+  request->payload = head + nparsed;
+  request->payload_len = head_len - (size_t) nparsed;
 
   /* From here on this request owns the connection.  Its path and headers point
-   * into conn->buf, which stays allocated; the buffer is only rewritten by a
-   * later read, and reads are ignored while a request is in flight. */
+   * into read_buf or conn->buf, and neither is rewritten while it is in
+   * flight, since nothing is read until destroy_request starts reading again.
+   * Dropping what arrives instead would lose a request sent the moment the
+   * last byte of a response is: libuv can see it before it sees that write
+   * complete.  Anything after the head in this same read, a pipelined
+   * request, is still dropped. */
+  uv_read_stop(stream);
   conn->request = request;
   conn->len = conn->last_len = 0;
+  TRACE4(request__head, conn->id, path, path_len, (size_t) nparsed);
   request_complete(request);
 }
 
+/* A handle is closed only if it was ever initialized. */
+static void
+close_server_handle(uv_handle_t* handle) {
+  if (handle->loop != NULL && !uv_is_closing(handle))
+    uv_close(handle, NULL);
+}
+
+/* Once stopped and the last connection has gone, nothing is left for the
+ * timers and the write scheduler to do, and while open they would keep the
+ * loop from being closed. */
+static void
+close_server_handles(void) {
+  close_server_handle((uv_handle_t*) &arena_compactor);
+  close_server_handle((uv_handle_t*) &open_file_sweeper);
+  close_server_handle((uv_handle_t*) &write_scheduler);
+  close_server_handle((uv_handle_t*) &write_throttle);
+  close_server_handle((uv_handle_t*) &lag_timer);
+  close_server_handle((uv_handle_t*) &request_trace_flusher);
+  close_server_handle((uv_handle_t*) &profile_timer);
+  if (missing_paths != NULL) {
+    flush_missing_paths();
+    drop_unused_missing_watches();
+  }
+  if (request_trace != NULL) {
+    flush_request_trace();
+    if (request_trace != NULL)
+      fclose(request_trace);
+    request_trace = NULL;
+  }
+}
+
 static void on_close(uv_handle_t* peer) {
   http_connection* conn = (http_connection*) peer->data;
   if (conn) {
-    free(conn->buf);
-    free(conn);
+    TRACE1(conn__close, conn->id);
+    if (conn->prev != NULL)
+      conn->prev->next = conn->next;
+    else
+      connections = conn->next;
+    if (conn->next != NULL)
+      conn->next->prev = conn->prev;
+    if (conn->cap == HEAD_BUF_SIZE)
+      pool_put(&head_pool, conn->buf);
+    else
+      free(conn->buf);
+    pool_put(&connection_pool, conn);
+    open_connections--;
+  }
+  pool_put(&stream_pool, peer);
+  if (stopping) {
+    if (open_connections == 0)
+      close_server_handles();
+    return;
   }
-  free(peer);
+  resume_accepting();
 }
 
 static void
 on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
   http_connection* conn = (http_connection*) handle->data;
   (void) suggested_size;
+  ASSERT(conn != NULL && conn->request == NULL);
   buf->base = conn->read_buf;
-  buf->len = sizeof(conn->read_buf);
+  buf->len = READ_BUF_SIZE;
 }
 
 static void
-on_write_error_free_buf(uv_write_t* req, int status) {
+on_write_status(uv_write_t* req, int status) {
   (void) status;
-  free(req->data);
-  free(req);
-}
-
-static void
-response_error(uv_handle_t* handle, int status_code, const char* status, const char* message) {
-  const char* ptr = message ? message : status;
-  char* bufline = malloc(1024);
-  if (bufline == NULL) {
-    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    return;
-  }
-  int nbuf = snprintf(bufline, 1024,
-      "HTTP/1.0 %d %s\r\n"
-      "Content-Length: %d\r\n"
-      "Content-Type: text/plain; charset=UTF-8;\r\n"
-      "\r\n"
-      "%s", status_code, status, (int) strlen(ptr), ptr);
-  uv_write_t* write_req = malloc(sizeof(uv_write_t));
-  if (write_req == NULL) {
-    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    free(bufline);
-    return;
-  }
-  write_req->data = bufline;
-  uv_buf_t buf = uv_buf_init(bufline, nbuf);
-  int r = uv_write(write_req, (uv_stream_t*) handle, &buf, 1, on_write_error_free_buf);
-  if (r) {
-    fprintf(stderr, "Write error %s: %s\n", uv_err_name(r), uv_strerror(r));
-    free(bufline);
-    free(write_req);
-  }
+  pool_put(&write_req_pool, req);
 }
 
 static void
@@ -1069,17 +4153,46 @@ on_fs_read(uv_fs_t *req) {
   uv_fs_req_cleanup(req);
   if (result < 0) {
     fprintf(stderr, "File read error: %s: %s\n", uv_err_name(result), uv_strerror(result));
-    response_error(response->handle, 500, "Internal Server Error", NULL);
+    send_status(response->handle, 500);
+    destroy_response(response, 1);
+    return;
+  }
+  if (result == 0) {
+    /* The file was cut short under us; the Content-Length already sent can
+     * no longer be honoured, so the client has to see the connection drop. */
+    fprintf(stderr, "File read error: %s: file shrank\n", response->open_file->path);
     destroy_response(response, 1);
     return;
   }
 
+  if (response->open_file->bypass == BYPASS_DIRECT)
+    server_stats.direct_read_bytes += result;
+#ifdef POSIX_FADV_DONTNEED
+  else if (response->open_file->bypass == BYPASS_DROP) {
+    /* The chunk is in pbuf now, so the cache need not keep it. */
+    uint64_t end = response->response_offset + result;
+    uint64_t mark = end & ~(uint64_t) (DROP_BEHIND - 1);
+    if (mark > response->response_offset || end == response->response_size) {
+      uint64_t start = mark > 2 * DROP_BEHIND ? mark - 2 * DROP_BEHIND : 0;
+      posix_fadvise(response->fd, (off_t) start, (off_t) (end - start), POSIX_FADV_DONTNEED);
+    }
+    server_stats.dropped_cache_bytes += result;
+  }
+#endif
+
   uv_buf_t buf = uv_buf_init(response->pbuf, result);
+  TRACE3(write__partial, connection_id(response->handle), response->response_offset, response->response_size);
   int r = uv_write(&response->write_req, (uv_stream_t*) response->handle, &buf, 1, on_write);
   if (r) {
     destroy_response(response, 1);
     return;
   }
+  /* uv_write has handed the chunk to the kernel if the socket would take it,
+   * so uncorking now sends it in the same segment as the header. */
+  if (response->corked) {
+    set_cork(response->handle, 0);
+    response->corked = 0;
+  }
   response->response_offset += result;
 }
 
@@ -1088,30 +4201,65 @@ on_connection(uv_stream_t* server, int status) {
   uv_stream_t* stream;
   int r;
 
+  /* libuv has already dropped the connection, as it does when the process is
+   * out of descriptors. */
   if (status != 0) {
     fprintf(stderr, "Connect error: %s: %s\n", uv_err_name(status), uv_strerror(status));
+    server_stats.accepts_refused++;
+    return;
+  }
+
+  /* Rather than add to the lag, or take more connections than the cap, leave
+   * them in the backlog; on_lag_sample or on_close picks them up again. */
+  if (server != admin_listener && lag_exceeds(pause_lag_ms)) {
+    if (!accept_paused)
+      server_stats.accept_pauses++;
+    pause_accepting(server);
+    return;
+  }
+  if (server != admin_listener && at_connection_cap()) {
+    server_stats.accepts_deferred++;
+    pause_accepting(server);
     return;
   }
 
-  stream = malloc(sizeof(uv_tcp_t));
+  stream = pool_get(&stream_pool);
   if (stream == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    server_stats.accepts_refused++;
     return;
   }
-  stream->data = calloc(1, sizeof(http_connection));
-  if (stream->data == NULL) {
+  http_connection* conn = pool_get(&connection_pool);
+  if (conn == NULL) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
-    free(stream);
+    server_stats.accepts_refused++;
+    pool_put(&stream_pool, stream);
     return;
   }
+  /* Everything but the read buffer, which is only ever written before it is
+   * read. */
+  memset(conn, 0, offsetof(http_connection, read_buf));
 
-  r = uv_tcp_init(loop, (uv_tcp_t*) stream);
+  if (server->type == UV_NAMED_PIPE)
+    r = uv_pipe_init(loop, (uv_pipe_t*) stream, 0);
+  else
+    r = uv_tcp_init(loop, (uv_tcp_t*) stream);
   if (r) {
     fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    free(stream->data);
-    free(stream);
+    server_stats.accepts_refused++;
+    pool_put(&connection_pool, conn);
+    pool_put(&stream_pool, stream);
     return;
   }
+  /* Counted from here to on_close. */
+  stream->data = conn;
+  conn->admin = server == admin_listener;
+  conn->handle = (uv_handle_t*) stream;
+  conn->next = connections;
+  if (connections != NULL)
+    connections->prev = conn;
+  connections = conn;
+  open_connections++;
 
   /* Accept before anything else can fail: returning from this callback without
    * having accepted makes libuv stop watching the listening socket, and only
@@ -1120,14 +4268,20 @@ on_connection(uv_stream_t* server, int status) {
   r = uv_accept(server, stream);
   if (r) {
     fprintf(stderr, "Accept error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    server_stats.accepts_refused++;
     close_connection((uv_handle_t*) stream);
     return;
   }
 
+  conn->id = ++next_connection_id;
+  TRACE1(conn__accept, conn->id);
+
   /* Not worth dropping a connection over. */
-  r = uv_tcp_nodelay((uv_tcp_t*) stream, 1);
-  if (r)
-    fprintf(stderr, "Flag error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+  if (stream->type == UV_TCP) {
+    r = uv_tcp_nodelay((uv_tcp_t*) stream, 1);
+    if (r)
+      fprintf(stderr, "Flag error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+  }
 
   r = uv_read_start(stream, on_alloc, on_read);
   if (r) {
@@ -1136,13 +4290,208 @@ on_connection(uv_stream_t* server, int status) {
   }
 }
 
-static void
-usage(const char* app) {
+/* Binds a pipe listener to path.  On Linux a name starting with '@' is in the
+ * abstract namespace: nothing appears in the file system and nothing is left
+ * behind to clean up. */
+static int
+bind_pipe_listener(uv_pipe_t* listener, const char* path) {
+  int r;
+#ifndef _WIN32
+  size_t len = strlen(path);
+  if (len >= sizeof(((struct sockaddr_un*) 0)->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return 1;
+  }
+#endif
+#ifdef __linux__
+  if (path[0] == '@') {
+    char name[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    name[0] = '\0';
+    memcpy(name + 1, path + 1, len - 1);
+# if UV_VERSION_HEX >= 0x012e00
+    r = uv_pipe_bind2(listener, name, len, 0);
+# else
+    /* uv_pipe_bind takes a NUL terminated path, so before uv_pipe_bind2 an
+     * abstract name has to be bound by hand and the socket handed over. */
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      fprintf(stderr, "Socket creation error: %s\n", strerror(errno));
+      return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, name, len);
+    if (bind(fd, (struct sockaddr*) &addr, (socklen_t) (offsetof(struct sockaddr_un, sun_path) + len))) {
+      fprintf(stderr, "Bind error: %s: %s\n", path, strerror(errno));
+      close(fd);
+      return 1;
+    }
+    r = uv_pipe_open(listener, fd);
+# endif
+    if (r) {
+      fprintf(stderr, "Bind error: %s: %s: %s\n", path, uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    return 0;
+  }
+#endif
+#ifndef _WIN32
+  /* A socket file left by a server that was killed would make the bind
+   * fail, so one is removed first.  Anything else at the path is not ours to
+   * remove. */
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+#endif
+  r = uv_pipe_bind(listener, path);
+  if (r) {
+    fprintf(stderr, "Bind error: %s: %s: %s\n", path, uv_err_name(r), uv_strerror(r));
+    return 1;
+  }
+  return 0;
+}
+
+/* Parses one -S key=value.  Returns nonzero for anything not understood. */
+static int
+parse_socket_option(const char* arg) {
+  static const struct {
+    const char* name;
+    int* value;
+    long max;
+  } keys[] = {
+    { "backlog", &socket_tuning.backlog, 65535 },
+    { "defer-accept", &socket_tuning.defer_accept, 3600 },
+    { "fastopen", &socket_tuning.fastopen, 65535 },
+    { "rcvbuf", &socket_tuning.rcvbuf, 64 * 1024 * 1024 },
+    { "sndbuf", &socket_tuning.sndbuf, 64 * 1024 * 1024 },
+    { "cork", &socket_tuning.cork, 1 },
+  };
+  const char* eq = strchr(arg, '=');
+  size_t len = eq ? (size_t) (eq - arg) : strlen(arg);
+  size_t i;
+
+  for (i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (strlen(keys[i].name) != len || memcmp(keys[i].name, arg, len))
+      continue;
+    /* A bare flag turns it on. */
+    if (eq == NULL) {
+      if (keys[i].max != 1)
+        return -1;
+      *keys[i].value = 1;
+      return 0;
+    }
+    char* e = NULL;
+    long value;
+    errno = 0;
+    value = strtol(eq + 1, &e, 10);
+    if (e == eq + 1 || *e || errno != 0 || value < 0 || value > keys[i].max)
+      return -1;
+    *keys[i].value = (int) value;
+    return 0;
+  }
+  return -1;
+}
+
+/* Applies the listener side of -S.  Accepted sockets inherit the buffer
+ * sizes, which have to be set before listen() to take part in choosing the
+ * window scale. */
+static int
+tune_listener(uv_tcp_t* server) {
+  int r;
+
+  if (socket_tuning.rcvbuf > 0) {
+    int value = socket_tuning.rcvbuf;
+    r = uv_recv_buffer_size((uv_handle_t*) server, &value);
+    if (r) {
+      fprintf(stderr, "Socket option error: rcvbuf: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+  }
+  if (socket_tuning.sndbuf > 0) {
+    int value = socket_tuning.sndbuf;
+    r = uv_send_buffer_size((uv_handle_t*) server, &value);
+    if (r) {
+      fprintf(stderr, "Socket option error: sndbuf: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+  }
+  if (socket_tuning.defer_accept == 0 && socket_tuning.fastopen == 0)
+    return 0;
+
+#ifndef _WIN32
+  uv_os_fd_t fd;
+  r = uv_fileno((uv_handle_t*) server, &fd);
+  if (r) {
+    fprintf(stderr, "Socket option error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    return 1;
+  }
+#endif
+  if (socket_tuning.defer_accept > 0) {
+#if defined(TCP_DEFER_ACCEPT) && !defined(_WIN32)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &socket_tuning.defer_accept, sizeof(int))) {
+      fprintf(stderr, "Socket option error: defer-accept: %s\n", strerror(errno));
+      return 1;
+    }
+#else
+    fprintf(stderr, "Socket option error: defer-accept: not supported here\n");
+    return 1;
+#endif
+  }
+  if (socket_tuning.fastopen > 0) {
+#if defined(TCP_FASTOPEN) && !defined(_WIN32)
+    if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &socket_tuning.fastopen, sizeof(int))) {
+      fprintf(stderr, "Socket option error: fastopen: %s\n", strerror(errno));
+      return 1;
+    }
+#else
+    fprintf(stderr, "Socket option error: fastopen: not supported here\n");
+    return 1;
+#endif
+  }
+  return 0;
+}
+
+void
+http_server_usage(const char* app) {
   fprintf(stderr, "usage: %s [OPTIONS]\n", app);
   fprintf(stderr, "    -a ADDR: address (default: 0.0.0.0)\n");
   fprintf(stderr, "    -p PORT: port number (default: 7000)\n");
+  fprintf(stderr, "    -u PATH: also listen on a Unix domain socket, or only on it unless\n");
+  fprintf(stderr, "             -a or -p is given; @NAME is abstract (Linux)\n");
   fprintf(stderr, "    -d DIR:  root directory (default: public)\n");
-  exit(1);
+  fprintf(stderr, "    -l:      list directories that have no index file\n");
+  fprintf(stderr, "    -e:      answer errors with pages like 404.html from DIR when present\n");
+  fprintf(stderr, "    -H:      keep the file cache on explicit huge pages\n");
+  fprintf(stderr, "    -P PACK: serve a site pack built by http-server-pack instead of DIR\n");
+  fprintf(stderr, "    -c PATTERN=VALUE:\n");
+  fprintf(stderr, "             Cache-Control for paths starting with PATTERN, or ending in it\n");
+  fprintf(stderr, "             if it starts with '.'; repeatable, the first match applies\n");
+  fprintf(stderr, "             (fingerprinted names like app.3f2a9c1b.js that no rule\n");
+  fprintf(stderr, "             matches are cached for a year)\n");
+  fprintf(stderr, "    -L PAUSE_MS[,SHED_MS]:\n");
+  fprintf(stderr, "             stop accepting at this much loop lag, and answer 503 past\n");
+  fprintf(stderr, "             SHED_MS (default: twice PAUSE_MS)\n");
+  fprintf(stderr, "    -C MAX:  stop accepting while MAX connections are open\n");
+  fprintf(stderr, "    -A PREFIX: serve PREFIX/metrics, and a CPU profile at\n");
+  fprintf(stderr, "             PREFIX/profile?seconds=N, on the -M listener only\n");
+  fprintf(stderr, "    -M PORT|PATH: the admin listener, on that port of 127.0.0.1 or\n");
+  fprintf(stderr, "             a Unix domain socket; required with -A\n");
+  fprintf(stderr, "    -W QUOTA[,RATE]:\n");
+  fprintf(stderr, "             send responses bigger than QUOTA bytes in turns of QUOTA\n");
+  fprintf(stderr, "             per loop iteration, at most RATE bytes/s each\n");
+  fprintf(stderr, "             (default: 0, every response is sent whole)\n");
+  fprintf(stderr, "    -t FILE: write a line per request to FILE, for bench/replay.py\n");
+  fprintf(stderr, "    -D BYTES: stream files of at least BYTES without filling the page\n");
+  fprintf(stderr, "             cache, with O_DIRECT where the file system allows it\n");
+  fprintf(stderr, "    -T N:    sample TCP_INFO (RTT, retransmits, delivery rate, cwnd) as\n");
+  fprintf(stderr, "             every Nth response completes, into the -A metrics (Linux)\n");
+  fprintf(stderr, "    -S KEY=VALUE: socket tuning, repeatable:\n");
+  fprintf(stderr, "             backlog=N       listen backlog (default: SOMAXCONN)\n");
+  fprintf(stderr, "             defer-accept=S  accept only once data arrives, waiting up to S s\n");
+  fprintf(stderr, "             fastopen=N      accept TCP Fast Open, N pending at most\n");
+  fprintf(stderr, "             rcvbuf=BYTES, sndbuf=BYTES  socket buffer sizes\n");
+  fprintf(stderr, "             cork            send a streamed header with its first chunk\n");
 }
 
 static void
@@ -1157,24 +4506,29 @@ add_mime_type(const char* ext, const char* value) {
   kh_value(mime_type, k) = value;
 }
 
-static void
-on_signal(uv_signal_t* handle, int signum) {
-  (void) signum;
-  uv_stop((uv_loop_t*) handle->data);
-}
-
+/* The options are the command line's.  Everything is static, so there is
+ * one server per process and this is called once. */
 int
-main(int argc, char* argv[]) {
+http_server_start(uv_loop_t* server_loop, int argc, char* argv[]) {
   char* ipaddr = "0.0.0.0";
   int port = 7000;
+  int listen_tcp = -1;
+  const char* pack_path = NULL;
+  const char* trace_path = NULL;
   int i;
+
+  if (loop != NULL) {
+    fprintf(stderr, "Server already started\n");
+    return 1;
+  }
   for (i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "-a")) {
-      if (i == argc-1) usage(argv[0]);
+      if (i == argc-1) return 2;
       ipaddr = argv[++i];
+      listen_tcp = 1;
     } else
     if (!strcmp(argv[i], "-p")) {
-      if (i == argc-1) usage(argv[0]);
+      if (i == argc-1) return 2;
       /* Range checked as a long, before narrowing: assigning to an int first
        * lets a value like 4294967296 truncate to something that passes. */
       const char* arg = argv[++i];
@@ -1183,14 +4537,169 @@ main(int argc, char* argv[]) {
       errno = 0;
       value = strtol(arg, &e, 10);
       if (e == arg || *e || errno != 0 || value < 0 || value > 65535)
-        usage(argv[0]);
+        return 2;
       port = (int) value;
+      listen_tcp = 1;
+    } else
+    if (!strcmp(argv[i], "-u")) {
+      if (i == argc-1) return 2;
+      pipe_path = argv[++i];
+      if (*pipe_path == '\0')
+        return 2;
     } else
     if (!strcmp(argv[i], "-d")) {
-      if (i == argc-1) usage(argv[0]);
+      if (i == argc-1) return 2;
       static_dir = argv[++i];
     } else
-      usage(argv[0]);
+    if (!strcmp(argv[i], "-l")) {
+      dir_listing = 1;
+    } else
+    if (!strcmp(argv[i], "-e")) {
+      error_pages = 1;
+    } else
+    if (!strcmp(argv[i], "-H")) {
+      arena_huge_pages = 1;
+    } else
+    if (!strcmp(argv[i], "-P")) {
+      if (i == argc-1) return 2;
+      pack_path = argv[++i];
+    } else
+    if (!strcmp(argv[i], "-c")) {
+      if (i == argc-1) return 2;
+      if (add_cache_rule(argv[++i]))
+        return 2;
+    } else
+    if (!strcmp(argv[i], "-L")) {
+      if (i == argc-1) return 2;
+      const char* arg = argv[++i];
+      char* e = NULL;
+      errno = 0;
+      pause_lag_ms = strtol(arg, &e, 10);
+      if (e == arg || errno != 0 || pause_lag_ms < 0 || pause_lag_ms > 3600000)
+        return 2;
+      if (*e == ',') {
+        arg = e + 1;
+        shed_lag_ms = strtol(arg, &e, 10);
+        if (e == arg || errno != 0 || shed_lag_ms < 0 || shed_lag_ms > 3600000)
+          return 2;
+      } else
+        shed_lag_ms = pause_lag_ms * 2;
+      if (*e)
+        return 2;
+    } else
+    if (!strcmp(argv[i], "-C")) {
+      if (i == argc-1) return 2;
+      const char* arg = argv[++i];
+      char* e = NULL;
+      errno = 0;
+      max_connections = strtol(arg, &e, 10);
+      if (e == arg || *e || errno != 0 || max_connections < 1 || max_connections > INT_MAX)
+        return 2;
+    } else
+    if (!strcmp(argv[i], "-A")) {
+      if (i == argc-1) return 2;
+      admin_prefix = argv[++i];
+      admin_prefix_len = strlen(admin_prefix);
+      /* "/" would put the endpoints at "//metrics"; the prefix names a
+       * directory without its trailing slash. */
+      while (admin_prefix_len > 0 && admin_prefix[admin_prefix_len - 1] == '/')
+        admin_prefix_len--;
+      if (admin_prefix[0] != '/' && admin_prefix_len > 0)
+        return 2;
+    } else
+    if (!strcmp(argv[i], "-M")) {
+      if (i == argc-1) return 2;
+      admin_address = argv[++i];
+      if (*admin_address == '\0')
+        return 2;
+      /* All digits is a port, anything else a socket path. */
+      if (strspn(admin_address, "0123456789") == strlen(admin_address)) {
+        char* e = NULL;
+        long value;
+        errno = 0;
+        value = strtol(admin_address, &e, 10);
+        if (errno != 0 || value < 1 || value > 65535)
+          return 2;
+        admin_port = (int) value;
+      }
+    } else
+    if (!strcmp(argv[i], "-W")) {
+      if (i == argc-1) return 2;
+      const char* arg = argv[++i];
+      char* e = NULL;
+      long long value;
+      errno = 0;
+      value = strtoll(arg, &e, 10);
+      /* Slices smaller than a chunk only add round trips. */
+      if (e == arg || errno != 0 || value < 0 || (value > 0 && value < WRITE_BUF_SIZE) ||
+          value > 1024 * 1024 * 1024)
+        return 2;
+      write_quota = (size_t) value;
+      if (*e == ',') {
+        arg = e + 1;
+        value = strtoll(arg, &e, 10);
+        if (e == arg || errno != 0 || value <= 0 || write_quota == 0)
+          return 2;
+        write_rate = (uint64_t) value;
+      }
+      if (*e)
+        return 2;
+    } else
+    if (!strcmp(argv[i], "-t")) {
+      if (i == argc-1) return 2;
+      trace_path = argv[++i];
+    } else
+    if (!strcmp(argv[i], "-D")) {
+      if (i == argc-1) return 2;
+      const char* arg = argv[++i];
+      char* e = NULL;
+      long long value;
+      errno = 0;
+      value = strtoll(arg, &e, 10);
+      if (e == arg || *e || errno != 0 || value <= 0)
+        return 2;
+      uncached_size = (uint64_t) value;
+    } else
+    if (!strcmp(argv[i], "-T")) {
+      if (i == argc-1) return 2;
+      const char* arg = argv[++i];
+      char* e = NULL;
+      long value;
+      errno = 0;
+      value = strtol(arg, &e, 10);
+      if (e == arg || *e || errno != 0 || value < 1 || value > 1000000)
+        return 2;
+      tcp_info_every = (unsigned long) value;
+    } else
+    if (!strcmp(argv[i], "-S")) {
+      if (i == argc-1) return 2;
+      if (parse_socket_option(argv[++i]))
+        return 2;
+    } else
+      return 2;
+  }
+  /* Either without the other would leave the endpoints nowhere, or a
+   * listener serving nothing of its own. */
+  if ((admin_prefix == NULL) != (admin_address == NULL))
+    return 2;
+#ifndef HAVE_TCP_INFO
+  if (tcp_info_every > 0) {
+    fprintf(stderr, "-T is not supported here\n");
+    return 1;
+  }
+#endif
+  if (pack_path != NULL) {
+    /* A pack's headers are rendered when it is built. */
+    if (ncache_rules > 0) {
+      fprintf(stderr, "-c has no effect with -P: give the rules to http-server-pack\n");
+      return 1;
+    }
+    if (load_site_pack(pack_path))
+      return 1;
+    /* Pack paths are the resolved targets themselves.  There is no root to
+     * find error pages in either. */
+    static_dir = "";
+    error_pages = 0;
   }
   static_dir_len = strlen(static_dir);
   if (static_dir_len > (int) (PATH_MAX - sizeof(INDEX_FILE) - 1)) {
@@ -1211,74 +4720,218 @@ main(int argc, char* argv[]) {
     fprintf(stderr, "Allocate error: %s\n", strerror(errno));
     return 1;
   }
-  add_mime_type(".jpg", "image/jpeg");
-  add_mime_type(".png", "image/png");
-  add_mime_type(".gif", "image/gif");
-  add_mime_type(".html", "text/html");
-  add_mime_type(".css", "text/css");
-  add_mime_type(".txt", "text/plain");
-  add_mime_type(".js", "text/javascript");
+  body_cache = kh_init(body_cache);
+  if (body_cache == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    return 1;
+  }
+  open_files = kh_init(open_files);
+  missing_paths = kh_init(missing_paths);
+  missing_watches = kh_init(missing_watches);
+  if (open_files == NULL || missing_paths == NULL || missing_watches == NULL) {
+    fprintf(stderr, "Allocate error: %s\n", strerror(errno));
+    return 1;
+  }
+  for (i = 0; i < (int) (sizeof(default_mime_types) / sizeof(default_mime_types[0])); i++)
+    add_mime_type(default_mime_types[i].ext, default_mime_types[i].type);
+  render_status_responses();
 
+  if (listen_tcp < 0)
+    listen_tcp = pipe_path == NULL;
   r = uv_ip4_addr(ipaddr, port, &addr);
   if (r) {
     fprintf(stderr, "Address error: %s: %s\n", uv_err_name(r), uv_strerror(r));
     return 1;
   }
 
-  loop = uv_default_loop();
+  loop = server_loop != NULL ? server_loop : uv_default_loop();
 
-  uv_tcp_t server;
-  r = uv_tcp_init(loop, &server);
+  r = uv_timer_init(loop, &arena_compactor);
   if (r) {
-    fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
     return 1;
   }
+  uv_unref((uv_handle_t*) &arena_compactor);
 
-  r = uv_tcp_bind(&server, (const struct sockaddr*) &addr, 0);
+  r = uv_timer_init(loop, &open_file_sweeper);
+  if (r == 0)
+    r = uv_timer_start(&open_file_sweeper, on_open_file_sweep, OPEN_FILE_IDLE_MS, OPEN_FILE_IDLE_MS);
   if (r) {
-    fprintf(stderr, "Bind error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
     return 1;
   }
+  uv_unref((uv_handle_t*) &open_file_sweeper);
 
-  r = uv_tcp_simultaneous_accepts((uv_tcp_t*) &server, 1);
+  r = uv_idle_init(loop, &write_scheduler);
+  if (r == 0)
+    r = uv_timer_init(loop, &write_throttle);
   if (r) {
-    fprintf(stderr, "Accept error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+    fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
     return 1;
   }
 
-  fprintf(stderr, "Listening %s:%d\n", ipaddr, port);
+  /* The lag is only sampled when something uses it. */
+  if (pause_lag_ms >= 0 || shed_lag_ms >= 0 || admin_prefix != NULL) {
+    r = uv_timer_init(loop, &lag_timer);
+    if (r) {
+      fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    lag_expected = uv_hrtime() + (uint64_t) LAG_SAMPLE_MS * 1000000;
+    r = uv_timer_start(&lag_timer, on_lag_sample, LAG_SAMPLE_MS, LAG_SAMPLE_MS);
+    if (r) {
+      fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    uv_unref((uv_handle_t*) &lag_timer);
+  }
 
-  r = uv_listen((uv_stream_t*)&server, SOMAXCONN, on_connection);
-  if (r) {
-    fprintf(stderr, "Listen error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    return 1;
+  if (trace_path != NULL) {
+    request_trace = fopen(trace_path, "w");
+    if (request_trace == NULL) {
+      fprintf(stderr, "Trace open error: %s: %s\n", trace_path, strerror(errno));
+      return 1;
+    }
+    setvbuf(request_trace, NULL, _IOFBF, REQUEST_TRACE_BUF_SIZE);
+    fprintf(request_trace, "# usec\tstatus\tbytes\tmethod\ttarget\n");
+    request_trace_started = uv_hrtime() / 1000;
+    r = uv_timer_init(loop, &request_trace_flusher);
+    if (r == 0)
+      r = uv_timer_start(&request_trace_flusher, on_request_trace_flush, REQUEST_TRACE_FLUSH_MS, REQUEST_TRACE_FLUSH_MS);
+    if (r) {
+      fprintf(stderr, "Timer error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    uv_unref((uv_handle_t*) &request_trace_flusher);
   }
 
-  uv_signal_t sig;
-  r = uv_signal_init(loop, &sig);
-  if (r) {
-    fprintf(stderr, "Signal error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    return 1;
+  int backlog = socket_tuning.backlog > 0 ? socket_tuning.backlog : SOMAXCONN;
+
+  if (listen_tcp) {
+    r = uv_tcp_init(loop, &tcp_listener);
+    if (r) {
+      fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+
+    r = uv_tcp_bind(&tcp_listener, (const struct sockaddr*) &addr, 0);
+    if (r) {
+      fprintf(stderr, "Bind error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+
+    r = uv_tcp_simultaneous_accepts(&tcp_listener, 1);
+    if (r) {
+      fprintf(stderr, "Accept error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+
+    if (tune_listener(&tcp_listener))
+      return 1;
+
+    fprintf(stderr, "Listening %s:%d\n", ipaddr, port);
+
+    r = uv_listen((uv_stream_t*) &tcp_listener, backlog, on_connection);
+    if (r) {
+      fprintf(stderr, "Listen error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    listening_tcp = 1;
   }
-  sig.data = loop;
-  r = uv_signal_start(&sig, on_signal, SIGINT);
-  if (r) {
-    fprintf(stderr, "Signal error: %s: %s\n", uv_err_name(r), uv_strerror(r));
-    return 1;
+
+  if (pipe_path != NULL) {
+    r = uv_pipe_init(loop, &pipe_listener, 0);
+    if (r) {
+      fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    if (bind_pipe_listener(&pipe_listener, pipe_path))
+      return 1;
+
+    fprintf(stderr, "Listening %s\n", pipe_path);
+
+    r = uv_listen((uv_stream_t*) &pipe_listener, backlog, on_connection);
+    if (r) {
+      fprintf(stderr, "Listen error: %s: %s: %s\n", pipe_path, uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    listening_pipe = 1;
   }
 
-#ifdef SIGPIPE
-  struct sigaction act;
-  memset(&act, 0, sizeof(act));
-  act.sa_handler = SIG_IGN;
-  act.sa_flags = SA_RESTART;
-  if (sigaction(SIGPIPE, &act, NULL)) {
-    fprintf(stderr, "cannot ignore SIGPIPE\n");
-    return 1;
+  if (admin_port > 0) {
+    struct sockaddr_in admin_addr;
+    r = uv_ip4_addr("127.0.0.1", admin_port, &admin_addr);
+    if (r == 0)
+      r = uv_tcp_init(loop, &admin_tcp_listener);
+    if (r) {
+      fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    r = uv_tcp_bind(&admin_tcp_listener, (const struct sockaddr*) &admin_addr, 0);
+    if (r) {
+      fprintf(stderr, "Bind error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    fprintf(stderr, "Admin listening 127.0.0.1:%d\n", admin_port);
+    admin_listener = (uv_stream_t*) &admin_tcp_listener;
+  } else if (admin_address != NULL) {
+    r = uv_pipe_init(loop, &admin_pipe_listener, 0);
+    if (r) {
+      fprintf(stderr, "Socket creation error: %s: %s\n", uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
+    if (bind_pipe_listener(&admin_pipe_listener, admin_address))
+      return 1;
+    fprintf(stderr, "Admin listening %s\n", admin_address);
+    admin_listener = (uv_stream_t*) &admin_pipe_listener;
+  }
+  if (admin_listener != NULL) {
+    r = uv_listen(admin_listener, SOMAXCONN, on_connection);
+    if (r) {
+      fprintf(stderr, "Listen error: %s: %s: %s\n", admin_address, uv_err_name(r), uv_strerror(r));
+      return 1;
+    }
   }
-#endif
 
-  return uv_run(loop, UV_RUN_DEFAULT);
+  return 0;
+}
+
+void
+http_server_stop(void) {
+  http_connection* conn;
+  if (stopping)
+    return;
+  stopping = 1;
+  /* A listener paused for lag or the cap would be accepted on again. */
+  accept_paused = 0;
+  paused_listeners[0] = paused_listeners[1] = NULL;
+  if (request_trace != NULL)
+    flush_request_trace();
+  if (listening_tcp && !uv_is_closing((uv_handle_t*) &tcp_listener))
+    uv_close((uv_handle_t*) &tcp_listener, NULL);
+  if (listening_pipe && !uv_is_closing((uv_handle_t*) &pipe_listener)) {
+    uv_close((uv_handle_t*) &pipe_listener, NULL);
+#ifndef _WIN32
+    if (pipe_path[0] != '@')
+      unlink(pipe_path);
+#endif
+  }
+  if (admin_listener != NULL && !uv_is_closing((uv_handle_t*) admin_listener)) {
+    uv_close((uv_handle_t*) admin_listener, NULL);
+#ifndef _WIN32
+    if (admin_port == 0 && admin_address[0] != '@')
+      unlink(admin_address);
+#endif
+  }
+  /* An idle connection has no owner to close it, and keep-alive would hold
+   * it open for as long as the client likes.  One with a request in flight is
+   * closed by destroy_request once the response is done. */
+  for (conn = connections; conn != NULL; conn = conn->next) {
+    if (conn->request == NULL)
+      close_connection(conn->handle);
+  }
+  if (open_connections == 0)
+    close_server_handles();
 }
 
 /* vim:set et ts=2 sw=2 cino=>2: */
@@ -26,6 +26,23 @@
 #include "uv.h"
 #include "picohttpparser.h"
 
+/* Request header fields the server reads.  They are found in one pass when the
+ * head is parsed (classify_headers), so reading another field costs a lookup
+ * rather than another scan of every header. */
+enum {
+  HEADER_UNKNOWN = -1,
+  HEADER_HOST,
+  HEADER_RANGE,
+  HEADER_ACCEPT,
+  HEADER_CONNECTION,
+  HEADER_IF_NONE_MATCH,
+  HEADER_CONTENT_LENGTH,
+  HEADER_ACCEPT_ENCODING,
+  HEADER_KNOWN
+};
+
+#define MAX_HEADERS 32
+
 typedef struct _http_request {
   uv_handle_t* handle;
 
@@ -34,8 +51,17 @@ typedef struct _http_request {
   int minor_version;
   const char* path;
   size_t path_len;
-  struct phr_header headers[32];
+  /* The query string, without its '?', split off path: a file is looked up
+   * by path alone, so that "/app.js?v=123" is app.js. */
+  const char* query;
+  size_t query_len;
+  struct phr_header headers[MAX_HEADERS];
   size_t num_headers;
+  /* Index of the first header of each known kind, or -1.  A field can be
+   * repeated, so further ones of the same kind are chained through
+   * header_next, which ends in -1 too. */
+  signed char header_first[HEADER_KNOWN];
+  signed char header_next[MAX_HEADERS];
   size_t last_len;
   const char* payload;
   size_t payload_len;
@@ -43,20 +69,34 @@ typedef struct _http_request {
   /* method points into the read buffer, which is freed before the response is
    * built, so what it was has to be recorded here. */
   int head_only;
+  /* The target named a directory, so file_path ends in the index file that
+   * build_file_path appended to it. */
+  int names_dir;
 
   char file_path[PATH_MAX];
 } http_request;
 
-/* Scratch space handed to libuv for each read.  One read is in flight per
- * connection at a time, so a fixed buffer can be reused instead of having
- * on_alloc allocate and on_read free one per read. */
+/* Where libuv reads into.  One read is in flight per connection at a time, so
+ * a fixed buffer can be reused instead of having on_alloc allocate and on_read
+ * free one per read.  A head that arrives whole is parsed where it lies, so
+ * the request in flight points into this buffer. */
 #define READ_BUF_SIZE 16384
 
 /* Per connection state, hung off the handle's data pointer.  A request can
- * arrive across several reads, so the bytes seen so far are accumulated here;
+ * arrive across several reads, so the bytes seen so far are accumulated in buf;
  * `request` is the one currently being served, or NULL when the connection is
  * idle and therefore unowned. */
-typedef struct {
+typedef struct _http_connection {
+  /* Sequential, for telling connections apart in traces. */
+  uint64_t id;
+  /* Every open connection is on one list, so http_server_stop can find those
+   * that are idle. */
+  uv_handle_t* handle;
+  struct _http_connection* next;
+  struct _http_connection* prev;
+  /* Accepted on the admin listener (-M), the only place the admin endpoints
+   * are answered. */
+  int admin;
   char* buf;
   size_t len;
   size_t cap;
@@ -70,26 +110,109 @@ typedef struct {
 } http_connection;
 
 struct file_cache_entry;
+struct open_file;
 
-typedef struct {
+typedef struct _http_response {
   uv_file fd;
   uv_write_t write_req;
   uv_write_t header_req;
   uv_fs_t read_req;
+  /* header and pbuf come from the buffer pool, or pbuf from the aligned one
+   * for a file read with O_DIRECT (-D).  owned is handed to release once the
+   * response is done with: a response rendered for one request, to free(), or
+   * the data of http_respond_nocopy, to its callback. */
   char* header;
   char* pbuf;
+  void* owned;
+  void (*release)(void* owned);
   uv_buf_t buf;
   uv_handle_t* handle;
 
   uint64_t response_size;
   uint64_t response_offset;
+  /* TCP_CORK is set on the connection until the first body chunk is
+   * written (-S cork). */
+  int corked;
+
+  /* Write scheduling (-W).  A response sent in slices is on the run queue,
+   * or the throttled list, through next_ready between slices.  One from
+   * memory keeps what is still to go in pending, from pending_first on. */
+  struct _http_response* next_ready;
+  uv_buf_t pending[3];
+  unsigned int pending_first;
+  unsigned int npending;
+  /* Bytes it may send before it has to wait, under a rate cap. */
+  uint64_t tokens;
+  uint64_t refilled_at;
 
   /* Held (reference counted) while a cached response is being written, so an
    * entry displaced by a newer version of the file cannot be freed while its
    * buffers are still queued in libuv. */
   struct file_cache_entry* cache_entry;
+  /* Likewise the shared descriptor a streamed response reads from (fd). */
+  struct open_file* open_file;
 
   http_request* request;
 } http_response;
 
+/* Embedding.  The server is a library (libhttpserver); http-server is main.c
+ * on top of it.  A program adds its routes, starts the server on its loop and
+ * runs the loop, and its handlers are called on that loop with each parsed
+ * request for a path they were routed.  Only GET and HEAD reach a handler:
+ * request bodies are not read. */
+
+/* Starts serving on loop, or the default loop if NULL, with the options of
+ * the command line (argv[0] is skipped).  There is one server per process.
+ * Returns 0 on success, 1 on an error it has reported on stderr, or 2 if the
+ * options were not understood.  Signals are left to the caller, and SIGPIPE
+ * has to be ignored: a write to a peer that has gone would raise it. */
+int http_server_start(uv_loop_t* loop, int argc, char* argv[]);
+
+/* Stops serving: the listeners and idle connections are closed at once, and
+ * a connection with a request in flight once its response has gone out.  The
+ * server's own handles are closed with the last connection, so the loop then
+ * runs out, and can be closed, unless the program has handles of its own
+ * open.  A handler that never answers keeps its connection open.  A socket
+ * file made for -u or -M is removed. */
+void http_server_stop(void);
+
+/* The options http_server_start takes, on stderr. */
+void http_server_usage(const char* app);
+
+/* Returns 0 once it has taken the request, or nonzero to pass it on to the
+ * next route that matches and in the end the files.  A handler that takes the
+ * request answers it exactly once with one of the http_respond calls below,
+ * then or later from another callback on the loop; the request is not to be
+ * touched after that.  Until then path, query and headers stay valid. */
+typedef int (*http_handler)(http_request* request, void* data);
+
+/* Routes requests for a path to handler, which gets data along with them.  A
+ * pattern ending in '*' covers every path that starts with what comes before
+ * it; any other only the path itself.  Paths are matched as sent, before any
+ * percent-decoding, and without the query string.  Routes are tried in the
+ * order they were added, ahead of the files, and the pattern has to stay
+ * valid.  Returns -1 if the pattern does not start with '/' or there are too
+ * many. */
+int http_server_route(const char* pattern, http_handler handler, void* data);
+
+/* Answers with status, a Content-Type (text/plain if NULL) and body.  headers,
+ * if not NULL, is inserted as is and has to end in CRLF.  Content-Length and
+ * Connection are added, and a HEAD request gets the header alone.  The body
+ * is copied if it cannot all be sent at once, so it only has to last the
+ * call; http_respond_nocopy never copies it, so it has to stay valid until
+ * done(data) is called.  That happens exactly once, when the server is
+ * finished with the body: before the call returns if the response went out
+ * at once or could not be sent, otherwise later on the loop.  done may be
+ * NULL for a body that lasts for good, like a string constant.  Either way
+ * the response is usually written before the call returns.  If the header
+ * does not fit, the client gets a 500. */
+void http_respond(http_request* request, int status, const char* ctype, const char* headers, const char* body, size_t len);
+void http_respond_nocopy(http_request* request, int status, const char* ctype, const char* headers, const char* body, size_t len,
+    void (*done)(void* data), void* data);
+
+/* Answers as a request for path, below the document root, would have been:
+ * from the file cache, the site pack or by streaming, or with a 404.  It
+ * replaces request->path. */
+void http_respond_file(http_request* request, const char* path);
+
 #endif
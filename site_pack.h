@@ -0,0 +1,96 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _SITE_PACK_H_
+#define _SITE_PACK_H_
+
+/* On-disk format of a site pack: a whole document root rendered ahead of time
+ * into one file that the server maps and serves from directly (-P).  It is
+ * written by http-server-pack and read in native byte order, so a pack is
+ * built for the architecture that serves it.
+ *
+ *   site_pack_header
+ *   for each file: path, then per variant the close header, the keep-alive
+ *                  header and the body, back to back
+ *   site_pack_slot[nslots], an open addressing table indexed by path hash
+ *
+ * Laying the keep-alive header directly in front of its body makes the
+ * common response a single contiguous span of the mapping. */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SITE_PACK_MAGIC "HSPACK\r\n"
+#define SITE_PACK_VERSION 1
+
+/* Bodies are sent as a single buffer, whose length libuv takes as an int, so
+ * anything bigger is left out of a pack. */
+#define SITE_PACK_MAX_BODY (1024 * 1024 * 1024)
+
+/* Variants of a file's body.  The compressed one is only present if it was
+ * asked for when packing and came out smaller. */
+#define SITE_PACK_IDENTITY 0
+#define SITE_PACK_GZIP 1
+#define SITE_PACK_VARIANTS 2
+
+typedef struct {
+  uint64_t offset;
+  uint64_t len;
+} site_pack_span;
+
+typedef struct {
+  site_pack_span header_close;
+  site_pack_span header_keep_alive;
+  site_pack_span body;
+} site_pack_variant;
+
+typedef struct {
+  /* Hash of the path; 0 marks an empty slot. */
+  uint64_t hash;
+  site_pack_span path;
+  site_pack_variant variants[SITE_PACK_VARIANTS];
+} site_pack_slot;
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  /* A power of two. */
+  uint32_t nslots;
+  uint64_t slots_offset;
+  /* Size of the whole file, so a truncated copy is refused. */
+  uint64_t size;
+} site_pack_header;
+
+/* Paths are the resolved request target, "/" separated and starting with one,
+ * with the index file already appended to a directory. */
+static uint64_t
+site_pack_hash(const char* path, size_t len) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char) path[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h ? h : 1;
+}
+
+#endif
@@ -0,0 +1,220 @@
+#!/usr/bin/env python3
+"""Steady-state allocation test for http-server.
+
+Usage: test/alloc.py ./http-server
+
+Needs a binary built with -DALLOC_STATS, which counts the server's own heap
+allocations and reports them in its metrics. Runs a mixed workload twice to
+warm the caches and object pools, then once more, and checks that the last run
+made no heap allocations at all: keep-alive hits, connection churn, misses,
+streamed files, and responses too big to leave in one write.
+"""
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+failures = []
+
+
+def check(name, got, want):
+    if got == want:
+        print(f"  ok    {name}")
+    else:
+        print(f"  FAIL  {name}: got {got!r}, want {want!r}")
+        failures.append(name)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def read_response(s, head_only=False):
+    data = b""
+    while b"\r\n\r\n" not in data:
+        chunk = s.recv(65536)
+        if not chunk:
+            return None
+        data += chunk
+    head, rest = data.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in head.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:"):
+            length = int(line.split(b":", 1)[1])
+    if head_only:
+        length = 0
+    while len(rest) < length:
+        chunk = s.recv(65536)
+        if not chunk:
+            return None
+        rest += chunk
+    return head.split(b"\r\n", 1)[0]
+
+
+def one(port, target, method=b"GET"):
+    s = socket.create_connection(("127.0.0.1", port), timeout=5)
+    try:
+        s.sendall(method + b" " + target + b" HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+        return read_response(s, method == b"HEAD")
+    finally:
+        s.close()
+
+
+def allocations(port):
+    s = socket.create_connection(("127.0.0.1", port), timeout=5)
+    try:
+        s.sendall(b"GET /_admin/metrics HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+        data = b""
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+    finally:
+        s.close()
+    for line in data.split(b"\n"):
+        if line.startswith(b"http_server_heap_allocations_total "):
+            return int(line.split()[1])
+    return None
+
+
+def keep_alive_client(port, errors):
+    try:
+        s = socket.create_connection(("127.0.0.1", port), timeout=5)
+        try:
+            for i in range(60):
+                target, method = ((b"/index.html", b"GET"), (b"/nope", b"GET"),
+                                  (b"/index.html", b"HEAD"))[i % 3]
+                s.sendall(method + b" " + target + b" HTTP/1.1\r\nHost: x\r\n\r\n")
+                if read_response(s, method == b"HEAD") is None:
+                    errors.append("keep-alive connection dropped")
+                    return
+        finally:
+            s.close()
+    except OSError as e:
+        errors.append(str(e))
+
+
+def slow_reader(port, errors):
+    """Leaves a cached response too big for the socket to take at once, so it
+    has to be queued with uv_write."""
+    try:
+        s = socket.socket()
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        s.settimeout(5)
+        s.connect(("127.0.0.1", port))
+        try:
+            s.sendall(b"GET /cached.bin HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+            time.sleep(0.2)
+            got = 0
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                got += len(chunk)
+            if got < 900 * 1024:
+                errors.append(f"short cached response: {got}")
+        finally:
+            s.close()
+    except OSError as e:
+        errors.append(str(e))
+
+
+def workload(port):
+    errors = []
+    threads = [threading.Thread(target=keep_alive_client, args=(port, errors)) for _ in range(8)]
+    threads += [threading.Thread(target=slow_reader, args=(port, errors)) for _ in range(2)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    for _ in range(20):
+        if one(port, b"/index.html") != b"HTTP/1.1 200 OK":
+            errors.append("churned connection not served")
+    for _ in range(3):
+        if one(port, b"/big.bin") != b"HTTP/1.1 200 OK":
+            errors.append("streamed file not served")
+    one(port, b"/big.bin", b"HEAD")
+    return errors
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return 2
+    binary = os.path.abspath(sys.argv[1])
+
+    tmp = tempfile.mkdtemp(prefix="http-server-alloc.")
+    root = os.path.join(tmp, "root")
+    os.makedirs(root)
+    with open(os.path.join(root, "index.html"), "w") as f:
+        f.write("INDEX\n")
+    # Under the cache limit, but far more than a socket takes in one write.
+    with open(os.path.join(root, "cached.bin"), "wb") as f:
+        f.write(b"C" * (960 * 1024))
+    # Over it, so streamed from disk.
+    with open(os.path.join(root, "big.bin"), "wb") as f:
+        f.write(b"B" * (2 * 1024 * 1024))
+
+    port = free_port()
+    admin_port = free_port()
+    log = open(os.path.join(tmp, "server.log"), "w+")
+    proc = subprocess.Popen([binary, "-a", "127.0.0.1", "-p", str(port), "-d", root,
+                             "-A", "/_admin", "-M", str(admin_port)],
+                            stdout=log, stderr=subprocess.STDOUT)
+    try:
+        deadline = time.time() + 15
+        while time.time() < deadline:
+            try:
+                socket.create_connection(("127.0.0.1", port), timeout=0.5).close()
+                break
+            except OSError:
+                time.sleep(0.1)
+        if allocations(admin_port) is None:
+            print("no allocation counter; build with -DALLOC_STATS")
+            return 1
+
+        print("warming up")
+        for _ in range(2):
+            check("warm-up workload", workload(port), [])
+
+        print("steady state")
+        # Reading the counter costs allocations of its own, the same every
+        # time, so that is measured and taken off.
+        a = allocations(admin_port)
+        b = allocations(admin_port)
+        errors = workload(port)
+        c = allocations(admin_port)
+        check("workload", errors, [])
+        check("heap allocations during the workload", (c - b) - (b - a), 0)
+        check("server survived", proc.poll(), None)
+    finally:
+        if proc.poll() is None:
+            proc.terminate()
+            try:
+                proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+        log.seek(0)
+        output = log.read()
+        log.close()
+
+    if output.strip():
+        print("--- server output ---")
+        print(output.strip())
+    if failures:
+        print(f"\n{len(failures)} check(s) failed: {', '.join(failures)}")
+        return 1
+    print("\nall checks passed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
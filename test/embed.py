@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""Embedding test for libhttpserver.
+
+Usage: test/embed.py ./http-server-embed
+
+Runs examples/embed.c, a program with handlers of its own on the server's
+loop, and checks that requests for its routes reach them, answered at once or
+later, and that everything else is still served from the files.
+"""
+import json
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+failures = []
+
+
+def check(name, got, want):
+    if got == want:
+        print(f"  ok    {name}")
+    else:
+        print(f"  FAIL  {name}: got {got!r}, want {want!r}")
+        failures.append(name)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def exchange(port, requests):
+    """Send requests on one connection, return [(head, body)] for each."""
+    s = socket.socket()
+    s.settimeout(5)
+    out = []
+    try:
+        s.connect(("127.0.0.1", port))
+        data = b""
+        for req, head_only in requests:
+            s.sendall(req)
+            while b"\r\n\r\n" not in data:
+                chunk = s.recv(65536)
+                if not chunk:
+                    return out
+                data += chunk
+            head, data = data.split(b"\r\n\r\n", 1)
+            length = 0
+            for line in head.split(b"\r\n"):
+                if line.lower().startswith(b"content-length:"):
+                    length = int(line.split(b":", 1)[1])
+            if head_only:
+                length = 0
+            while len(data) < length:
+                chunk = s.recv(65536)
+                if not chunk:
+                    return out
+                data += chunk
+            out.append((head.decode("latin-1"), data[:length]))
+            data = data[length:]
+    except OSError:
+        pass
+    finally:
+        s.close()
+    return out
+
+
+def get(port, target, extra=b"", method=b"GET"):
+    req = (method + b" " + target + b" HTTP/1.1\r\nHost: x\r\n" + extra
+           + b"Connection: close\r\n\r\n")
+    got = exchange(port, [(req, method == b"HEAD")])
+    return got[0] if got else ("<none>", b"")
+
+
+def read_to_end(s):
+    data = b""
+    try:
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                return data
+            data += chunk
+    except OSError:
+        return data + b"<timed out>"
+    finally:
+        s.close()
+
+
+def header(head, name):
+    for line in head.split("\r\n")[1:]:
+        k, _, v = line.partition(":")
+        if k.strip().lower() == name.lower():
+            return v.strip()
+    return None
+
+
+def wait_until_listening(proc, port, timeout=15.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        try:
+            s = socket.socket()
+            s.settimeout(0.5)
+            s.connect(("127.0.0.1", port))
+            s.close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__)
+        return 2
+    binary = os.path.abspath(sys.argv[1])
+
+    tmp = tempfile.mkdtemp(prefix="http-server-embed.")
+    root = os.path.join(tmp, "root")
+    os.makedirs(os.path.join(root, "api"))
+    with open(os.path.join(root, "index.html"), "wb") as f:
+        f.write(b"INDEX\n")
+    with open(os.path.join(root, "api", "file.txt"), "wb") as f:
+        f.write(b"API-FILE\n")
+
+    done = subprocess.run([binary, "-x"], capture_output=True, timeout=5)
+    check("bad option is refused", done.returncode, 1)
+    check("with the usage", b"usage:" in done.stderr, True)
+
+    port = free_port()
+    log = open(os.path.join(tmp, "server.log"), "w+")
+    # A small quota, so that a large made-up response is sent in turns.
+    proc = subprocess.Popen([binary, "-a", "127.0.0.1", "-p", str(port), "-d", root,
+                             "-W", "16384"], stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+    try:
+        if not wait_until_listening(proc, port):
+            log.seek(0)
+            print("server did not start:\n" + log.read())
+            return 1
+
+        print("routes")
+        head, body = get(port, b"/healthz")
+        check("handler answers", (head.split("\r\n")[0], body), ("HTTP/1.1 200 OK", b"ok\n"))
+        check("with its headers", header(head, "Cache-Control"), "no-store")
+        check("and a length", header(head, "Content-Length"), "3")
+        head, body = get(port, b"/healthz", method=b"HEAD")
+        check("HEAD gets the header alone", (header(head, "Content-Length"), body), ("3", b""))
+        head, body = get(port, b"/config")
+        check("rendered per request", json.loads(body)["version"] if body else None, "1.0")
+        check("typed", header(head, "Content-Type"), "application/json")
+        check("file from a handler", get(port, b"/latest")[1], b"INDEX\n")
+        check("query string", get(port, b"/api/echo?a=1&b=2")[1], b"a=1&b=2")
+        big = b"q" * 40000
+        check("large response in turns", get(port, b"/api/echo?" + big)[1], big)
+        check("declined falls through to a file", get(port, b"/api/file.txt")[1], b"API-FILE\n")
+        check("and to a 404", get(port, b"/api/nope")[0].startswith("HTTP/1.0 404"), True)
+        check("exact route only", get(port, b"/healthz/x")[0].startswith("HTTP/1.0 404"), True)
+        check("other methods are not handled",
+              get(port, b"/healthz", method=b"POST")[0].startswith("HTTP/1.0 501"), True)
+        check("files still served", get(port, b"/index.html")[1], b"INDEX\n")
+
+        print("answered later")
+        got = exchange(port, [
+            (b"GET /slow HTTP/1.1\r\nHost: x\r\n\r\n", False),
+            (b"GET /healthz HTTP/1.1\r\nHost: x\r\n\r\n", False),
+            (b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n", False),
+        ])
+        check("keep-alive carries on after it", [b for _, b in got], [b"done\n", b"ok\n", b"INDEX\n"])
+        s = socket.create_connection(("127.0.0.1", port))
+        s.sendall(b"GET /slow HTTP/1.1\r\nHost: x\r\n\r\n")
+        s.close()
+        time.sleep(0.2)
+        check("client gone before the answer", get(port, b"/healthz")[1], b"ok\n")
+
+        check("server survived", proc.poll(), None)
+
+        print("stop")
+        # The program stops the server on SIGINT and closes the loop after
+        # uv_run returns, which fails if the server left a handle open.
+        idle = socket.create_connection(("127.0.0.1", port), timeout=5)
+        idle.sendall(b"GET /healthz HTTP/1.1\r\nHost: x\r\n\r\n")
+        idle.recv(65536)
+        slow = socket.create_connection(("127.0.0.1", port), timeout=5)
+        slow.sendall(b"GET /slow HTTP/1.1\r\nHost: x\r\n\r\n")
+        time.sleep(0.02)
+        proc.send_signal(signal.SIGINT)
+        check("idle keep-alive connection closed", read_to_end(idle), b"")
+        check("response in flight finished, then closed",
+              read_to_end(slow).endswith(b"\r\n\r\ndone\n"), True)
+        try:
+            check("loop runs out and closes", proc.wait(timeout=5), 0)
+        except subprocess.TimeoutExpired:
+            check("loop runs out and closes", "still running", 0)
+    finally:
+        if proc.poll() is None:
+            proc.terminate()
+            try:
+                proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+        log.seek(0)
+        output = log.read()
+        log.close()
+
+    for marker in ("AddressSanitizer", "runtime error:", "LeakSanitizer"):
+        if marker in output:
+            print(f"  FAIL  sanitizer reported {marker}")
+            failures.append("sanitizer")
+            break
+
+    if failures:
+        print("--- server output ---")
+        print(output.strip())
+        print(f"\n{len(failures)} check(s) failed: {', '.join(failures)}")
+        return 1
+    print("\nall checks passed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
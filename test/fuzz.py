@@ -8,6 +8,11 @@ error aborts the process and is reported. Checks that the server survives, that
 nothing outside the document root is ever served, that descriptors do not grow
 without bound, and that no sanitizer diagnostic appears.
 
+Targets simple enough for build_file_path's fast path are also sent rewritten
+so that they need the general one, and the two answers have to match. A build
+with -DCHECK_PATH_FAST_PATH also cross-checks every fast resolution inside
+the server and aborts on a difference.
+
 The generator is seeded, so a failure is reproducible.
 """
 import os
@@ -111,6 +116,69 @@ def phase_targets(port, iterations, rng):
             print(f"  {i}")
 
 
+# Files for the path phase, named so that every kind of segment the fast path
+# has to pass through verbatim turns up: dots inside names, a dot at the end,
+# and a '?', which unescaped starts the query string instead.
+PATH_FILES = [
+    "plain.txt", "sub/f.txt", "sub/deep/g.txt", "a.b/c.d.txt", "dot./x", "q?x",
+    "sub/deep/index.html",
+]
+
+
+def rewrite_target(target, rng):
+    """The same target spelled so that the fast path cannot take it.  Only the
+    path is respelled; a query string is kept as it is."""
+    target, sep, query = target.partition(b"?")
+    pieces = target.split(b"/")
+    i = rng.randrange(1, len(pieces))
+    kind = rng.randrange(4)
+    if kind == 0:
+        pieces.insert(i, b".")
+    elif kind == 1:
+        pieces.insert(i, b"")
+    elif kind == 2:
+        pieces.insert(i, b"zz")
+        pieces.insert(i + 1, b"..")
+    else:
+        name = pieces[i]
+        if not name:
+            pieces.insert(i, b".")
+        else:
+            j = rng.randrange(len(name))
+            pieces[i] = name[:j] + b"%%%02X" % name[j] + name[j + 1:]
+    return b"/".join(pieces) + sep + query
+
+
+def phase_paths(port, iterations, rng):
+    print(f"paths: {iterations} targets resolved both ways")
+    for _ in range(iterations):
+        roll = rng.random()
+        if roll < 0.7:
+            name = rng.choice(PATH_FILES)
+            if rng.random() < 0.3 and "/" in name:
+                name = name.rsplit("/", 1)[0] + "/"
+            target = b"/" + name.encode()
+        elif roll < 0.9:
+            target = b"/" + b"/".join(rng.choice([b"sub", b"deep", b"nope", b"x.y", b"a-b_c"])
+                                      for _ in range(rng.randint(1, 6)))
+        else:
+            # Either side of the longest target that still fits file_path.
+            target = b"/" + b"a" * rng.randint(4020, 4100)
+        if rng.random() < 0.2:
+            target += b"/"
+        if rng.random() < 0.2:
+            target += rng.choice([b"?v=1", b"?", b"?a/../..", b"?%2e%2e"])
+        slow = rewrite_target(target, rng)
+        got = []
+        for t in (target, slow):
+            got.append(one_shot(port, b"GET " + t + b" HTTP/1.1\r\nHost: x\r\n"
+                                      b"Connection: close\r\n\r\n"))
+        if got[0] != got[1]:
+            failures.append(f"{target[:120]!r} and {slow[:120]!r} were answered differently: "
+                            f"{got[0][:60]!r} vs {got[1][:60]!r}")
+            return
+
+
 def phase_connections(port, rounds, rng):
     print(f"connections: {rounds} rounds x 8 concurrent hostile clients")
     seeds = [rng.randrange(1 << 30) for _ in range(8)]
@@ -162,6 +230,11 @@ def main():
         f.write(b"X" * (2 * 1024 * 1024))
     with open(os.path.join(tmp, "secret.txt"), "wb") as f:
         f.write(CANARY + b"\n")
+    for name in PATH_FILES:
+        path = os.path.join(root, *name.split("/"))
+        os.makedirs(os.path.dirname(path), exist_ok=True)
+        with open(path, "w") as f:
+            f.write(name + "\n")
 
     s = socket.socket()
     s.bind(("127.0.0.1", 0))
@@ -198,6 +271,10 @@ def main():
         if proc.poll() is not None:
             failures.append(f"server died during the target phase (exit {proc.returncode})")
         else:
+            phase_paths(port, iterations // 4, rng)
+            if proc.poll() is not None:
+                failures.append(f"server died during the path phase (exit {proc.returncode})")
+        if proc.poll() is None:
             phase_connections(port, 40, rng)
             if proc.poll() is not None:
                 failures.append(f"server died during the connection phase (exit {proc.returncode})")
@@ -222,7 +299,7 @@ def main():
         log.close()
 
     for marker in ("AddressSanitizer", "UndefinedBehaviorSanitizer", "runtime error:",
-                   "LeakSanitizer", "SEGV"):
+                   "LeakSanitizer", "SEGV", "Path fast path mismatch"):
         if marker in output:
             failures.append(f"sanitizer reported {marker}")
             break
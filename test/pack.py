@@ -0,0 +1,254 @@
+#!/usr/bin/env python3
+"""Site pack test for http-server.
+
+Usage: test/pack.py ./http-server ./http-server-pack
+
+Packs a temporary document root with the pack tool, serves it with -P and
+checks the responses match what the files say, including the gzip variants
+when the tool was built with zlib. Also checks that a damaged pack is refused
+rather than served from.
+"""
+import gzip
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+failures = []
+
+
+def check(name, got, want):
+    if got == want:
+        print(f"  ok    {name}")
+    else:
+        print(f"  FAIL  {name}: got {got!r}, want {want!r}")
+        failures.append(name)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def exchange(port, requests):
+    """Send requests on one connection, return [(head, body)] for each."""
+    s = socket.socket()
+    s.settimeout(5)
+    out = []
+    try:
+        s.connect(("127.0.0.1", port))
+        data = b""
+        for req, head_only in requests:
+            s.sendall(req)
+            while b"\r\n\r\n" not in data:
+                chunk = s.recv(65536)
+                if not chunk:
+                    return out
+                data += chunk
+            head, data = data.split(b"\r\n\r\n", 1)
+            length = 0
+            for line in head.split(b"\r\n"):
+                if line.lower().startswith(b"content-length:"):
+                    length = int(line.split(b":", 1)[1])
+            if head_only:
+                length = 0
+            while len(data) < length:
+                chunk = s.recv(65536)
+                if not chunk:
+                    return out
+                data += chunk
+            out.append((head.decode("latin-1"), data[:length]))
+            data = data[length:]
+    except OSError:
+        pass
+    finally:
+        s.close()
+    return out
+
+
+def get(port, target, extra=b"", method=b"GET"):
+    req = (method + b" " + target + b" HTTP/1.1\r\nHost: x\r\n" + extra
+           + b"Connection: close\r\n\r\n")
+    got = exchange(port, [(req, method == b"HEAD")])
+    return got[0] if got else ("<none>", b"")
+
+
+def header(head, name):
+    for line in head.split("\r\n")[1:]:
+        k, _, v = line.partition(":")
+        if k.strip().lower() == name.lower():
+            return v.strip()
+    return None
+
+
+def wait_until_listening(proc, port, timeout=15.0):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        if proc.poll() is not None:
+            return False
+        try:
+            s = socket.socket()
+            s.settimeout(0.5)
+            s.connect(("127.0.0.1", port))
+            s.close()
+            return True
+        except OSError:
+            time.sleep(0.1)
+    return False
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        return 2
+    binary = os.path.abspath(sys.argv[1])
+    packer = os.path.abspath(sys.argv[2])
+
+    tmp = tempfile.mkdtemp(prefix="http-server-pack.")
+    root = os.path.join(tmp, "root")
+    os.makedirs(os.path.join(root, "sub", "deeper"))
+    files = {
+        "/index.html": b"ROOT-INDEX\n",
+        "/sub/index.html": b"SUB-INDEX\n",
+        "/sub/deeper/a.txt": b"DEEP\n",
+        "/app.js": b"function f() { return 1; }\n" * 400,
+        "/empty.txt": b"",
+        "/a b.txt": b"SPACE\n",
+        "/noext": b"NOEXT\n",
+        "/lib.3f2a9c1b.js": b"LIB\n",
+    }
+    for url, data in files.items():
+        with open(os.path.join(root, url.lstrip("/")), "wb") as f:
+            f.write(data)
+    with open(os.path.join(tmp, "secret.txt"), "w") as f:
+        f.write("SECRET-CANARY\n")
+
+    pack = os.path.join(tmp, "site.pack")
+    # -z is only there when the tool was built with zlib.
+    rules = ["-c", "/sub/=no-cache"]
+    built = subprocess.run([packer, "-z"] + rules + [root, pack], capture_output=True)
+    with_gzip = built.returncode == 0
+    if not with_gzip:
+        built = subprocess.run([packer] + rules + [root, pack], capture_output=True)
+    if built.returncode != 0:
+        print("packing failed:\n" + built.stderr.decode("latin-1"))
+        return 1
+    print(f"packed ({'with' if with_gzip else 'without'} gzip variants)")
+
+    print("refusing a damaged pack")
+    with open(pack, "rb") as f:
+        whole = f.read()
+    for name, damaged in (("truncated", whole[:-100]),
+                          ("bad magic", b"X" + whole[1:]),
+                          ("empty", b"")):
+        bad = os.path.join(tmp, "bad.pack")
+        with open(bad, "wb") as f:
+            f.write(damaged)
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()), "-P", bad],
+                                  capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"{name} pack is refused", refused, True)
+    # The rules are rendered into the pack; the server cannot apply them.
+    done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()), "-P", pack,
+                           "-c", ".txt=no-store"], capture_output=True, timeout=5)
+    check("-c with -P is refused", done.returncode != 0, True)
+
+    port = free_port()
+    log = open(os.path.join(tmp, "server.log"), "w+")
+    proc = subprocess.Popen([binary, "-a", "127.0.0.1", "-p", str(port), "-P", pack],
+                            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+    try:
+        if not wait_until_listening(proc, port):
+            log.seek(0)
+            print("server did not start:\n" + log.read())
+            return 1
+
+        print("serving from the pack")
+        for url, data in files.items():
+            target = url.replace(" ", "%20").encode()
+            head, body = get(port, target)
+            check(f"GET {url}", body, data)
+            check(f"GET {url} length", header(head, "Content-Length"), str(len(data)))
+        check("GET / is the index", get(port, b"/")[1], files["/index.html"])
+        check("GET /sub/ is its index", get(port, b"/sub/")[1], files["/sub/index.html"])
+        check("dot segments resolve", get(port, b"/sub/../sub/./deeper/a.txt")[1], b"DEEP\n")
+        check("type by extension", header(get(port, b"/app.js")[0], "Content-Type"),
+              "text/javascript")
+        check("unknown type", header(get(port, b"/noext")[0], "Content-Type"),
+              "application/octet-stream")
+        check("missing file is 404", get(port, b"/nope")[0].startswith("HTTP/1.0 404"), True)
+        check("query string is ignored", get(port, b"/sub/deeper/a.txt?v=2")[1], b"DEEP\n")
+        check("fingerprinted name is immutable", header(get(port, b"/lib.3f2a9c1b.js")[0], "Cache-Control"),
+              "public, max-age=31536000, immutable")
+        check("rule by prefix", header(get(port, b"/sub/deeper/a.txt")[0], "Cache-Control"), "no-cache")
+        check("no rule, no Cache-Control", header(get(port, b"/index.html")[0], "Cache-Control"), None)
+        check("escaping the root finds nothing",
+              b"SECRET" in get(port, b"/../secret.txt")[1], False)
+
+        head, body = get(port, b"/index.html", method=b"HEAD")
+        check("HEAD has a length", header(head, "Content-Length"), "11")
+        got = exchange(port, [
+            (b"HEAD /app.js HTTP/1.1\r\nHost: x\r\n\r\n", True),
+            (b"GET /sub/deeper/a.txt HTTP/1.1\r\nHost: x\r\n\r\n", False),
+            (b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n", False),
+        ])
+        check("keep-alive serves each in turn", [b for _, b in got],
+              [b"", b"DEEP\n", b"ROOT-INDEX\n"])
+        check("keep-alive is announced", [header(h, "Connection") for h, _ in got],
+              ["keep-alive"] * 3)
+
+        if with_gzip:
+            print("gzip variants")
+            head, body = get(port, b"/app.js", b"Accept-Encoding: br, gzip\r\n")
+            check("gzip when accepted", header(head, "Content-Encoding"), "gzip")
+            check("gzip body decodes", gzip.decompress(body) if body else b"", files["/app.js"])
+            check("gzip varies", header(head, "Vary"), "Accept-Encoding")
+            head, body = get(port, b"/sub/index.html", b"Accept-Encoding: gzip\r\n")
+            check("rule applies whichever variant", header(head, "Cache-Control"), "no-cache")
+            head, body = get(port, b"/app.js")
+            check("identity when not accepted", (header(head, "Content-Encoding"), body),
+                  (None, files["/app.js"]))
+            check("identity varies too", header(head, "Vary"), "Accept-Encoding")
+            head, body = get(port, b"/app.js", b"Accept-Encoding: gzip;q=0\r\n")
+            check("identity when gzip is refused", header(head, "Content-Encoding"), None)
+            head, body = get(port, b"/sub/deeper/a.txt", b"Accept-Encoding: gzip\r\n")
+            check("no gzip where it does not help", (header(head, "Content-Encoding"), body),
+                  (None, b"DEEP\n"))
+
+        check("server survived", proc.poll(), None)
+    finally:
+        if proc.poll() is None:
+            proc.terminate()
+            try:
+                proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                proc.kill()
+        log.seek(0)
+        output = log.read()
+        log.close()
+
+    for marker in ("AddressSanitizer", "runtime error:", "LeakSanitizer"):
+        if marker in output:
+            print(f"  FAIL  sanitizer reported {marker}")
+            failures.append("sanitizer")
+            break
+
+    if failures:
+        print("--- server output ---")
+        print(output.strip())
+        print(f"\n{len(failures)} check(s) failed: {', '.join(failures)}")
+        return 1
+    print("\nall checks passed")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
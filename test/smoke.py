@@ -7,11 +7,14 @@ Starts the given binary on a free port with a temporary document root and
 checks that it serves files, rejects targets it should reject, and is still
 alive at the end.
 """
+import json
 import os
+import signal
 import socket
 import subprocess
 import sys
 import tempfile
+import threading
 import time
 
 CANARY = "SECRET-CANARY-DO-NOT-SERVE"
@@ -118,6 +121,28 @@ def main():
         f.write(b"X" * (2 * 1024 * 1024))
     with open(os.path.join(root, "unknown.bin"), "w") as f:
         f.write("BIN\n")
+    # A '?' that is part of the name, and names with a content hash in them,
+    # cached and streamed.
+    with open(os.path.join(root, "q?x.txt"), "w") as f:
+        f.write("QUESTION\n")
+    with open(os.path.join(root, "app.3f2a9c1b.js"), "w") as f:
+        f.write("HASHED\n")
+    with open(os.path.join(root, "video-0a1b2c3d4e.bin"), "wb") as f:
+        f.write(b"V" * (2 * 1024 * 1024))
+    # Hex and digits, but as the name itself rather than a hash after it.
+    for name in ("feed2023.xml", "cafe1234.html"):
+        with open(os.path.join(root, name), "w") as f:
+            f.write("NOT-HASHED\n")
+    # Identical contents under several names, which share one cached body.
+    for name in ("same1.js", "same2.js", "same3.css"):
+        with open(os.path.join(root, name), "w") as f:
+            f.write("SAME-CONTENT\n")
+    # A directory without an index file, listed because the server runs with -l.
+    os.makedirs(os.path.join(root, "list", "inner"))
+    with open(os.path.join(root, "list", "one.txt"), "w") as f:
+        f.write("ONE\n")
+    with open(os.path.join(root, "list", "<b>&\".txt"), "w") as f:
+        f.write("MARKUP\n")
     # Outside the document root: must never be served.
     with open(os.path.join(tmp, "secret.txt"), "w") as f:
         f.write(CANARY + "\n")
@@ -134,11 +159,70 @@ def main():
         except subprocess.TimeoutExpired:
             refused = False
         check(f"-p {bad!r} is refused", refused, True)
+    for bad in ("backlog", "backlog=-1", "cork=2", "rcvbuf=1k", "nagle=0", "=1"):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-S", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-S {bad!r} is refused", refused, True)
+    for bad in ("100", "-1", "0,1000", "65536,0", "65536,", "x"):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-W", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-W {bad!r} is refused", refused, True)
+    for bad in ("0", "-1", "x", "5x", ""):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-C", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-C {bad!r} is refused", refused, True)
+    for bad in ("0", "-1", "1m", ""):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-D", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-D {bad!r} is refused", refused, True)
+    for bad in ("0", "-1", "x", "1000001"):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-T", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-T {bad!r} is refused", refused, True)
+    for bad in ("x=1", "/a", "/a=", "=no-cache", ".txt=a\x01b"):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root, "-c", bad], capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"-c {bad!r} is refused", refused, True)
+    for bad in (["-A", "/_admin"], ["-M", str(free_port())], ["-A", "/_admin", "-M", "0"],
+                ["-A", "/_admin", "-M", "65536"], ["-A", "/_admin", "-M", ""]):
+        try:
+            done = subprocess.run([binary, "-a", "127.0.0.1", "-p", str(free_port()),
+                                   "-d", root] + bad, capture_output=True, timeout=5)
+            refused = done.returncode != 0
+        except subprocess.TimeoutExpired:
+            refused = False
+        check(f"{' '.join(bad)!r} is refused", refused, True)
 
     port = free_port()
+    admin_port = free_port()
     log = open(os.path.join(tmp, "server.log"), "w+")
     proc = subprocess.Popen(
-        [binary, "-a", "127.0.0.1", "-p", str(port), "-d", root],
+        [binary, "-a", "127.0.0.1", "-p", str(port), "-d", root, "-l", "-e", "-A", "/_admin",
+         "-M", str(admin_port), "-W", "65536"],
         stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
 
     try:
@@ -211,6 +295,12 @@ def main():
         check("byte at a time",
               in_pieces([bytes([c]) for c in b"GET / HTTP/1.1\r\nHost: x\r\n\r\n"]),
               "HTTP/1.1 200 OK")
+        # Parsed in place from the read buffer, with the bytes after the head
+        # and those arriving while it is served landing elsewhere.
+        check("head with trailing bytes in one read",
+              in_pieces([b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n" + b"z" * 9000,
+                         b"z" * 20000]),
+              "HTTP/1.1 200 OK")
         # A client must not be able to make the server buffer without bound.
         check("oversized head is refused",
               in_pieces([b"GET / HTTP/1.1\r\nHost: x\r\n",
@@ -355,6 +445,58 @@ def main():
         check("unknown extension again",
               content_type(port, b"/unknown.bin"), "application/octet-stream")
 
+        print("query strings and Cache-Control")
+
+        def cache_control(cc_port, target, method=b"GET"):
+            head = request(cc_port, target, method).split(b"\r\n\r\n", 1)[0]
+            for line in head.split(b"\r\n"):
+                if line.lower().startswith(b"cache-control:"):
+                    return line.split(b":", 1)[1].strip().decode("latin-1")
+            return None
+
+        check("query string is ignored", body(port, b"/index.html?v=123"), b"ROOT-INDEX\n")
+        check("empty query string", body(port, b"/index.html?"), b"ROOT-INDEX\n")
+        check("query string on a directory", body(port, b"/sub/?x=1"), b"SUB-INDEX\n")
+        check("no escaping the root through the query",
+              CANARY.encode() in request(port, b"/index.html?/../../secret.txt"), False)
+        check("escaped '?' is part of the name", body(port, b"/q%3Fx.txt"), b"QUESTION\n")
+        check("unescaped '?' starts the query", status(port, b"/q?x.txt").startswith("HTTP/1.0 404"),
+              True)
+        immutable = "public, max-age=31536000, immutable"
+        check("fingerprinted name is immutable", cache_control(port, b"/app.3f2a9c1b.js"), immutable)
+        check("no rules, no Cache-Control", cache_control(port, b"/index.html"), None)
+        check("a name is not a hash", [cache_control(port, b"/feed2023.xml"),
+                                        cache_control(port, b"/cafe1234.html")], [None, None])
+
+        ruled_port = free_port()
+        ruled_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(ruled_port), "-d", root,
+             "-c", "/sub/=no-cache", "-c", ".txt=public, max-age=60", "-c", "/app.=no-store",
+             "-c", ".html=max-age=5", "-c", "/big=max-age=5"],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(ruled_proc, ruled_port):
+                check("rule by prefix", cache_control(ruled_port, b"/sub/f.txt"), "no-cache")
+                check("rule by extension", cache_control(ruled_port, b"/a%20b.txt"),
+                      "public, max-age=60")
+                check("another rule by extension", cache_control(ruled_port, b"/index.html"), "max-age=5")
+                check("rule ahead of the fingerprint",
+                      cache_control(ruled_port, b"/app.3f2a9c1b.js"), "no-store")
+                # On its own server, as it leaves a descriptor open.
+                check("streamed fingerprinted file no rule matches",
+                      cache_control(ruled_port, b"/video-0a1b2c3d4e.bin", b"HEAD"), immutable)
+                check("body unchanged", body(ruled_port, b"/sub/f.txt"), b"SUBFILE\n")
+                check("streamed file by rule", cache_control(ruled_port, b"/big.bin", b"HEAD"),
+                      "max-age=5")
+            else:
+                check("server with cache rules started", False, True)
+        finally:
+            ruled_proc.terminate()
+            try:
+                ruled_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                ruled_proc.kill()
+
         print("rejecting anything that is not a regular file")
         # Opening a directory succeeds on Linux; reading it fails only after a
         # 200 and a Content-Length have already been written.
@@ -365,6 +507,155 @@ def main():
         check("directory without a slash is 404",
               status(port, b"/sub").startswith("HTTP/1.0 404"), True)
 
+        print("identical files")
+        check("first copy", body(port, b"/same1.js"), b"SAME-CONTENT\n")
+        check("second copy", body(port, b"/same2.js"), b"SAME-CONTENT\n")
+        check("copy keeps its own type", content_type(port, b"/same3.css"), "text/css")
+        check("copy keeps the other's type", content_type(port, b"/same1.js"),
+              "text/javascript")
+        # Changing one copy must not show through the others that share its body.
+        with open(os.path.join(root, "same2.js"), "w") as f:
+            f.write("CHANGED-CONTENT\n")
+        time.sleep(1.2)
+        check("changed copy is reloaded", body(port, b"/same2.js"), b"CHANGED-CONTENT\n")
+        check("unchanged copy is untouched", body(port, b"/same1.js"), b"SAME-CONTENT\n")
+        os.remove(os.path.join(root, "same1.js"))
+        time.sleep(1.2)
+        check("removed copy is gone", status(port, b"/same1.js").startswith("HTTP/1.0 404"), True)
+        check("remaining copy still served", body(port, b"/same3.css"), b"SAME-CONTENT\n")
+        if sys.platform.startswith("linux"):
+            def resident_kb():
+                with open(f"/proc/{proc.pid}/status") as f:
+                    for line in f:
+                        if line.startswith("VmRSS:"):
+                            return int(line.split()[1])
+                return 0
+
+            # 20 MB if each copy were kept, one body if they share it.
+            copies = os.path.join(root, "copies")
+            os.makedirs(copies)
+            for i in range(200):
+                with open(os.path.join(copies, f"{i}.bin"), "wb") as f:
+                    f.write(b"C" * (100 * 1024))
+            before = resident_kb()
+            served = [body(port, b"/copies/%d.bin" % i) for i in range(200)]
+            check("copies served", all(b == b"C" * (100 * 1024) for b in served), True)
+            # Compaction runs a second after a chunk goes sparse.
+            time.sleep(1.5)
+            grown = resident_kb() - before
+            check("copies take the memory of one", grown < 8 * 1024, True)
+
+        print("cache storage churn")
+        # Enough mid-sized files to spread over several storage chunks, most of
+        # which are then replaced, so the chunks they were in go mostly dead and
+        # the survivors get moved out of them.
+        churn = os.path.join(root, "churn")
+        os.makedirs(churn)
+        for i in range(48):
+            with open(os.path.join(churn, f"{i}.txt"), "wb") as f:
+                f.write(b"%d-" % i + b"a" * 60000)
+        for i in range(48):
+            body(port, b"/churn/%d.txt" % i)
+        for i in range(48):
+            if i % 8:
+                with open(os.path.join(churn, f"{i}.txt"), "wb") as f:
+                    f.write(b"%d-" % i + b"b" * 30000)
+        time.sleep(1.2)
+        for i in range(48):
+            body(port, b"/churn/%d.txt" % i)
+        # Compaction runs a second after a chunk goes sparse.
+        time.sleep(1.5)
+        got = [body(port, b"/churn/%d.txt" % i) for i in range(48)]
+        want = [b"%d-" % i + (b"b" * 30000 if i % 8 else b"a" * 60000) for i in range(48)]
+        check("bodies intact after churn", [g == w for g, w in zip(got, want)], [True] * 48)
+
+        # Keep-alive responses go out as header and body in one buffer.
+        def keep_alive_bodies(targets):
+            s = socket.socket()
+            s.settimeout(5)
+            out = []
+            try:
+                s.connect(("127.0.0.1", port))
+                data = b""
+                for target in targets:
+                    s.sendall(b"GET " + target + b" HTTP/1.1\r\nHost: x\r\n\r\n")
+                    while b"\r\n\r\n" not in data:
+                        data += s.recv(65536)
+                    head, data = data.split(b"\r\n\r\n", 1)
+                    length = 0
+                    for line in head.split(b"\r\n"):
+                        if line.lower().startswith(b"content-length:"):
+                            length = int(line.split(b":", 1)[1])
+                    while len(data) < length:
+                        data += s.recv(65536)
+                    out.append(data[:length])
+                    data = data[length:]
+            except OSError:
+                pass
+            finally:
+                s.close()
+            return out
+
+        check("keep-alive bodies intact after churn",
+              keep_alive_bodies([b"/churn/%d.txt" % i for i in range(48)]) == want, True)
+
+        print("directory listings")
+        # Backdate the directory, so adding an entry below is sure to move its
+        # mtime even within the same second.
+        listed = os.path.join(root, "list")
+        os.utime(listed, (time.time() - 100, time.time() - 100))
+        check("index file wins over a listing", body(port, b"/sub/"), b"SUB-INDEX\n")
+        html = body(port, b"/list/")
+        check("listing names a file", b'href="one.txt"' in html, True)
+        check("listing marks a directory", b'href="inner/"' in html, True)
+        check("listing escapes markup", b"&lt;b&gt;&amp;&quot;.txt" in html, True)
+        check("listing escapes the link", b'href="%3Cb%3E%26%22.txt"' in html, True)
+        check("listing is text/html", content_type(port, b"/list/"),
+              "text/html; charset=utf-8")
+        check("listing varies by Accept",
+              b"\r\nVary: Accept\r\n" in request(port, b"/list/").split(b"\r\n\r\n", 1)[0] + b"\r\n",
+              True)
+
+        def listing_json(target):
+            s = socket.socket()
+            s.settimeout(5)
+            try:
+                s.connect(("127.0.0.1", port))
+                s.sendall(b"GET " + target + b" HTTP/1.1\r\nHost: x\r\n"
+                          b"Accept: text/plain;q=0.5, application/json\r\n"
+                          b"Connection: close\r\n\r\n")
+                data = b""
+                while True:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            finally:
+                s.close()
+            head, _, rest = data.partition(b"\r\n\r\n")
+            if b"application/json" not in head:
+                return None
+            return {e["name"]: e for e in json.loads(rest)}
+
+        entries = listing_json(b"/list/")
+        check("JSON listing on request", sorted(entries or {}),
+              ["<b>&\".txt", "inner", "one.txt"])
+        check("JSON listing has sizes", (entries or {}).get("one.txt", {}).get("size"), 4)
+        check("JSON listing has types", (entries or {}).get("inner", {}).get("type"),
+              "directory")
+        check("HTML still served after JSON", b'href="one.txt"' in body(port, b"/list/"), True)
+        with open(os.path.join(listed, "two.txt"), "w") as f:
+            f.write("TWO\n")
+        # Listings are revalidated like files, at most once a second.
+        time.sleep(1.2)
+        check("listing picks up a new file", b'href="two.txt"' in body(port, b"/list/"), True)
+        check("JSON listing picks up a new file", "two.txt" in (listing_json(b"/list/") or {}),
+              True)
+        check("listed directory without a slash is 404",
+              status(port, b"/list").startswith("HTTP/1.0 404"), True)
+        check("missing directory is 404",
+              status(port, b"/nolist/").startswith("HTTP/1.0 404"), True)
+
         print("rejecting bad targets")
         # An over-long target must be refused, not copied into a fixed buffer.
         check("over-long target is 414",
@@ -412,6 +703,113 @@ def main():
         s.close()
         check("two requests on one connection", got, [True, True])
 
+        print("header fields")
+
+        def response_head(head):
+            s = socket.socket()
+            s.settimeout(3)
+            try:
+                s.connect(("127.0.0.1", port))
+                s.sendall(head)
+                data = b""
+                while b"\r\n\r\n" not in data:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+                return data.split(b"\r\n\r\n", 1)[0]
+            finally:
+                s.close()
+
+        def persistence(version, fields):
+            head = response_head(b"GET /index.html HTTP/1." + version + b"\r\nHost: x\r\n" +
+                                 fields + b"\r\n")
+            return b"\r\nConnection: keep-alive" in head
+
+        check("field names ignore case", persistence(b"1", b"CONNECTION: Close\r\n"), False)
+        check("token among others", persistence(b"0", b"Connection: foo, Keep-Alive\r\n"), True)
+        check("token in a repeated field",
+              persistence(b"1", b"Connection: foo\r\nConnection: close\r\n"), False)
+        check("token past sixteen bytes",
+              persistence(b"1", b"Connection: upgrade-insecure-requests, te, close\r\n"), False)
+        check("name of the same length is another field",
+              persistence(b"1", b"Connectiom: close\r\n"), True)
+        head = response_head(b"GET /list/ HTTP/1.1\r\nHost: x\r\nConnection: close\r\n"
+                             b"Accept: text/html\r\nAccept: application/json\r\n\r\n")
+        check("media type in a repeated field", b"application/json" in head, True)
+
+        print("error responses")
+
+        def exchange_on_one_connection(heads, to_port=None):
+            """Send each head in turn on one connection, reading its whole
+            response (by Content-Length) before the next."""
+            s = socket.socket()
+            s.settimeout(3)
+            out = []
+            try:
+                s.connect(("127.0.0.1", to_port or port))
+                data = b""
+                for head in heads:
+                    try:
+                        s.sendall(head)
+                    except OSError:
+                        out.append(None)
+                        continue
+                    try:
+                        while b"\r\n\r\n" not in data:
+                            chunk = s.recv(65536)
+                            if not chunk:
+                                break
+                            data += chunk
+                    except OSError:
+                        pass
+                    if b"\r\n\r\n" not in data:
+                        out.append(None)
+                        continue
+                    hdr, data = data.split(b"\r\n\r\n", 1)
+                    length = 0
+                    for line in hdr.split(b"\r\n"):
+                        if line.lower().startswith(b"content-length:"):
+                            length = int(line.split(b":", 1)[1])
+                    if head.startswith(b"HEAD"):
+                        length = 0
+                    while len(data) < length:
+                        chunk = s.recv(65536)
+                        if not chunk:
+                            break
+                        data += chunk
+                    out.append((hdr.split(b"\r\n", 1)[0], data[:length]))
+                    data = data[length:]
+                return out
+            finally:
+                s.close()
+
+        got = exchange_on_one_connection([
+            b"GET /nope HTTP/1.1\r\nHost: x\r\n\r\n",
+            b"GET /a%zz HTTP/1.1\r\nHost: x\r\n\r\n",
+            b"HEAD /nope HTTP/1.1\r\nHost: x\r\n\r\n",
+            b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n"])
+        check("404 keeps the connection", got[0], (b"HTTP/1.0 404 Not Found", b"Not Found"))
+        check("400 for a bad target keeps it", got[1], (b"HTTP/1.0 400 Bad Request", b"Bad Request"))
+        check("HEAD 404 has no body", got[2], (b"HTTP/1.0 404 Not Found", b""))
+        check("and it still serves", got[3], (b"HTTP/1.1 200 OK", b"ROOT-INDEX\n"))
+        got = exchange_on_one_connection([
+            b"FROB / HTTP/1.1\r\nHost: x\r\n\r\n",
+            b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n"])
+        check("501 closes the connection", got, [(b"HTTP/1.0 501 Not Implemented", b"Not Implemented"), None])
+
+        with open(os.path.join(root, "404.html"), "w") as f:
+            f.write("<p>CUSTOM-404</p>\n")
+        time.sleep(1.2)
+        got = exchange_on_one_connection([
+            b"GET /nope HTTP/1.1\r\nHost: x\r\n\r\n",
+            b"GET /nope HTTP/1.1\r\nHost: x\r\n\r\n"])
+        check("custom error page", got, [(b"HTTP/1.0 404 Not Found", b"<p>CUSTOM-404</p>\n")] * 2)
+        check("custom error page type", content_type(port, b"/nope"), "text/html")
+        os.remove(os.path.join(root, "404.html"))
+        time.sleep(1.2)
+        check("canned text once it is gone", body(port, b"/nope"), b"Not Found")
+
         print("surviving overlapping requests on one connection")
         # A second request, or garbage, arriving while a response is streaming
         # used to give the connection a second owner and get it closed twice.
@@ -462,6 +860,673 @@ def main():
         else:
             print("  skip  descriptor check (no /proc)")
 
+        print("metrics")
+        metrics = request(admin_port, b"/_admin/metrics")
+        check("metrics are served", metrics.startswith(b"HTTP/1.1 200"), True)
+        check("metrics report loop lag", b"\nhttp_server_loop_lag_seconds " in metrics, True)
+        check("metrics report shed requests", b"\nhttp_server_requests_shed_total 0\n" in metrics, True)
+        check("a query string is ignored",
+              request(admin_port, b"/_admin/metrics?x=1").startswith(b"HTTP/1.1 200"), True)
+        check("other admin names are not endpoints",
+              status(admin_port, b"/_admin/metricsx").startswith("HTTP/1.0 404"), True)
+        # Behind a proxy on the same host everyone is a loopback peer.
+        check("not on the main listener, even from loopback",
+              status(port, b"/_admin/metrics").startswith("HTTP/1.0 404"), True)
+
+        print("profiling")
+        check("bad duration is refused",
+              status(admin_port, b"/_admin/profile?seconds=0").startswith("HTTP/1.1 400"), True)
+        check("bad rate is refused",
+              status(admin_port, b"/_admin/profile?seconds=1&hz=x").startswith("HTTP/1.1 400"), True)
+        served_meanwhile = []
+        stop_load = threading.Event()
+
+        def keep_serving():
+            while not stop_load.is_set():
+                served_meanwhile.append(body(port, b"/index.html") == b"ROOT-INDEX\n")
+
+        load = threading.Thread(target=keep_serving)
+        load.start()
+        profile = {}
+        taking = threading.Thread(
+            target=lambda: profile.update(got=request(admin_port, b"/_admin/profile?seconds=1&hz=997")))
+        taking.start()
+        time.sleep(0.3)
+        check("one profile at a time",
+              status(admin_port, b"/_admin/profile?seconds=1").startswith("HTTP/1.1 409"), True)
+        taking.join()
+        stop_load.set()
+        load.join()
+        got = profile.get("got", b"")
+        check("profile is served", got.startswith(b"HTTP/1.1 200"), True)
+        stacks = got.split(b"\r\n\r\n", 1)[1].decode("latin-1").splitlines() if b"\r\n\r\n" in got else []
+        check("as folded stacks",
+              bool(stacks) and all(len(line.rsplit(" ", 1)) == 2 and line.rsplit(" ", 1)[1].isdigit()
+                                   for line in stacks), True)
+        check("naming the server's functions", any("on_read" in line for line in stacks), True)
+        check("while it carries on serving",
+              bool(served_meanwhile) and all(served_meanwhile), True)
+        # A whole second between samples.
+        check("profile at 1 Hz",
+              request(admin_port, b"/_admin/profile?seconds=1&hz=1").startswith(b"HTTP/1.1 200"), True)
+
+        print("raw target cache")
+
+        def target_cache_hits():
+            for line in request(admin_port, b"/_admin/metrics").split(b"\n"):
+                if line.startswith(b"http_server_target_cache_hits_total "):
+                    return int(line.split()[1])
+            return -1
+
+        with open(os.path.join(root, "front.txt"), "w") as f:
+            f.write("FRONT-1\n")
+        body(port, b"/front.txt")
+        hits = target_cache_hits()
+        check("repeat target is served", body(port, b"/front.txt"), b"FRONT-1\n")
+        check("repeat target skips resolution", target_cache_hits(), hits + 1)
+        check("other spelling is resolved", body(port, b"/./front.txt"), b"FRONT-1\n")
+        check("other spelling is a target of its own", target_cache_hits(), hits + 1)
+        with open(os.path.join(root, "front.txt"), "w") as f:
+            f.write("FRONT-TWO\n")
+        time.sleep(1.2)
+        check("change is seen through it", body(port, b"/front.txt"), b"FRONT-TWO\n")
+        os.remove(os.path.join(root, "front.txt"))
+        time.sleep(1.2)
+        check("removal is seen through it",
+              status(port, b"/front.txt").startswith("HTTP/1.0 404"), True)
+
+        print("missing paths")
+
+        def missing_hits():
+            for line in request(admin_port, b"/_admin/metrics").split(b"\n"):
+                if line.startswith(b"http_server_missing_path_hits_total "):
+                    return int(line.split()[1])
+            return -1
+
+        check("missing file", status(port, b"/ghost.txt").startswith("HTTP/1.0 404"), True)
+        hits = missing_hits()
+        check("missing again", status(port, b"/ghost.txt").startswith("HTTP/1.0 404"), True)
+        check("repeat miss skips the open", missing_hits(), hits + 1)
+        with open(os.path.join(root, "ghost.txt"), "w") as f:
+            f.write("GHOST\n")
+
+        def eventually(target, want):
+            # Well inside CACHE_REVALIDATE_MS, so only the watch can have told
+            # the server; the wait is for the event to be delivered.
+            for _ in range(20):
+                got = body(port, target)
+                if got == want:
+                    break
+                time.sleep(0.02)
+            return got
+
+        check("file appearing is seen at once", eventually(b"/ghost.txt", b"GHOST\n"), b"GHOST\n")
+        check("missing below a missing directory",
+              status(port, b"/haunt/ed/ghost.txt").startswith("HTTP/1.0 404"), True)
+        status(port, b"/haunt/ed/ghost.txt")
+        os.makedirs(os.path.join(root, "haunt", "ed"))
+        with open(os.path.join(root, "haunt", "ed", "ghost.txt"), "w") as f:
+            f.write("DEEP-GHOST\n")
+        check("directories appearing are seen at once",
+              eventually(b"/haunt/ed/ghost.txt", b"DEEP-GHOST\n"), b"DEEP-GHOST\n")
+        check("missing below a file",
+              status(port, b"/ghost.txt/x").startswith("HTTP/1.0 404"), True)
+        os.remove(os.path.join(root, "ghost.txt"))
+        time.sleep(1.2)
+        check("removal is seen", status(port, b"/ghost.txt").startswith("HTTP/1.0 404"), True)
+        # The watched directory itself goes, so the watch cannot be set again
+        # while an entry still depends on it.
+        os.makedirs(os.path.join(root, "doomed"))
+        status(port, b"/doomed/x")
+        os.rmdir(os.path.join(root, "doomed"))
+        time.sleep(0.1)
+        status(port, b"/doomed/y")
+        check("miss under a removed watched directory",
+              status(port, b"/doomed/x").startswith("HTTP/1.0 404"), True)
+        # More watched directories than MISSING_WATCH_MAX: new ones still get a
+        # watch rather than waiting out CACHE_REVALIDATE_MS.
+        for i in range(70):
+            os.makedirs(os.path.join(root, "many", str(i)))
+            status(port, b"/many/%d/x" % i)
+        os.makedirs(os.path.join(root, "many", "last"))
+        status(port, b"/many/last/ghost.txt")
+        with open(os.path.join(root, "many", "last", "ghost.txt"), "w") as f:
+            f.write("LAST-GHOST\n")
+        check("watched past the limit",
+              eventually(b"/many/last/ghost.txt", b"LAST-GHOST\n"), b"LAST-GHOST\n")
+
+        print("large files held open")
+
+        def open_files():
+            for line in request(admin_port, b"/_admin/metrics").split(b"\n"):
+                if line.startswith(b"http_server_open_files "):
+                    return int(line.split()[1])
+            return -1
+
+        # Random bytes, so a read from the wrong offset cannot go unnoticed.
+        large = os.urandom(1536 * 1024)
+        with open(os.path.join(root, "large.bin"), "wb") as f:
+            f.write(large)
+        held = open_files()
+        check("first download", body(port, b"/large.bin") == large, True)
+        check("descriptor is kept", open_files(), held + 1)
+        check("repeat download", body(port, b"/large.bin") == large, True)
+        check("one descriptor for repeats", open_files(), held + 1)
+        got = []
+        threads = [threading.Thread(target=lambda: got.append(body(port, b"/large.bin")))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        check("concurrent downloads share it", got == [large] * 4, True)
+        check("HEAD from it", request(port, b"/large.bin", b"HEAD").endswith(b"\r\n\r\n"), True)
+        # Same size, and the mtime set back, so only the inode tells it apart.
+        replaced = os.urandom(len(large))
+        with open(os.path.join(root, "large.new"), "wb") as f:
+            f.write(replaced)
+        st = os.stat(os.path.join(root, "large.bin"))
+        os.utime(os.path.join(root, "large.new"), (st.st_atime, st.st_mtime))
+        os.replace(os.path.join(root, "large.new"), os.path.join(root, "large.bin"))
+        time.sleep(1.2)
+        check("replacement is seen", body(port, b"/large.bin") == replaced, True)
+        os.remove(os.path.join(root, "large.bin"))
+        time.sleep(1.2)
+        check("removal is seen",
+              status(port, b"/large.bin").startswith("HTTP/1.0 404"), True)
+        check("its descriptor is closed", open_files(), held)
+
+        print("shedding load")
+        # With a shedding threshold of zero lag every request counts as late,
+        # while the pause threshold is out of reach.
+        shed_port = free_port()
+        shed_admin_port = free_port()
+        shed_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(shed_port), "-d", root,
+             "-L", "60000,0", "-A", "/_admin", "-M", str(shed_admin_port)],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(shed_proc, shed_port):
+                shed = request(shed_port, b"/index.html")
+                check("late request is 503", shed.split(b"\r\n", 1)[0],
+                      b"HTTP/1.0 503 Service Unavailable")
+                check("503 says when to retry", b"\r\nRetry-After: 1\r\n" in shed, True)
+                metrics = request(shed_admin_port, b"/_admin/metrics")
+                check("metrics are not shed", metrics.startswith(b"HTTP/1.1 200"), True)
+                check("shed request is counted",
+                      b"\nhttp_server_requests_shed_total 1\n" in metrics, True)
+                for _ in range(3):
+                    s = socket.socket()
+                    s.settimeout(2)
+                    s.connect(("127.0.0.1", shed_port))
+                    s.sendall(b"GET / HTTP/1.1\r\nHost: x\r\n\r\n")
+                    s.close()
+                time.sleep(0.2)
+                check("alive after shedding", shed_proc.poll(), None)
+            else:
+                check("shedding server started", False, True)
+        finally:
+            shed_proc.terminate()
+            try:
+                shed_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                shed_proc.kill()
+
+        print("connection cap")
+
+        def cap_server(*extra):
+            cap_port = free_port()
+            cap_proc = subprocess.Popen(
+                [binary, "-a", "127.0.0.1", "-p", str(cap_port), "-d", root] + list(extra),
+                stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+            if not wait_until_listening(cap_proc, cap_port):
+                check("capped server started", False, True)
+            time.sleep(0.2)
+            return cap_proc, cap_port
+
+        def over_cap(cap_port, idle):
+            """Requests over a full cap, frees a slot, and returns what was
+            answered before and after that."""
+            s = socket.socket()
+            s.settimeout(0.5)
+            s.connect(("127.0.0.1", cap_port))
+            s.sendall(b"GET /index.html HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+            try:
+                early = s.recv(65536)
+            except socket.timeout:
+                early = b""
+            idle.pop().close()
+            s.settimeout(5)
+            data = early
+            try:
+                while True:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            except socket.timeout:
+                pass
+            s.close()
+            return early, data
+
+        # Without -A or -L nothing samples the lag, so only a connection
+        # closing can start the listener again.
+        cap_proc, cap_port = cap_server("-C", "2")
+        idle = []
+        try:
+            for _ in range(2):
+                c = socket.socket()
+                c.connect(("127.0.0.1", cap_port))
+                idle.append(c)
+            time.sleep(0.2)
+            # The kernel completes the handshake, but the server leaves the
+            # connection in the backlog until one of the others goes.
+            early, data = over_cap(cap_port, idle)
+            check("over the cap is not served", early, b"")
+            check("served once a connection closes", data.startswith(b"HTTP/1.1 200 OK"), True)
+            for c in idle:
+                c.close()
+            time.sleep(0.2)
+            check("still serving under the cap", body(cap_port, b"/index.html"), b"ROOT-INDEX\n")
+        finally:
+            for c in idle:
+                c.close()
+            cap_proc.terminate()
+            cap_proc.wait(timeout=5)
+
+        cap_admin_port = free_port()
+        cap_proc, cap_port = cap_server("-C", "1", "-A", "/_admin", "-M", str(cap_admin_port))
+        idle = []
+        try:
+            c = socket.socket()
+            c.connect(("127.0.0.1", cap_port))
+            idle.append(c)
+            time.sleep(0.2)
+            over_cap(cap_port, idle)
+            time.sleep(0.2)
+            metrics = request(cap_admin_port, b"/_admin/metrics")
+            check("deferral is counted",
+                  b"\nhttp_server_accepts_deferred_total 0\n" not in metrics
+                  and b"\nhttp_server_accepts_deferred_total " in metrics, True)
+            check("open connections", b"\nhttp_server_connections 1\n" in metrics, True)
+        finally:
+            cap_proc.terminate()
+            cap_proc.wait(timeout=5)
+
+        print("socket tuning")
+        tuned_port = free_port()
+        tuned_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(tuned_port), "-d", root,
+             "-S", "backlog=16", "-S", "defer-accept=1", "-S", "fastopen=16",
+             "-S", "rcvbuf=65536", "-S", "sndbuf=65536", "-S", "cork"],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(tuned_proc, tuned_port):
+                check("small file", body(tuned_port, b"/index.html"), b"ROOT-INDEX\n")
+                check("corked streamed file",
+                      body(tuned_port, b"/big.bin") == b"X" * (2 * 1024 * 1024), True)
+                check("corked HEAD", request(tuned_port, b"/big.bin", b"HEAD").endswith(b"\r\n\r\n"),
+                      True)
+                # A HEAD never writes a body chunk, so it has to uncork on its
+                # own; a header left corked sits in the kernel for 200ms.
+                s = socket.socket()
+                s.settimeout(5)
+                s.connect(("127.0.0.1", tuned_port))
+                data = b""
+                started = time.time()
+                for n in range(3):
+                    s.sendall(b"HEAD /big.bin HTTP/1.1\r\nHost: x\r\n\r\n")
+                    while data.count(b"\r\n\r\n") < n + 1:
+                        data += s.recv(65536)
+                s.close()
+                check("keep-alive after a corked HEAD", data.count(b"HTTP/1.1 200 OK"), 3)
+                check("HEAD is not held corked", time.time() - started < 0.5, True)
+            else:
+                check("tuned server started", False, True)
+        finally:
+            tuned_proc.terminate()
+            try:
+                tuned_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                tuned_proc.kill()
+
+        print("write scheduling")
+
+        def metric(metrics_port, name):
+            for line in request(metrics_port, b"/_admin/metrics").split(b"\n"):
+                if line.startswith(name + b" "):
+                    return int(line.split()[1])
+            return -1
+
+        # Cached, and far bigger than the default quota of 64 KiB.
+        sliced = os.urandom(900 * 1024)
+        with open(os.path.join(root, "sliced.bin"), "wb") as f:
+            f.write(sliced)
+        slices = metric(admin_port, b"http_server_write_slices_total")
+        s = socket.socket()
+        s.settimeout(5)
+        s.connect(("127.0.0.1", port))
+        bodies = []
+        data = b""
+        for _ in range(2):
+            s.sendall(b"GET /sliced.bin HTTP/1.1\r\nHost: x\r\n\r\n")
+            while b"\r\n\r\n" not in data or len(data.split(b"\r\n\r\n", 1)[1]) < len(sliced):
+                chunk = s.recv(262144)
+                if not chunk:
+                    break
+                data += chunk
+            head, rest = data.split(b"\r\n\r\n", 1) if b"\r\n\r\n" in data else (data, b"")
+            bodies.append(rest[:len(sliced)])
+            data = rest[len(sliced):]
+        s.close()
+        check("sliced responses on one connection", bodies == [sliced, sliced], True)
+        check("sent in slices", metric(admin_port, b"http_server_write_slices_total") - slices >= 2 * 14, True)
+        # The next request sent the moment the last slice of a response
+        # arrives, which libuv can see before that write completes.
+        s = socket.create_connection(("127.0.0.1", port))
+        s.settimeout(5)
+        served = 0
+        try:
+            for _ in range(20):
+                s.sendall(b"GET /sliced.bin HTTP/1.1\r\nHost: x\r\n\r\n")
+                data = b""
+                while len(data.split(b"\r\n\r\n", 1)[-1]) < len(sliced):
+                    chunk = s.recv(262144)
+                    if not chunk:
+                        raise OSError("closed")
+                    data += chunk
+                served += 1
+        except OSError:
+            pass
+        s.close()
+        check("requests right after a sliced response", served, 20)
+
+        whole_port = free_port()
+        whole_admin_port = free_port()
+        whole_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(whole_port), "-d", root,
+             "-A", "/_admin", "-M", str(whole_admin_port)],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(whole_proc, whole_port):
+                check("whole response without -W", body(whole_port, b"/sliced.bin") == sliced, True)
+                check("not sliced without -W", metric(whole_admin_port, b"http_server_write_slices_total"), 0)
+            else:
+                check("server without -W started", False, True)
+        finally:
+            whole_proc.terminate()
+            try:
+                whole_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                whole_proc.kill()
+
+        capped_port = free_port()
+        capped_admin_port = free_port()
+        capped_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(capped_port), "-d", root,
+             "-W", "4096,200000", "-A", "/_admin", "-M", str(capped_admin_port)],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(capped_proc, capped_port):
+                got = []
+                started = time.time()
+                t = threading.Thread(target=lambda: got.append(body(capped_port, b"/sliced.bin")))
+                t.start()
+                time.sleep(0.2)
+                small_started = time.time()
+                check("small file while capped", body(capped_port, b"/index.html"), b"ROOT-INDEX\n")
+                check("small file is not held up", time.time() - small_started < 0.5, True)
+                t.join()
+                elapsed = time.time() - started
+                check("capped download is whole", got == [sliced], True)
+                # 900 KiB at 200 kB/s, less the first allowance.
+                check("capped download is held to its rate", 3.5 < elapsed < 8, True)
+                check("waits are counted",
+                      metric(capped_admin_port, b"http_server_writes_throttled_total") > 0, True)
+            else:
+                check("capped server started", False, True)
+        finally:
+            capped_proc.terminate()
+            try:
+                capped_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                capped_proc.kill()
+
+        print("unix domain socket")
+
+        def unix_request(address, raw):
+            s = socket.socket(socket.AF_UNIX)
+            s.settimeout(5)
+            try:
+                s.connect(address)
+                s.sendall(raw)
+                data = b""
+                while True:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+                return data
+            finally:
+                s.close()
+
+        sock_path = os.path.join(tmp, "http.sock")
+        # A stale socket file, as a killed server leaves behind.
+        stale = socket.socket(socket.AF_UNIX)
+        stale.bind(sock_path)
+        stale.close()
+        unix_port = free_port()
+        admin_sock_path = os.path.join(tmp, "admin.sock")
+        unix_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(unix_port), "-d", root, "-u", sock_path,
+             "-A", "/_admin", "-M", admin_sock_path],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(unix_proc, unix_port):
+                got = unix_request(sock_path, b"GET /index.html HTTP/1.1\r\nHost: x\r\n"
+                                              b"Connection: close\r\n\r\n")
+                check("served over the socket", got.split(b"\r\n\r\n", 1)[-1], b"ROOT-INDEX\n")
+                check("and over TCP alongside it", body(unix_port, b"/index.html"), b"ROOT-INDEX\n")
+                got = unix_request(sock_path, b"GET /big.bin HTTP/1.1\r\nHost: x\r\n"
+                                              b"Connection: close\r\n\r\n")
+                check("streamed over the socket",
+                      got.split(b"\r\n\r\n", 1)[-1] == b"X" * (2 * 1024 * 1024), True)
+                got = unix_request(sock_path, b"GET /_admin/metrics HTTP/1.1\r\nHost: x\r\n"
+                                              b"Connection: close\r\n\r\n")
+                check("no admin endpoints over the socket", got.startswith(b"HTTP/1.0 404"), True)
+                got = unix_request(admin_sock_path, b"GET /_admin/metrics HTTP/1.1\r\nHost: x\r\n"
+                                                    b"Connection: close\r\n\r\n")
+                check("admin endpoints over the admin socket", got.startswith(b"HTTP/1.1 200"), True)
+                s = socket.socket(socket.AF_UNIX)
+                s.settimeout(5)
+                s.connect(sock_path)
+                s.sendall(b"GET /index.html HTTP/1.1\r\nHost: x\r\n\r\n")
+                first = s.recv(65536)
+                s.sendall(b"GET /sub/ HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n")
+                second = b""
+                while True:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    second += chunk
+                s.close()
+                check("keep-alive over the socket",
+                      (first.endswith(b"ROOT-INDEX\n"), second.endswith(b"SUB-INDEX\n")), (True, True))
+            else:
+                check("socket server started", False, True)
+        finally:
+            unix_proc.send_signal(signal.SIGINT)
+            try:
+                unix_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                unix_proc.kill()
+        check("socket file removed on exit", os.path.exists(sock_path), False)
+
+        if sys.platform.startswith("linux"):
+            name = "\0http-server-smoke-%d" % os.getpid()
+            abstract_proc = subprocess.Popen(
+                [binary, "-d", root, "-u", "@" + name[1:]],
+                stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+            try:
+                got = b""
+                deadline = time.time() + 15
+                while time.time() < deadline and abstract_proc.poll() is None:
+                    try:
+                        got = unix_request(name, b"GET /sub/f.txt HTTP/1.1\r\nHost: x\r\n"
+                                                 b"Connection: close\r\n\r\n")
+                        break
+                    except OSError:
+                        time.sleep(0.1)
+                check("abstract socket", got.split(b"\r\n\r\n", 1)[-1], b"SUBFILE\n")
+            finally:
+                abstract_proc.terminate()
+                try:
+                    abstract_proc.wait(timeout=5)
+                except subprocess.TimeoutExpired:
+                    abstract_proc.kill()
+
+        print("request trace")
+        trace_path = os.path.join(tmp, "requests.tsv")
+        traced_port = free_port()
+        traced_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(traced_port), "-d", root, "-t", trace_path],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(traced_proc, traced_port):
+                status(traced_port, b"/index.html")
+                status(traced_port, b"/nope?x=1")
+                status(traced_port, b"/sub/f.txt", method=b"HEAD")
+                status(traced_port, b"/a%20b?q")
+                # Written through a buffer flushed every second.
+                time.sleep(1.5)
+                with open(trace_path) as f:
+                    lines = f.read().splitlines()
+                check("trace header", lines[0], "# usec\tstatus\tbytes\tmethod\ttarget")
+                rows = [line.split("\t") for line in lines[1:]]
+                check("a line per request", len(rows), 4)
+                check("statuses and targets", [(r[1], r[3], r[4]) for r in rows[:4]],
+                      [("200", "GET", "/index.html"), ("404", "GET", "/nope?x=1"),
+                       ("200", "HEAD", "/sub/f.txt"), ("404", "GET", "/a%20b?q")])
+                check("bytes include the header", int(rows[0][2]) > len(b"ROOT-INDEX\n"), True)
+                check("times go forward",
+                      all(int(a[0]) <= int(b[0]) for a, b in zip(rows, rows[1:])), True)
+            else:
+                check("traced server started", False, True)
+        finally:
+            traced_proc.send_signal(signal.SIGINT)
+            try:
+                traced_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                traced_proc.kill()
+
+        print("streaming past the page cache")
+        # Not a whole number of blocks, so the last O_DIRECT read is short.
+        odd = os.urandom(1536 * 1024 + 3)
+        with open(os.path.join(root, "odd.bin"), "wb") as f:
+            f.write(odd)
+        for quota in ("65536", "0", "4096,4000000"):
+            uncached_port = free_port()
+            uncached_admin_port = free_port()
+            uncached_proc = subprocess.Popen(
+                [binary, "-a", "127.0.0.1", "-p", str(uncached_port), "-d", root,
+                 "-D", str(1024 * 1024), "-W", quota, "-A", "/_admin", "-M", str(uncached_admin_port)],
+                stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+            try:
+                if wait_until_listening(uncached_proc, uncached_port):
+                    got = exchange_on_one_connection([
+                        b"GET /odd.bin HTTP/1.1\r\nHost: x\r\n\r\n",
+                        b"GET /big.bin HTTP/1.1\r\nHost: x\r\n\r\n",
+                        b"GET /odd.bin HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n"],
+                        uncached_port)
+                    check(f"-W {quota}: whole files, kept alive",
+                          [g[1] == want for g, want in zip(got, (odd, b"X" * (2 * 1024 * 1024), odd))],
+                          [True] * 3)
+                    check(f"-W {quota}: HEAD", status(uncached_port, b"/odd.bin", method=b"HEAD"),
+                          "HTTP/1.1 200 OK")
+                    check(f"-W {quota}: cached files as usual", body(uncached_port, b"/index.html"),
+                          b"ROOT-INDEX\n")
+                    # O_DIRECT where the file system takes it, dropped pages
+                    # where it does not.
+                    bypassed = (metric(uncached_admin_port, b"http_server_direct_read_bytes_total") +
+                                metric(uncached_admin_port, b"http_server_dropped_cache_bytes_total"))
+                    check(f"-W {quota}: every byte bypassed", bypassed, 2 * len(odd) + 2 * 1024 * 1024)
+                else:
+                    check("uncached server started", False, True)
+            finally:
+                uncached_proc.terminate()
+                try:
+                    uncached_proc.wait(timeout=5)
+                except subprocess.TimeoutExpired:
+                    uncached_proc.kill()
+        # Reads of whole blocks under a rate too low for a block per throttle
+        # wait: they must not get ahead of the cap.
+        uncached_port = free_port()
+        uncached_proc = subprocess.Popen(
+            [binary, "-a", "127.0.0.1", "-p", str(uncached_port), "-d", root,
+             "-D", str(1024 * 1024), "-W", "65536,400000"],
+            stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+        try:
+            if wait_until_listening(uncached_proc, uncached_port):
+                started = time.time()
+                check("capped uncached download is whole", body(uncached_port, b"/odd.bin") == odd, True)
+                # 1.5 MiB at 400 kB/s, less the first allowance.
+                check("capped uncached download is held to its rate",
+                      3 < time.time() - started < 8, True)
+            else:
+                check("uncached server started", False, True)
+        finally:
+            uncached_proc.terminate()
+            try:
+                uncached_proc.wait(timeout=5)
+            except subprocess.TimeoutExpired:
+                uncached_proc.kill()
+
+        if sys.platform.startswith("linux"):
+            print("TCP_INFO sampling")
+            check("no histograms without -T",
+                  b"http_server_tcp_rtt_seconds" in request(admin_port, b"/_admin/metrics"), False)
+            sampled_port = free_port()
+            sampled_admin_port = free_port()
+            sampled_proc = subprocess.Popen(
+                [binary, "-a", "127.0.0.1", "-p", str(sampled_port), "-d", root,
+                 "-T", "1", "-A", "/_admin", "-M", str(sampled_admin_port)],
+                stdout=log, stderr=subprocess.STDOUT, cwd=tmp)
+            try:
+                if wait_until_listening(sampled_proc, sampled_port):
+                    for _ in range(3):
+                        body(sampled_port, b"/index.html")
+                    streamed = body(sampled_port, b"/big.bin")
+                    check("streamed while sampled", streamed == b"X" * (2 * 1024 * 1024), True)
+                    text = request(sampled_admin_port, b"/_admin/metrics").decode()
+                    samples = {}
+                    for line in text.splitlines():
+                        if line.startswith("http_server_tcp_"):
+                            name, value = line.rsplit(" ", 1)
+                            samples[name] = float(value)
+                    rtt = "http_server_tcp_rtt_seconds"
+                    check("small responses counted", samples.get(rtt + '_count{size="<16k"}'), 3.0)
+                    check("by size class", samples.get(rtt + '_count{size="<4m"}'), 1.0)
+                    check("+Inf bucket is the count",
+                          samples.get(rtt + '_bucket{size="<16k",le="+Inf"}'), 3.0)
+                    buckets = [v for k, v in samples.items() if k.startswith(rtt + '_bucket{size="<16k"')]
+                    check("buckets are cumulative", buckets == sorted(buckets), True)
+                    check("loopback RTT is under a second",
+                          samples.get(rtt + '_bucket{size="<16k",le="1.000000"}'), 3.0)
+                    check("congestion window sampled",
+                          samples.get('http_server_tcp_cwnd_segments_count{size="<4m"}'), 1.0)
+                    check("every metric present",
+                          all(any(k.startswith(name) for k in samples) for name in (
+                              rtt, "http_server_tcp_rttvar_seconds", "http_server_tcp_retransmitted_segments",
+                              "http_server_tcp_delivery_rate_bytes", "http_server_tcp_cwnd_segments")), True)
+                else:
+                    check("sampling server started", False, True)
+            finally:
+                sampled_proc.terminate()
+                try:
+                    sampled_proc.wait(timeout=5)
+                except subprocess.TimeoutExpired:
+                    sampled_proc.kill()
+
         print("still alive")
         check("server survived", proc.poll(), None)
         check("serves after all of the above", body(port, b"/index.html"), b"ROOT-INDEX\n")
@@ -0,0 +1,62 @@
+/* Copyright 2014 by Yasuhiro Matsumoto
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/* Static tracepoints (USDT), provider "http_server".  With <sys/sdt.h> each one
+ * is a single nop plus an ELF note describing where its arguments live, so an
+ * unattached probe costs next to nothing; without it they compile away.
+ *
+ *   conn__accept      (conn_id)
+ *   conn__close       (conn_id)
+ *   request__head     (conn_id, target, target_len, head_len)
+ *   request__resolved (conn_id, file_path)
+ *   request__shed     (conn_id)
+ *   cache__hit        (conn_id, path, body_len)  also fired by target cache
+ *                                              hits, which skip resolution
+ *   cache__miss       (conn_id, path)
+ *   cache__reload     (conn_id, path)       cached copy was stale and dropped
+ *   cache__load       (conn_id, path, body_len)
+ *   file__reuse       (conn_id, path, size)  large file streamed from a
+ *                                            descriptor already open
+ *   write__start      (conn_id, total_len)
+ *   write__partial    (conn_id, done, total_len)  the rest goes to uv_write
+ *   write__complete   (conn_id, total_len)
+ *
+ * target is not NUL terminated.  The scripts in trace/ turn these into
+ * per-phase latency histograms. */
+
+#ifdef HAVE_SYS_SDT_H
+# include <sys/sdt.h>
+# define TRACE1(name, a) DTRACE_PROBE1(http_server, name, a)
+# define TRACE2(name, a, b) DTRACE_PROBE2(http_server, name, a, b)
+# define TRACE3(name, a, b, c) DTRACE_PROBE3(http_server, name, a, b, c)
+# define TRACE4(name, a, b, c, d) DTRACE_PROBE4(http_server, name, a, b, c, d)
+#else
+# define TRACE1(name, a) do { } while (0)
+# define TRACE2(name, a, b) do { } while (0)
+# define TRACE3(name, a, b, c) do { } while (0)
+# define TRACE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif